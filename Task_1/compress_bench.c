@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <string.h>
+
+#include "payload_stream.h"
+
+#define DEFAULT_INTERFACE "127.0.0.1"
+#define DEFAULT_SIZE_MB 16
+#define WRITE_LEN 16384
+
+/**
+ * @brief payload stream throughput with and without
+ * compression, for text and for random bytes, over
+ * links of several speeds. the link is paced in user
+ * space on both directions, 0 leaves it unpaced
+ *
+ * > gcc -O2 -DUSE_ZLIB compress_bench.c payload_stream.c -o compress_bench -lz
+ * > ./compress_bench PORT [ADDRESS SIZE_MB LINK_MB_PER_S]
+ */
+
+// one direction of the emulated link
+typedef struct pacedLink
+{
+    double rate; // bytes per second, 0 is unpaced
+    double bytes;
+    struct timespec start;
+} pacedLink;
+
+typedef struct connection
+{
+    int socketFD;
+    pacedLink up;
+    pacedLink down;
+} connection;
+
+static const char *WORDS[] = {
+    "the", "server", "reverses", "every", "string", "it", "is", "sent", "and", "a",
+    "client", "waits", "for", "answer", "of", "payload", "text", "with", "many", "words",
+    "network", "bytes", "chunk", "frame", "stream", "compression", "throughput", "link",
+};
+
+static double elapsedS(struct timespec start, struct timespec end)
+{
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static void pace(pacedLink *l, int len)
+{
+    /**
+     * @brief sleep until the link would have carried len more bytes
+     */
+
+    if (!l->rate)
+        return;
+
+    if (!l->bytes)
+        clock_gettime(CLOCK_MONOTONIC, &l->start);
+    l->bytes += len;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    double ahead = l->bytes / l->rate - elapsedS(l->start, now);
+    if (ahead > 0)
+        usleep(ahead * 1e6);
+}
+
+static int pacedRecv(void *io, char *buffer, int len)
+{
+    connection *c = (connection *)io;
+    int valread = recv(c->socketFD, buffer, len, 0);
+
+    if (valread > 0)
+        pace(&c->down, valread);
+
+    return valread;
+}
+
+static int pacedSend(void *io, char *buffer, int len)
+{
+    connection *c = (connection *)io;
+    int sent = send(c->socketFD, buffer, len, MSG_NOSIGNAL);
+
+    if (sent > 0)
+        pace(&c->up, sent);
+
+    return sent;
+}
+
+static void fillText(char *data, int size)
+{
+    unsigned int seed = 1;
+
+    for (int i = 0; i < size;)
+    {
+        seed = seed * 1103515245 + 12345;
+        const char *word = WORDS[(seed >> 16) % (sizeof(WORDS) / sizeof(WORDS[0]))];
+
+        for (int j = 0; word[j] && i < size; j++)
+            data[i++] = word[j];
+        if (i < size)
+            data[i++] = (seed >> 8) % 12 ? ' ' : '\n';
+    }
+}
+
+static void fillRandom(char *data, int size)
+{
+    unsigned long state = 88172645463325252UL;
+
+    for (int i = 0; i < size; i++)
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        data[i] = state;
+    }
+}
+
+static int reverseRemote(const struct sockaddr_in *address, int codec, double rate,
+                         const char *data, int size, char *result, unsigned long *wire)
+{
+    /**
+     * @brief one payload stream to the server, offering
+     * only codec
+     *
+     * @return -2 if the server chose another codec, -1 if it failed
+     */
+
+    connection c = {0};
+    c.up.rate = c.down.rate = rate;
+    c.socketFD = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (connect(c.socketFD, (struct sockaddr *)address, sizeof(*address)) < 0)
+    {
+        close(c.socketFD);
+        return -1;
+    }
+
+    char hello[STREAM_HELLO_LEN];
+    memcpy(hello, STREAM_MAGIC, STREAM_MAGIC_LEN);
+    hello[STREAM_MAGIC_LEN] = STREAM_VERSION;
+    hello[STREAM_MAGIC_LEN + 1] = 1 << codec;
+
+    int length = 0;
+    if (send(c.socketFD, hello, STREAM_HELLO_LEN, MSG_NOSIGNAL) == STREAM_HELLO_LEN)
+    {
+        while (length < STREAM_HELLO_LEN)
+        {
+            int valread = recv(c.socketFD, hello + length, STREAM_HELLO_LEN - length, 0);
+            if (valread <= 0)
+                break;
+            length += valread;
+        }
+    }
+
+    // a server built without zlib answers with identity
+    if (length == STREAM_HELLO_LEN && hello[STREAM_MAGIC_LEN + 1] != codec)
+    {
+        close(c.socketFD);
+        return -2;
+    }
+
+    payloadStream *stream = length == STREAM_HELLO_LEN ? streamOpen(codec, pacedRecv, pacedSend, &c) : NULL;
+    if (!stream)
+    {
+        close(c.socketFD);
+        return -1;
+    }
+
+    int ret = 0;
+    for (int i = 0; i < size && ret != -1; i += WRITE_LEN)
+        ret = streamWrite(stream, data + i, size - i < WRITE_LEN ? size - i : WRITE_LEN);
+    if (ret != -1)
+        ret = streamFinish(stream);
+
+    int received = 0;
+    while (ret != -1)
+    {
+        int valread = streamRead(stream, result + received, size + 1 - received);
+        if (valread <= 0)
+        {
+            ret = valread;
+            break;
+        }
+        received += valread;
+
+        if (received > size)
+            ret = -1;
+    }
+
+    *wire = streamWireBytes(stream);
+    streamClose(stream);
+    close(c.socketFD);
+
+    return ret == -1 || received != size ? -1 : 0;
+}
+
+static void run(const struct sockaddr_in *address, const char *name, int codec, double rate,
+                const char *data, const char *expected, int size, char *result)
+{
+    struct timespec start, end;
+    unsigned long wire = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int failed = reverseRemote(address, codec, rate, data, size, result, &wire);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    char linkName[32] = "unpaced";
+    if (rate)
+        snprintf(linkName, sizeof(linkName), "%g MB/s", rate / 1e6);
+
+    if (failed || memcmp(result, expected, size))
+    {
+        fprintf(stdout, "%-6s %-8s link %-10s: %s\n", name,
+                codec == STREAM_DEFLATE ? "deflate" : "identity", linkName,
+                failed == -2 ? "not supported by the server" : "failed");
+        return;
+    }
+
+    fprintf(stdout, "%-6s %-8s link %-10s: %8.1f MB/s  wire %7.1f MB (%3.0f%%)\n", name,
+            codec == STREAM_DEFLATE ? "deflate" : "identity", linkName,
+            size / elapsedS(start, end) / 1e6, wire / 1e6, 100.0 * wire / (2.0 * size));
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s PORT [ADDRESS SIZE_MB LINK_MB_PER_S]\n", argv[0]);
+        return 1;
+    }
+
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = inet_addr(argc > 2 ? argv[2] : DEFAULT_INTERFACE);
+    address.sin_port = htons(atoi(argv[1]));
+
+    int size = (argc > 3 ? atoi(argv[3]) : DEFAULT_SIZE_MB) << 20;
+    if (size <= 0 || size > STREAM_MAX_PAYLOAD)
+    {
+        fprintf(stderr, "Error: SIZE_MB must be between 1 and %d\n", STREAM_MAX_PAYLOAD >> 20);
+        return EINVAL;
+    }
+
+    // without a link speed, a sweep from loopback down to a slow wan
+    double rates[] = {0, 1000e6, 100e6, 10e6};
+    int numRates = sizeof(rates) / sizeof(rates[0]);
+    if (argc > 4)
+    {
+        rates[0] = atof(argv[4]) * 1e6;
+        numRates = 1;
+    }
+
+    if (!streamSupported(STREAM_DEFLATE))
+        fprintf(stderr, "Built without zlib, compile with -DUSE_ZLIB -lz to compare deflate\n");
+
+    char *data = (char *)malloc(size);
+    char *expected = (char *)malloc(size);
+    char *result = (char *)malloc(size + 1);
+
+    for (int input = 0; input < 2; input++)
+    {
+        const char *name = input ? "random" : "text";
+        if (input)
+            fillRandom(data, size);
+        else
+            fillText(data, size);
+
+        for (int i = 0; i < size; i++)
+            expected[i] = data[size - 1 - i];
+
+        for (int r = 0; r < numRates; r++)
+        {
+            run(&address, name, STREAM_IDENTITY, rates[r], data, expected, size, result);
+            if (streamSupported(STREAM_DEFLATE))
+                run(&address, name, STREAM_DEFLATE, rates[r], data, expected, size, result);
+        }
+    }
+
+    free(data);
+    free(expected);
+    free(result);
+
+    return 0;
+}
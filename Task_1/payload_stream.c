@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "payload_stream.h"
+
+#define STREAM_HEADER_LEN 4
+#define STREAM_LEVEL 1 // fastest deflate, the link is what we save on
+#define STREAM_STORED_FRAMES 16 // frames sent stored before compressing is tried again
+
+struct payloadStream {
+    int codec;
+    streamIO recv;
+    streamIO send;
+    void *io;
+
+    // the frame being read, ended once the empty frame arrived
+    char in[STREAM_FRAME_MAX];
+    int in_len;
+    int in_pos;
+    char ended;
+
+    // the frame being written, after room for its header
+    char out[STREAM_HEADER_LEN + STREAM_FRAME_MAX];
+    int out_len;
+
+    unsigned long wire;
+
+#ifdef USE_ZLIB
+    z_stream inflater;
+    z_stream deflater;
+    char inflated; // the request's deflate stream is complete
+
+    // incompressible data goes out in stored blocks for a while
+    int level;
+    int wanted;
+    int stored;
+    unsigned long frame_in;
+#endif
+};
+
+// function declarations
+static int recvAll(payloadStream *s, char *buffer, int len);
+static int nextFrame(payloadStream *s);
+static int flushFrame(payloadStream *s);
+static int sendFrame(payloadStream *s, int len);
+
+
+// function definitions
+payloadStream *streamOpen(int codec, streamIO recv, streamIO send, void *io) {
+    /**
+     * @brief both directions of a payload stream with the
+     * negotiated codec, the hello exchange is done already
+     *
+     * @return null if the codec is not built in
+     */
+
+    if (!streamSupported(codec)) return NULL;
+
+    payloadStream *s = (payloadStream *) calloc(1, sizeof(payloadStream));
+    s->codec = codec;
+    s->recv = recv;
+    s->send = send;
+    s->io = io;
+
+#ifdef USE_ZLIB
+    // raw deflate, the frames already delimit the stream
+    if (codec == STREAM_DEFLATE &&
+        (inflateInit2(&s->inflater, -MAX_WBITS) != Z_OK ||
+         deflateInit2(&s->deflater, STREAM_LEVEL, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)) {
+        free(s);
+        return NULL;
+    }
+    s->level = s->wanted = STREAM_LEVEL;
+#endif
+
+    return s;
+}
+
+int streamRead(payloadStream *s, char *buffer, int len) {
+    /**
+     * @brief decode the next bytes of the peer's body
+     *
+     * @return the bytes put in buffer, 0 at the end
+     * of the body, -1 on a broken or invalid stream
+     */
+
+    if (s->codec == STREAM_IDENTITY) {
+        while (s->in_pos == s->in_len) {
+            if (s->ended) return 0;
+            if (nextFrame(s) == -1) return -1;
+        }
+
+        int n = len < s->in_len - s->in_pos ? len : s->in_len - s->in_pos;
+        memcpy(buffer, s->in + s->in_pos, n);
+        s->in_pos += n;
+
+        return n;
+    }
+
+#ifdef USE_ZLIB
+    if (s->ended) return 0;
+
+    s->inflater.next_out = (Bytef *) buffer;
+    s->inflater.avail_out = len;
+
+    while (s->inflater.avail_out == (uInt) len && !s->inflated) {
+        if (!s->inflater.avail_in) {
+            // the body can't end before its deflate stream
+            if (nextFrame(s) == -1 || s->ended) return -1;
+
+            s->inflater.next_in = (Bytef *) s->in;
+            s->inflater.avail_in = s->in_len;
+        }
+
+        int ret = inflate(&s->inflater, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) s->inflated = 1;
+        else if (ret != Z_OK) return -1;
+    }
+
+    int produced = len - s->inflater.avail_out;
+    if (produced) return produced;
+
+    // nothing may follow the deflate stream but the empty frame
+    if (s->inflater.avail_in || nextFrame(s) == -1 || !s->ended) return -1;
+#endif
+
+    return 0;
+}
+
+int streamWrite(payloadStream *s, const char *data, int len) {
+    /**
+     * @brief encode the next bytes of our body,
+     * full frames are sent as they fill up
+     *
+     * @return -1 if the peer is gone
+     */
+
+    if (s->codec == STREAM_IDENTITY) {
+        while (len) {
+            int n = len < STREAM_FRAME_MAX - s->out_len ? len : STREAM_FRAME_MAX - s->out_len;
+            memcpy(s->out + STREAM_HEADER_LEN + s->out_len, data, n);
+            s->out_len += n;
+            data += n;
+            len -= n;
+
+            if (s->out_len == STREAM_FRAME_MAX && flushFrame(s) == -1) return -1;
+        }
+
+        return 0;
+    }
+
+#ifdef USE_ZLIB
+    s->deflater.next_in = (Bytef *) data;
+    s->deflater.avail_in = len;
+
+    while (s->deflater.avail_in) {
+        s->deflater.next_out = (Bytef *) s->out + STREAM_HEADER_LEN + s->out_len;
+        s->deflater.avail_out = STREAM_FRAME_MAX - s->out_len;
+
+        // retried until zlib has the room to flush at the old level
+        if (s->level != s->wanted && deflateParams(&s->deflater, s->wanted, Z_DEFAULT_STRATEGY) == Z_OK) {
+            s->level = s->wanted;
+        }
+
+        deflate(&s->deflater, Z_NO_FLUSH);
+        s->out_len = STREAM_FRAME_MAX - s->deflater.avail_out;
+
+        if (s->out_len == STREAM_FRAME_MAX && flushFrame(s) == -1) return -1;
+    }
+#endif
+
+    return 0;
+}
+
+int streamFinish(payloadStream *s) {
+    /**
+     * @brief send the rest of our body and the empty frame
+     *
+     * @return -1 if the peer is gone
+     */
+
+#ifdef USE_ZLIB
+    if (s->codec == STREAM_DEFLATE) {
+        int ret = Z_OK;
+
+        while (ret != Z_STREAM_END) {
+            s->deflater.next_out = (Bytef *) s->out + STREAM_HEADER_LEN + s->out_len;
+            s->deflater.avail_out = STREAM_FRAME_MAX - s->out_len;
+
+            ret = deflate(&s->deflater, Z_FINISH);
+            s->out_len = STREAM_FRAME_MAX - s->deflater.avail_out;
+
+            if (s->out_len == STREAM_FRAME_MAX && flushFrame(s) == -1) return -1;
+        }
+    }
+#endif
+
+    if (s->out_len && flushFrame(s) == -1) return -1;
+
+    return sendFrame(s, 0);
+}
+
+unsigned long streamWireBytes(payloadStream *s) {
+    // frames sent and received so far, headers included
+    return s->wire;
+}
+
+void streamClose(payloadStream *s) {
+#ifdef USE_ZLIB
+    if (s->codec == STREAM_DEFLATE) {
+        inflateEnd(&s->inflater);
+        deflateEnd(&s->deflater);
+    }
+#endif
+
+    free(s);
+}
+
+int streamSupported(int codec) {
+#ifdef USE_ZLIB
+    if (codec == STREAM_DEFLATE) return 1;
+#endif
+    return codec == STREAM_IDENTITY;
+}
+
+int streamChooseCodec(int offered) {
+    /**
+     * @brief the codec the server answers a hello with,
+     * compression whenever both sides have it
+     */
+
+    if ((offered & (1 << STREAM_DEFLATE)) && streamSupported(STREAM_DEFLATE)) return STREAM_DEFLATE;
+
+    return STREAM_IDENTITY;
+}
+
+static int recvAll(payloadStream *s, char *buffer, int len) {
+    while (len) {
+        int n = s->recv(s->io, buffer, len);
+        if (n <= 0) return -1;
+
+        buffer += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int nextFrame(payloadStream *s) {
+    unsigned char header[STREAM_HEADER_LEN];
+    if (recvAll(s, (char *) header, STREAM_HEADER_LEN) == -1) return -1;
+
+    unsigned long len = (unsigned long) header[0] << 24 | header[1] << 16 | header[2] << 8 | header[3];
+    if (len > STREAM_FRAME_MAX) return -1;
+    if (recvAll(s, s->in, len) == -1) return -1;
+
+    s->in_len = len;
+    s->in_pos = 0;
+    s->ended = !len;
+    s->wire += STREAM_HEADER_LEN + len;
+
+    return 0;
+}
+
+static int flushFrame(payloadStream *s) {
+    int len = s->out_len;
+    s->out_len = 0;
+
+#ifdef USE_ZLIB
+    /**
+     * deflating random or already compressed bytes costs
+     * more cpu than the link it saves, such frames switch
+     * the stream to stored blocks (level 0, a copy)
+     */
+    if (s->codec == STREAM_DEFLATE) {
+        unsigned long consumed = s->deflater.total_in - s->frame_in;
+        s->frame_in = s->deflater.total_in;
+
+        if (s->wanted && len * 10UL > consumed * 9) {
+            s->wanted = 0;
+            s->stored = STREAM_STORED_FRAMES;
+        } else if (!s->wanted && !--s->stored) {
+            s->wanted = STREAM_LEVEL;
+        }
+    }
+#endif
+
+    return sendFrame(s, len);
+}
+
+static int sendFrame(payloadStream *s, int len) {
+    /**
+     * @brief send the len bytes after the header
+     * space of out as one frame
+     */
+
+    s->out[0] = len >> 24;
+    s->out[1] = len >> 16;
+    s->out[2] = len >> 8;
+    s->out[3] = len;
+
+    char *data = s->out;
+    int left = STREAM_HEADER_LEN + len;
+
+    while (left) {
+        int n = s->send(s->io, data, left);
+        if (n <= 0) return -1;
+
+        data += n;
+        left -= n;
+    }
+
+    s->wire += STREAM_HEADER_LEN + len;
+
+    return 0;
+}
@@ -0,0 +1,49 @@
+#ifndef PAYLOAD_STREAM_H
+#define PAYLOAD_STREAM_H
+
+#define STREAM_MAGIC "\0RVX"
+#define STREAM_MAGIC_LEN 4
+#define STREAM_HELLO_LEN 6          // magic, version, codecs
+#define STREAM_VERSION 1
+#define STREAM_FRAME_MAX 65536      // bytes on the wire per frame
+#define STREAM_MAX_PAYLOAD (256 << 20)
+
+// codecs, the hello carries a bit per codec the client offers
+#define STREAM_IDENTITY 0
+#define STREAM_DEFLATE 1
+
+/**
+ * @brief large payloads for the reversal server.
+ *
+ * a client that starts with STREAM_MAGIC instead of a
+ * string asks for a payload stream:
+ *
+ * client: magic, version, offered codecs (1 << codec each)
+ * server: magic, version, chosen codec
+ * client: frames of the request body, then an empty frame
+ * server: frames of the reversed body, then an empty frame
+ *
+ * a frame is a 4 byte big endian length and that many bytes.
+ * with STREAM_DEFLATE the frames carry one raw deflate stream
+ * per direction, so both sides work chunk by chunk and never
+ * hold more than a frame of wire data.
+ *
+ * the stream reads and writes through the callbacks, they
+ * behave like recv and send on a blocking socket.
+ */
+
+typedef int (*streamIO)(void *io, char *buffer, int len);
+
+typedef struct payloadStream payloadStream;
+
+payloadStream *streamOpen(int codec, streamIO recv, streamIO send, void *io);
+int streamRead(payloadStream *s, char *buffer, int len);
+int streamWrite(payloadStream *s, const char *data, int len);
+int streamFinish(payloadStream *s);
+unsigned long streamWireBytes(payloadStream *s);
+void streamClose(payloadStream *s);
+
+int streamSupported(int codec);
+int streamChooseCodec(int offered);
+
+#endif
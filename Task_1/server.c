@@ -6,10 +6,19 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include <string.h>
+#include <signal.h>
+
+#ifdef USE_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+#include "payload_stream.h"
 
 #define DEFAULT_PORT 8080
 #define DEFAULT_MAX_CONN 100
@@ -18,13 +27,40 @@
 
 #define max(a, b) (a > b) ? a : b
 
+// a payload is reversed in chunks of this many bytes
+#define CHUNK_LEN STREAM_FRAME_MAX
+#define MAX_CHUNKS (STREAM_MAX_PAYLOAD / CHUNK_LEN + 1) // the last one only sees the end
+#define PAYLOAD_BUDGET (512 << 20) // bytes of chunks all payload streams together may hold
+
+// a connection as the payload stream sees it
+typedef struct peer {
+    void *tls;
+    int socket;
+} peer;
+
 // global variables
 int SOCKET_FD;
+pthread_mutex_t PAYLOAD_LOCK = PTHREAD_MUTEX_INITIALIZER;
+long PAYLOAD_BUFFERED; // bytes of chunks held by the payload streams, guarded by PAYLOAD_LOCK
+#ifdef USE_TLS
+SSL_CTX *TLS_CONTEXT; // null while serving plaintext
+#endif
 
 
 // The following code contains function declarations
 void reverseString(char *string);
+void reverseBytes(char *data, int length);
 void* handleConnections(void *arg);
+int servePayload(void *tls, int peer_socket, const char *hello);
+int reservePayload(long bytes);
+void releasePayload(long bytes);
+int streamRecv(void *io, char *buffer, int len);
+int streamSend(void *io, char *buffer, int len);
+void tlsSetup(const char *cert, const char *key);
+int tlsAccept(int peer_socket, void **tls);
+int peerRecv(void *tls, int peer_socket, char *buffer, int len);
+int peerSend(void *tls, int peer_socket, const char *buffer, int len);
+void peerClose(void *tls, int peer_socket);
 
 
 // The main function
@@ -32,7 +68,8 @@ int main(int argc, char **argv) {
 
     int PORT = DEFAULT_PORT;
     int MAX_CONN = DEFAULT_MAX_CONN;
-    in_addr_t ADDR = INADDR_ANY;
+    const char *ADDR = "0.0.0.0";
+    const char *UNIX_PATH = 0;
 
     // decode arguments
     // if port number is specified specifically as 
@@ -40,10 +77,47 @@ int main(int argc, char **argv) {
     // value from default value
     if (argc > 1) PORT = atoi(argv[1]);
     if (argc > 2) MAX_CONN = atoi(argv[2]);
-    if (argc > 3) ADDR = inet_addr(argv[3]);
+    // an address with a slash is a unix socket path,
+    // clients on this host then skip the tcp/ip stack.
+    // one with a colon is ipv6, "::" takes ipv4 clients too
+    if (argc > 3) {
+        if (strchr(argv[3], '/')) UNIX_PATH = argv[3];
+        else ADDR = argv[3];
+    }
+    // a certificate and its key turn on tls
+    if (argc > 5) tlsSetup(argv[4], argv[5]);
+
+    // socket address setup
+    struct sockaddr_storage serverAddress = {0};
+    socklen_t addrlen;
+
+    if (UNIX_PATH) {
+        struct sockaddr_un *unixAddress = (struct sockaddr_un *)&serverAddress;
+        unixAddress->sun_family = AF_UNIX;
+        strncpy(unixAddress->sun_path, UNIX_PATH, sizeof(unixAddress->sun_path) - 1);
+        addrlen = sizeof(struct sockaddr_un);
+
+        // a path left behind by an earlier run
+        unlink(UNIX_PATH);
+    } else if (strchr(ADDR, ':')) {
+        struct sockaddr_in6 *inet6Address = (struct sockaddr_in6 *)&serverAddress;
+        inet6Address->sin6_family = AF_INET6;
+        inet6Address->sin6_port = htons(PORT);
+        addrlen = sizeof(struct sockaddr_in6);
+        if (inet_pton(AF_INET6, ADDR, &inet6Address->sin6_addr) != 1) {
+            fprintf(stderr, "Error: Invalid address %s\n", ADDR);
+            exit(EINVAL);
+        }
+    } else {
+        struct sockaddr_in *inetAddress = (struct sockaddr_in *)&serverAddress;
+        inetAddress->sin_family = AF_INET;
+        inetAddress->sin_addr.s_addr = inet_addr(ADDR);
+        inetAddress->sin_port = htons(PORT);
+        addrlen = sizeof(struct sockaddr_in);
+    }
 
     // create a socket
-    int socketFD = SOCKET_FD = socket(AF_INET, SOCK_STREAM, 0);
+    int socketFD = SOCKET_FD = socket(serverAddress.ss_family, SOCK_STREAM, 0);
 
     if (socketFD == -1) {
         fprintf(stderr, "Error: Attempt to create a socket failed...\n");
@@ -52,15 +126,14 @@ int main(int argc, char **argv) {
         fprintf(stdout, "Socket Created successfully...\n");
     }
 
-    // socket address setup
-    struct sockaddr_in serverAddress;
-    int addrlen = sizeof(serverAddress);
-    serverAddress.sin_family = AF_INET;
-    serverAddress.sin_addr.s_addr = ADDR;
-    serverAddress.sin_port = htons(PORT);
+    // only the any address is dual-stack
+    if (serverAddress.ss_family == AF_INET6) {
+        int v6only = !IN6_IS_ADDR_UNSPECIFIED(&((struct sockaddr_in6 *)&serverAddress)->sin6_addr);
+        setsockopt(socketFD, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+    }
 
     // binding address to the socket
-    if (bind(socketFD, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) < 0)
+    if (bind(socketFD, (struct sockaddr *)&serverAddress, addrlen) < 0)
     {
         fprintf(stderr, "Error: Failed to bind the socket\n");
         exit(errno);
@@ -92,7 +165,7 @@ int main(int argc, char **argv) {
         fprintf(stdout, "Waiting for new connection ...\n");
 
         // attempt to accept the connection request
-        *peer_socket = accept(socketFD, (struct sockaddr *)&serverAddress, (socklen_t *)&addrlen);
+        *peer_socket = accept(socketFD, NULL, NULL);
 
         // handle case if couldn't connect
         if ((*peer_socket) == -1)
@@ -130,9 +203,10 @@ void reverseString(char *string) {
     // i.e. the pointer is valid and not null
     if (!string) return;
 
-    // get the length of the string
-    int length = strlen(string);
+    reverseBytes(string, strlen(string));
+}
 
+void reverseBytes(char *data, int length) {
     /**
      * iterate till the mid
      * of the string
@@ -140,9 +214,9 @@ void reverseString(char *string) {
      * equidistant from start and end
      */
     for (int i = 0; i < length/2; i++) {
-        char temp = string[length - i - 1];
-        string[length - i - 1] = string[i];
-        string[i] = temp;
+        char temp = data[length - i - 1];
+        data[length - i - 1] = data[i];
+        data[i] = temp;
     }
 
 }
@@ -156,30 +230,273 @@ void* handleConnections(void *arg) {
      */
     int peer_socket = *((int*) arg);
     char buffer[MAX_STRING_LEN + 1] = {0};
+    void *tls = 0;
 
-    int valread = recv(peer_socket, buffer, MAX_STRING_LEN + 1, 0);
+    if (tlsAccept(peer_socket, &tls) == -1) {
+        fprintf(stderr, "Error: TLS handshake with peer %d failed\n", peer_socket);
+        free(arg);
+        close(peer_socket);
+
+        return NULL;
+    }
+
+    int valread = peerRecv(tls, peer_socket, buffer, MAX_STRING_LEN + 1);
 
     // if error encountered while reading request
     if (valread == -1) {
         fprintf(stderr, "Error: Couldn't read request from peer %d\n", peer_socket);
         free(arg);
+        peerClose(tls, peer_socket);
 
         return NULL;
     }
 
+    // a lone "\0" is an empty string, more after it is a stream hello
+    if (valread > 1 && !buffer[0]) {
+        while (valread < STREAM_HELLO_LEN) {
+            int more = peerRecv(tls, peer_socket, buffer + valread, STREAM_HELLO_LEN - valread);
+            if (more <= 0) break;
+            valread += more;
+        }
+
+        if (valread == STREAM_HELLO_LEN && !memcmp(buffer, STREAM_MAGIC, STREAM_MAGIC_LEN)) {
+            if (servePayload(tls, peer_socket, buffer) == -1) {
+                fprintf(stderr, "Error: Couldn't serve the payload of peer %d\n", peer_socket);
+            }
+
+            free(arg);
+            peerClose(tls, peer_socket);
+
+            return NULL;
+        }
+    }
+
     // reverse the string in-place
     reverseString(buffer);
 
     // send back the result
-    if (send(peer_socket, buffer, sizeof(char)*max(1, strlen(buffer)), 0) == -1) {
+    if (peerSend(tls, peer_socket, buffer, sizeof(char)*max(1, strlen(buffer))) == -1) {
         fprintf(stderr, "Error: Couldn't send result to peer %d\n", peer_socket);
         free(arg);
+        peerClose(tls, peer_socket);
 
         return NULL;
     }
 
     free(arg);
-    close(peer_socket);
+    peerClose(tls, peer_socket);
 
     return NULL;
+}
+
+int servePayload(void *tls, int peer_socket, const char *hello) {
+    /**
+     * @brief reverse a payload stream (payload_stream.h).
+     * every chunk is reversed as soon as it is decoded,
+     * the reversed payload is then its chunks sent
+     * last to first. only the chunks are kept, never
+     * the compressed bytes or a second copy, and each
+     * is taken from PAYLOAD_BUDGET before it is allocated
+     * 
+     * @return -1 if the peer broke the stream
+     */
+
+    if (hello[STREAM_MAGIC_LEN] != STREAM_VERSION) return -1;
+
+    // answer with the codec both sides have
+    char reply[STREAM_HELLO_LEN];
+    memcpy(reply, STREAM_MAGIC, STREAM_MAGIC_LEN);
+    reply[STREAM_MAGIC_LEN] = STREAM_VERSION;
+    reply[STREAM_MAGIC_LEN + 1] = streamChooseCodec((unsigned char) hello[STREAM_MAGIC_LEN + 1]);
+
+    if (peerSend(tls, peer_socket, reply, STREAM_HELLO_LEN) != STREAM_HELLO_LEN) return -1;
+
+    peer io = {tls, peer_socket};
+    payloadStream *stream = streamOpen(reply[STREAM_MAGIC_LEN + 1], streamRecv, streamSend, &io);
+    if (!stream) return -1;
+
+    char **chunks = (char **) calloc(MAX_CHUNKS, sizeof(char *));
+    int lengths[MAX_CHUNKS];
+    int count = 0, ret = 0;
+
+    // read and reverse chunk by chunk till the empty frame
+    while (1) {
+        // a few peers inflating to the maximum must not take the server's memory
+        if (reservePayload(CHUNK_LEN) == -1) {
+            fprintf(stderr, "Error: Payload of peer %d is over what the server buffers, %d bytes in all\n",
+                    peer_socket, PAYLOAD_BUDGET);
+            ret = -1;
+            break;
+        }
+
+        chunks[count] = (char *) malloc(CHUNK_LEN);
+        lengths[count] = 0;
+
+        int valread = 1;
+        while (lengths[count] < CHUNK_LEN && valread > 0) {
+            valread = streamRead(stream, chunks[count] + lengths[count], CHUNK_LEN - lengths[count]);
+            if (valread > 0) lengths[count] += valread;
+        }
+
+        reverseBytes(chunks[count], lengths[count]);
+        count++;
+
+        if (count == MAX_CHUNKS && lengths[count - 1]) {
+            fprintf(stderr, "Error: Payload of peer %d is over %d bytes\n", peer_socket, STREAM_MAX_PAYLOAD);
+            ret = -1;
+            break;
+        }
+
+        if (valread <= 0) {
+            ret = valread;
+            break;
+        }
+    }
+
+    for (int i = count - 1; i >= 0 && ret != -1; i--) {
+        ret = streamWrite(stream, chunks[i], lengths[i]);
+    }
+    if (ret != -1) ret = streamFinish(stream);
+
+    if (DEBUG) {
+        fprintf(stdout, "Payload of peer %d: %d chunks, %lu bytes on the wire\n",
+                peer_socket, count, streamWireBytes(stream));
+    }
+
+    for (int i = 0; i < count; i++) free(chunks[i]);
+    free(chunks);
+    releasePayload((long) count * CHUNK_LEN);
+    streamClose(stream);
+
+    return ret;
+}
+
+int reservePayload(long bytes) {
+    /**
+     * @brief take bytes from the budget of all payloads
+     * 
+     * @return -1 if they would go over PAYLOAD_BUDGET
+     */
+
+    int ret = -1;
+
+    pthread_mutex_lock(&PAYLOAD_LOCK);
+    if (PAYLOAD_BUFFERED + bytes <= PAYLOAD_BUDGET) {
+        PAYLOAD_BUFFERED += bytes;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&PAYLOAD_LOCK);
+
+    return ret;
+}
+
+void releasePayload(long bytes) {
+    pthread_mutex_lock(&PAYLOAD_LOCK);
+    PAYLOAD_BUFFERED -= bytes;
+    pthread_mutex_unlock(&PAYLOAD_LOCK);
+}
+
+int streamRecv(void *io, char *buffer, int len) {
+    return peerRecv(((peer *)io)->tls, ((peer *)io)->socket, buffer, len);
+}
+
+int streamSend(void *io, char *buffer, int len) {
+    return peerSend(((peer *)io)->tls, ((peer *)io)->socket, buffer, len);
+}
+
+void tlsSetup(const char *cert, const char *key) {
+    /**
+     * @brief serve tls with the certificate chain and key.
+     * reconnecting clients resume their session from a
+     * ticket (tls 1.3) or the session cache (tls 1.2).
+     * where the kernel has the tls module, records are
+     * encrypted by kTLS: the reversed string is copied once
+     * into the socket and encrypted there, no record buffer
+     * in user space.
+     * 
+     */
+#ifdef USE_TLS
+    TLS_CONTEXT = SSL_CTX_new(TLS_server_method());
+    if (!TLS_CONTEXT) exit(ENOMEM);
+
+    SSL_CTX_set_min_proto_version(TLS_CONTEXT, TLS1_2_VERSION);
+    SSL_CTX_set_options(TLS_CONTEXT, SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_ENABLE_KTLS);
+    SSL_CTX_set_session_id_context(TLS_CONTEXT, (const unsigned char *)"reverse", 7);
+    SSL_CTX_set_session_cache_mode(TLS_CONTEXT, SSL_SESS_CACHE_SERVER);
+
+    if (SSL_CTX_use_certificate_chain_file(TLS_CONTEXT, cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(TLS_CONTEXT, key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(TLS_CONTEXT) != 1) {
+        fprintf(stderr, "Error: Couldn't load the certificate %s and key %s\n", cert, key);
+        ERR_print_errors_fp(stderr);
+        exit(EINVAL);
+    }
+
+    // openssl writes the socket itself, a closed peer must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+#else
+    fprintf(stderr, "Error: Built without TLS, compile with -DUSE_TLS -lssl -lcrypto\n");
+    exit(EINVAL);
+#endif
+}
+
+int tlsAccept(int peer_socket, void **tls) {
+    /**
+     * @brief run the server side of the handshake,
+     * tls stays null while serving plaintext
+     * 
+     * @return -1 if the handshake failed
+     */
+#ifdef USE_TLS
+    if (!TLS_CONTEXT) return 0;
+
+    SSL *ssl = SSL_new(TLS_CONTEXT);
+    if (!ssl) return -1;
+
+    SSL_set_fd(ssl, peer_socket);
+    if (SSL_accept(ssl) != 1) {
+        SSL_free(ssl);
+        return -1;
+    }
+
+    if (DEBUG) {
+        fprintf(stdout, "TLS with peer %d: %s%s%s\n", peer_socket, SSL_get_version(ssl),
+                SSL_session_reused(ssl) ? ", resumed" : "",
+                BIO_get_ktls_send(SSL_get_wbio(ssl)) ? ", kTLS" : "");
+    }
+
+    *tls = ssl;
+#endif
+    return 0;
+}
+
+int peerRecv(void *tls, int peer_socket, char *buffer, int len) {
+#ifdef USE_TLS
+    if (tls) {
+        int valread = SSL_read((SSL *)tls, buffer, len);
+        if (valread > 0) return valread;
+
+        // close_notify ends the stream like a shutdown socket
+        return SSL_get_error((SSL *)tls, valread) == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+    }
+#endif
+    return recv(peer_socket, buffer, len, 0);
+}
+
+int peerSend(void *tls, int peer_socket, const char *buffer, int len) {
+#ifdef USE_TLS
+    // with kTLS this is a plain write of the socket
+    if (tls) return SSL_write((SSL *)tls, buffer, len) > 0 ? len : -1;
+#endif
+    return send(peer_socket, buffer, len, MSG_NOSIGNAL);
+}
+
+void peerClose(void *tls, int peer_socket) {
+#ifdef USE_TLS
+    if (tls) {
+        SSL_shutdown((SSL *)tls);
+        SSL_free((SSL *)tls);
+    }
+#endif
+    close(peer_socket);
 }
\ No newline at end of file
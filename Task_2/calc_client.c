@@ -0,0 +1,735 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <string.h>
+
+#include "calc_client.h"
+
+#define READ_CHUNK 4096
+
+// connection states
+enum
+{
+    CALC_CLOSED,
+    CALC_CONNECTING,
+    CALC_GREETING, // waiting for the client id the server opens with
+    CALC_READY
+};
+
+// data structures
+typedef struct _request
+{
+    /**
+     * @brief one submitted expression, frame is
+     * its encoded form kept for resending
+     */
+    char *frame;
+    int frame_len;
+    int retries;
+    calcCallback callback;
+    void *arg;
+    struct _request *next;
+} request;
+
+typedef struct
+{
+    /**
+     * @brief one pooled connection. head to tail are the
+     * requests sent on it, in the order answers will come.
+     * out holds encoded requests the socket did not take yet,
+     * in holds received bytes short of a whole answer.
+     */
+    int fd;
+    int state;
+    request *head;
+    request *tail;
+    int in_flight;
+    char *out;
+    int out_len;
+    int out_sent;
+    int out_cap;
+    char *in;
+    int in_len;
+    int in_cap;
+    long retry_at; // milli seconds, when closed
+    int backoff;
+} calcConnection;
+
+struct calcPool
+{
+    struct sockaddr_storage address;
+    socklen_t address_len;
+    calcFraming framing;
+    int depth;
+    calcConnection *connections;
+    int count;
+    request *queue_head; // submitted, not sent yet
+    request *queue_tail;
+    int queued;
+    int in_flight;
+};
+
+struct calcFuture
+{
+    calcPool *pool;
+    int done;
+    char *answer;
+};
+
+// function declarations
+static int encodeLine(const char *expression, char *out, int cap);
+static int decodeLine(const char *in, int len, char *answer, int cap);
+static long nowMs();
+static void startConnection(calcPool *pool, calcConnection *c);
+static void failConnection(calcPool *pool, calcConnection *c);
+static void dispatchRequests(calcPool *pool);
+static int flushConnection(calcPool *pool, calcConnection *c);
+static int readAnswers(calcPool *pool, calcConnection *c);
+static void completeRequest(request *r, const char *answer);
+static void futureDone(void *arg, const char *answer);
+
+const calcFraming CALC_LINES = {encodeLine, decodeLine, CALC_LINE_HELLO};
+
+// function definitions
+calcPool *calcPoolCreate(const char *address, int port, int connections, int depth, const calcFraming *framing)
+{
+    /**
+     * @brief a pool of connections to the server,
+     * depth 0 and framing null pick the defaults.
+     * an address with a slash is the path of the
+     * server's unix socket, port is then unused.
+     * connecting starts on the first calcPoll.
+     *
+     * @return null if the address is invalid
+     */
+
+    struct sockaddr_storage serverAddress = {0};
+    socklen_t length;
+
+    if (strchr(address, '/'))
+    {
+        struct sockaddr_un *unixAddress = (struct sockaddr_un *)&serverAddress;
+        unixAddress->sun_family = AF_UNIX;
+        strncpy(unixAddress->sun_path, address, sizeof(unixAddress->sun_path) - 1);
+        length = sizeof(struct sockaddr_un);
+    }
+    else if (strchr(address, ':'))
+    {
+        struct sockaddr_in6 *inet6Address = (struct sockaddr_in6 *)&serverAddress;
+        inet6Address->sin6_family = AF_INET6;
+        inet6Address->sin6_port = htons(port);
+        if (inet_pton(AF_INET6, address, &inet6Address->sin6_addr) != 1)
+            return NULL;
+        length = sizeof(struct sockaddr_in6);
+    }
+    else
+    {
+        struct sockaddr_in *inetAddress = (struct sockaddr_in *)&serverAddress;
+        inetAddress->sin_family = AF_INET;
+        inetAddress->sin_port = htons(port);
+        if (inet_pton(AF_INET, address, &inetAddress->sin_addr) != 1)
+            return NULL;
+        length = sizeof(struct sockaddr_in);
+    }
+
+    if (connections < 1)
+        return NULL;
+
+    calcPool *pool = (calcPool *)calloc(1, sizeof(calcPool));
+    pool->address = serverAddress;
+    pool->address_len = length;
+    pool->framing = framing ? *framing : CALC_LINES;
+    pool->depth = depth > 0 ? depth : CALC_DEFAULT_DEPTH;
+    pool->count = connections;
+    pool->connections = (calcConnection *)calloc(connections, sizeof(calcConnection));
+
+    for (int i = 0; i < connections; i++)
+    {
+        pool->connections[i].fd = -1;
+        pool->connections[i].backoff = CALC_RECONNECT_MIN;
+    }
+
+    return pool;
+}
+
+void calcPoolDestroy(calcPool *pool)
+{
+    /**
+     * @brief close every connection, requests
+     * still outstanding complete with null
+     */
+
+    for (int i = 0; i < pool->count; i++)
+    {
+        calcConnection *c = &pool->connections[i];
+
+        while (c->head)
+        {
+            request *r = c->head;
+            c->head = r->next;
+            completeRequest(r, NULL);
+        }
+
+        if (c->fd != -1)
+            close(c->fd);
+        free(c->out);
+        free(c->in);
+    }
+
+    while (pool->queue_head)
+    {
+        request *r = pool->queue_head;
+        pool->queue_head = r->next;
+        completeRequest(r, NULL);
+    }
+
+    free(pool->connections);
+    free(pool);
+}
+
+int calcSubmit(calcPool *pool, const char *expression, calcCallback callback, void *arg)
+{
+    /**
+     * @brief queue expression for evaluation, callback
+     * runs from a later calcPoll with the answer.
+     * nothing is sent until then, so submits in a row
+     * leave together.
+     *
+     * @return -1 if the expression can't be encoded
+     */
+
+    char frame[CALC_MAX_ANSWER + 2];
+    int length = pool->framing.encode(expression, frame, sizeof(frame));
+    if (length < 0)
+        return -1;
+
+    request *r = (request *)malloc(sizeof(request));
+    r->frame = (char *)malloc(length);
+    memcpy(r->frame, frame, length);
+    r->frame_len = length;
+    r->retries = 0;
+    r->callback = callback;
+    r->arg = arg;
+    r->next = 0;
+
+    if (pool->queue_tail)
+        pool->queue_tail->next = r;
+    else
+        pool->queue_head = r;
+    pool->queue_tail = r;
+    pool->queued++;
+
+    return 0;
+}
+
+int calcPoll(calcPool *pool, int timeout)
+{
+    /**
+     * @brief send what is queued, then wait up to timeout
+     * milli seconds (-1 for ever) for the sockets and complete
+     * every answer that arrived.
+     *
+     * @return the number of requests completed
+     */
+
+    int completed = 0;
+    long now = nowMs();
+    long wake = -1;
+
+    for (int i = 0; i < pool->count; i++)
+    {
+        calcConnection *c = &pool->connections[i];
+        if (c->state == CALC_CLOSED && c->retry_at <= now)
+            startConnection(pool, c);
+    }
+
+    dispatchRequests(pool);
+
+    struct pollfd fds[pool->count];
+    int polled[pool->count];
+    int n = 0;
+
+    for (int i = 0; i < pool->count; i++)
+    {
+        calcConnection *c = &pool->connections[i];
+
+        if (c->state == CALC_READY && c->out_len > c->out_sent)
+            flushConnection(pool, c);
+
+        // a connect or flush that failed right away is retried later too
+        if (c->state == CALC_CLOSED)
+        {
+            if (wake == -1 || c->retry_at < wake)
+                wake = c->retry_at;
+            continue;
+        }
+
+        fds[n].fd = c->fd;
+        fds[n].revents = 0;
+        if (c->state == CALC_CONNECTING)
+            fds[n].events = POLLOUT;
+        else if (c->out_len > c->out_sent)
+            fds[n].events = POLLIN | POLLOUT;
+        else
+            fds[n].events = POLLIN;
+        polled[n++] = i;
+    }
+
+    // don't sleep past a reconnect
+    if (wake != -1 && (timeout < 0 || wake - now < timeout))
+        timeout = wake > now ? wake - now : 0;
+
+    if (poll(fds, n, timeout) <= 0)
+        return 0;
+
+    for (int k = 0; k < n; k++)
+    {
+        calcConnection *c = &pool->connections[polled[k]];
+        short events = fds[k].revents;
+
+        if (!events)
+            continue;
+
+        if (c->state == CALC_CONNECTING)
+        {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+
+            if (error)
+                failConnection(pool, c);
+            else
+                c->state = CALC_GREETING;
+            continue;
+        }
+
+        if (events & POLLIN || events & (POLLERR | POLLHUP))
+        {
+            int answered = readAnswers(pool, c);
+            if (answered < 0)
+                continue;
+            completed += answered;
+        }
+
+        if (events & POLLOUT && c->state == CALC_READY)
+            flushConnection(pool, c);
+    }
+
+    return completed;
+}
+
+void calcPoolDrain(calcPool *pool)
+{
+    /**
+     * @brief poll until every submitted
+     * request has completed
+     */
+
+    while (calcInFlight(pool))
+        calcPoll(pool, -1);
+}
+
+int calcInFlight(calcPool *pool)
+{
+    return pool->queued + pool->in_flight;
+}
+
+calcFuture *calcSubmitFuture(calcPool *pool, const char *expression)
+{
+    /**
+     * @brief submit with a future instead of a callback
+     *
+     * @return null if the expression can't be encoded
+     */
+
+    calcFuture *f = (calcFuture *)calloc(1, sizeof(calcFuture));
+    f->pool = pool;
+
+    if (calcSubmit(pool, expression, futureDone, f) == -1)
+    {
+        free(f);
+        return NULL;
+    }
+
+    return f;
+}
+
+int calcFutureReady(calcFuture *future)
+{
+    return future->done;
+}
+
+const char *calcFutureWait(calcFuture *future)
+{
+    /**
+     * @brief poll the pool until the answer is in,
+     * other requests complete along the way
+     *
+     * @return the answer, null if the request failed
+     */
+
+    while (!future->done)
+        calcPoll(future->pool, -1);
+
+    return future->answer;
+}
+
+void calcFutureFree(calcFuture *future)
+{
+    /**
+     * @brief a future may only be freed once it is done,
+     * completing it would write to freed memory otherwise
+     */
+
+    calcFutureWait(future);
+
+    free(future->answer);
+    free(future);
+}
+
+static int encodeLine(const char *expression, char *out, int cap)
+{
+    int length = strlen(expression);
+
+    // a newline would split the request in two
+    if (length + 1 > cap || memchr(expression, '\n', length))
+        return -1;
+
+    memcpy(out, expression, length);
+    out[length] = '\n';
+
+    return length + 1;
+}
+
+static int decodeLine(const char *in, int len, char *answer, int cap)
+{
+    const char *end = (const char *)memchr(in, '\n', len);
+    if (!end)
+        return len >= cap ? -1 : 0;
+
+    int length = end - in;
+    if (length && in[length - 1] == '\r')
+        length--;
+    if (length >= cap)
+        return -1;
+
+    memcpy(answer, in, length);
+    answer[length] = 0;
+
+    return end - in + 1;
+}
+
+static long nowMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+static void startConnection(calcPool *pool, calcConnection *c)
+{
+    /**
+     * @brief begin a non blocking connect,
+     * calcPoll finishes it once the socket is writable
+     */
+
+    c->fd = socket(pool->address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd == -1)
+    {
+        failConnection(pool, c);
+        return;
+    }
+
+    // requests are small, don't let nagle hold them back
+    int one = 1;
+    if (pool->address.ss_family != AF_UNIX)
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    c->state = CALC_CONNECTING;
+    c->in_len = 0;
+    c->out_len = c->out_sent = 0;
+
+    if (connect(c->fd, (struct sockaddr *)&pool->address, pool->address_len) == 0)
+        c->state = CALC_GREETING;
+    else if (errno != EINPROGRESS)
+        failConnection(pool, c);
+}
+
+static void failConnection(calcPool *pool, calcConnection *c)
+{
+    /**
+     * @brief close a broken connection and schedule its reconnect.
+     * requests it had in flight go back to the front of the queue,
+     * those out of retries complete with null. when no connection is
+     * left to try, queued requests use up a retry too, so a server
+     * that is down fails them instead of holding them for ever.
+     */
+
+    if (c->fd != -1)
+        close(c->fd);
+    c->fd = -1;
+    c->state = CALC_CLOSED;
+    c->retry_at = nowMs() + c->backoff;
+    c->backoff = c->backoff * 2 > CALC_RECONNECT_MAX ? CALC_RECONNECT_MAX : c->backoff * 2;
+    c->out_len = c->out_sent = 0;
+    c->in_len = 0;
+
+    // failed requests complete last, their callbacks may submit again
+    request *failed = 0, **lastFailed = &failed;
+    request *retry = 0, *retryTail = 0;
+
+    while (c->head)
+    {
+        request *r = c->head;
+        c->head = r->next;
+        r->next = 0;
+        pool->in_flight--;
+
+        if (r->retries++ < CALC_MAX_RETRIES)
+        {
+            if (retryTail)
+                retryTail->next = r;
+            else
+                retry = r;
+            retryTail = r;
+            pool->queued++;
+        }
+        else
+        {
+            *lastFailed = r;
+            lastFailed = &r->next;
+        }
+    }
+    c->tail = 0;
+    c->in_flight = 0;
+
+    int usable = 0;
+    for (int i = 0; i < pool->count; i++)
+        usable |= pool->connections[i].state != CALC_CLOSED;
+
+    if (!usable)
+    {
+        request **r = &pool->queue_head;
+        pool->queue_tail = 0;
+        while (*r)
+        {
+            if ((*r)->retries++ < CALC_MAX_RETRIES)
+            {
+                pool->queue_tail = *r;
+                r = &(*r)->next;
+                continue;
+            }
+
+            request *out = *r;
+            *r = out->next;
+            out->next = 0;
+            pool->queued--;
+            *lastFailed = out;
+            lastFailed = &out->next;
+        }
+    }
+
+    // requests that were in flight were charged above
+    if (retry)
+    {
+        retryTail->next = pool->queue_head;
+        if (!pool->queue_head)
+            pool->queue_tail = retryTail;
+        pool->queue_head = retry;
+    }
+
+    while (failed)
+    {
+        request *r = failed;
+        failed = r->next;
+        completeRequest(r, NULL);
+    }
+}
+
+static void dispatchRequests(calcPool *pool)
+{
+    /**
+     * @brief move queued requests onto the ready connection
+     * with the fewest in flight, until every window is full
+     */
+
+    while (pool->queue_head)
+    {
+        calcConnection *best = 0;
+        for (int i = 0; i < pool->count; i++)
+        {
+            calcConnection *c = &pool->connections[i];
+            if (c->state == CALC_READY && c->in_flight < pool->depth && (!best || c->in_flight < best->in_flight))
+                best = c;
+        }
+
+        if (!best)
+            return;
+
+        request *r = pool->queue_head;
+        pool->queue_head = r->next;
+        if (!pool->queue_head)
+            pool->queue_tail = 0;
+        pool->queued--;
+
+        if (best->out_len + r->frame_len > best->out_cap)
+        {
+            best->out_cap = 2 * (best->out_len + r->frame_len);
+            best->out = (char *)realloc(best->out, best->out_cap);
+        }
+        memcpy(best->out + best->out_len, r->frame, r->frame_len);
+        best->out_len += r->frame_len;
+
+        r->next = 0;
+        if (best->tail)
+            best->tail->next = r;
+        else
+            best->head = r;
+        best->tail = r;
+        best->in_flight++;
+        pool->in_flight++;
+    }
+}
+
+static int flushConnection(calcPool *pool, calcConnection *c)
+{
+    /**
+     * @brief send as much of the encoded
+     * requests as the socket takes
+     *
+     * @return -1 if the connection broke
+     */
+
+    int sent = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+
+    if (sent == -1)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+
+        failConnection(pool, c);
+        return -1;
+    }
+
+    c->out_sent += sent;
+    if (c->out_sent == c->out_len)
+        c->out_len = c->out_sent = 0;
+
+    return 0;
+}
+
+static int readAnswers(calcPool *pool, calcConnection *c)
+{
+    /**
+     * @brief read what arrived and complete the requests
+     * at the head of the connection, in order
+     *
+     * @return the number completed, -1 if the connection broke
+     */
+
+    if (c->in_cap - c->in_len < READ_CHUNK)
+    {
+        c->in_cap = c->in_len + 2 * READ_CHUNK;
+        c->in = (char *)realloc(c->in, c->in_cap);
+    }
+
+    int valread = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, 0);
+
+    if (valread == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+
+    if (valread <= 0)
+    {
+        failConnection(pool, c);
+        return -1;
+    }
+
+    // the first bytes are the client id, nothing was sent before them
+    if (c->state == CALC_GREETING)
+    {
+        c->state = CALC_READY;
+        c->backoff = CALC_RECONNECT_MIN;
+
+        // the hello leads every request dispatched from now on
+        if (pool->framing.hello)
+        {
+            int length = strlen(pool->framing.hello);
+            if (length > c->out_cap)
+            {
+                c->out_cap = 2 * length;
+                c->out = (char *)realloc(c->out, c->out_cap);
+            }
+            memcpy(c->out, pool->framing.hello, length);
+            c->out_len = length;
+        }
+        return 0;
+    }
+
+    c->in_len += valread;
+
+    char answer[CALC_MAX_ANSWER + 1];
+    int completed = 0;
+    int used = 0;
+
+    while (used < c->in_len)
+    {
+        int length = pool->framing.decode(c->in + used, c->in_len - used, answer, sizeof(answer));
+        if (length == 0)
+            break;
+
+        // garbage, or an answer nobody asked for
+        if (length < 0 || !c->head)
+        {
+            failConnection(pool, c);
+            return -1;
+        }
+        used += length;
+
+        request *r = c->head;
+        c->head = r->next;
+        if (!c->head)
+            c->tail = 0;
+        c->in_flight--;
+        pool->in_flight--;
+
+        completeRequest(r, answer);
+        completed++;
+    }
+
+    c->in_len -= used;
+    memmove(c->in, c->in + used, c->in_len);
+
+    return completed;
+}
+
+static void completeRequest(request *r, const char *answer)
+{
+    if (r->callback)
+        r->callback(r->arg, answer);
+
+    free(r->frame);
+    free(r);
+}
+
+static void futureDone(void *arg, const char *answer)
+{
+    calcFuture *f = (calcFuture *)arg;
+
+    f->answer = answer ? strdup(answer) : NULL;
+    f->done = 1;
+}
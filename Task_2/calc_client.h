@@ -0,0 +1,75 @@
+#ifndef CALC_CLIENT_H
+#define CALC_CLIENT_H
+
+#define CALC_DEFAULT_DEPTH 128      // requests in flight per connection
+#define CALC_MAX_RETRIES 2          // resends of a request after its connection broke
+#define CALC_RECONNECT_MIN 50       // milli seconds before the first reconnect
+#define CALC_RECONNECT_MAX 1000     // longest wait between reconnects
+#define CALC_MAX_ANSWER 1024
+#define CALC_LINE_HELLO "\x01LINES\n" // a connection opening with it is in line mode
+
+/**
+ * @brief asynchronous client for the postfix server.
+ *
+ * a pool keeps a number of connections open and pipelines
+ * requests on them, each connection holds up to depth
+ * requests in flight and answers come back in order.
+ * the pool has no threads of its own: calcPoll does the
+ * socket work and runs completions on the caller's thread,
+ * so one thread can keep thousands of evaluations going.
+ *
+ * a broken connection is reconnected with a backoff,
+ * the requests it had in flight are sent again on
+ * another connection up to CALC_MAX_RETRIES times.
+ * variables stored with "store" live on one connection,
+ * a pool of one connection keeps them in one session.
+ *
+ * > calcPool *pool = calcPoolCreate("127.0.0.1", 8080, 4, 0, NULL);
+ * > calcPool *local = calcPoolCreate("/tmp/postfix.sock", 0, 4, 0, NULL);
+ * > calcSubmit(pool, "1 2 +", done, arg);
+ * > calcPoolDrain(pool);
+ */
+
+typedef struct
+{
+    /**
+     * @brief how requests and answers look on the wire.
+     * encode writes one request into out (at most cap bytes)
+     * and returns its length, -1 if it does not fit.
+     * decode looks at the received bytes, when a whole answer
+     * is there it copies it into answer (at most cap bytes,
+     * null terminated) and returns the bytes it used,
+     * 0 while the answer is incomplete, -1 on garbage.
+     * hello, unless null, goes out before the first request.
+     */
+    int (*encode)(const char *expression, char *out, int cap);
+    int (*decode)(const char *in, int len, char *answer, int cap);
+    const char *hello;
+} calcFraming;
+
+// newline terminated queries and answers
+extern const calcFraming CALC_LINES;
+
+/**
+ * @brief completion of a request, answer is the
+ * server's reply or null if the request failed.
+ * answer is only valid during the call.
+ */
+typedef void (*calcCallback)(void *arg, const char *answer);
+
+typedef struct calcPool calcPool;
+typedef struct calcFuture calcFuture;
+
+calcPool *calcPoolCreate(const char *address, int port, int connections, int depth, const calcFraming *framing);
+void calcPoolDestroy(calcPool *pool);
+int calcSubmit(calcPool *pool, const char *expression, calcCallback callback, void *arg);
+int calcPoll(calcPool *pool, int timeout);
+void calcPoolDrain(calcPool *pool);
+int calcInFlight(calcPool *pool);
+
+calcFuture *calcSubmitFuture(calcPool *pool, const char *expression);
+int calcFutureReady(calcFuture *future);
+const char *calcFutureWait(calcFuture *future);
+void calcFutureFree(calcFuture *future);
+
+#endif
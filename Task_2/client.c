@@ -6,6 +6,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -39,17 +40,24 @@ int main(int argc, char **argv) {
 
 
     int PORT = DEFAULT_PORT;
-    in_addr_t INTERFACE = inet_addr(DEFAULT_INTERFACE);
+    const char *INTERFACE = DEFAULT_INTERFACE;
+    const char *UNIX_PATH = 0;
 
     // decode arguments
     // if port number is specified specifically as 
     // a command line argument, update the port
     // value from default value
     if (argc > 1) PORT = atoi(argv[1]);
-    if (argc > 2) INTERFACE = inet_addr(argv[2]);
+    // an address with a slash is the unix socket path of a local server,
+    // one with a colon is ipv6
+    if (argc > 2) {
+        if (strchr(argv[2], '/')) UNIX_PATH = argv[2];
+        else INTERFACE = argv[2];
+    }
 
     // create a socket
-    int socketFD = SOCKET_FD = socket(AF_INET, SOCK_STREAM, 0);
+    int family = UNIX_PATH ? AF_UNIX : strchr(INTERFACE, ':') ? AF_INET6 : AF_INET;
+    int socketFD = SOCKET_FD = socket(family, SOCK_STREAM, 0);
 
     if (socketFD == -1) {
         fprintf(stderr, "Error: Attempt to create a socket failed...\n");
@@ -62,11 +70,24 @@ int main(int argc, char **argv) {
     struct sockaddr_in serverAddress;
     int addrlen = sizeof(serverAddress);
     serverAddress.sin_family = AF_INET;
-    serverAddress.sin_addr.s_addr = INTERFACE;
+    serverAddress.sin_addr.s_addr = inet_addr(INTERFACE);
     serverAddress.sin_port = htons(PORT);
 
+    struct sockaddr_in6 inet6Address = {0};
+    inet6Address.sin6_family = AF_INET6;
+    inet6Address.sin6_port = htons(PORT);
+    if (family == AF_INET6)
+        inet_pton(AF_INET6, INTERFACE, &inet6Address.sin6_addr);
+
+    struct sockaddr_un unixAddress = {0};
+    unixAddress.sun_family = AF_UNIX;
+    if (UNIX_PATH) strncpy(unixAddress.sun_path, UNIX_PATH, sizeof(unixAddress.sun_path) - 1);
+
     // binding address to the socket
-    if (connect(socketFD, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) < 0)
+    int connected = family == AF_UNIX  ? connect(socketFD, (struct sockaddr *)&unixAddress, sizeof(unixAddress))
+                    : family == AF_INET6 ? connect(socketFD, (struct sockaddr *)&inet6Address, sizeof(inet6Address))
+                                         : connect(socketFD, (struct sockaddr *)&serverAddress, sizeof(serverAddress));
+    if (connected < 0)
     {
         fprintf(stderr, "Error: Failed to connect to server\n");
         exit(errno);
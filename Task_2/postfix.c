@@ -0,0 +1,790 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "postfix.h"
+#include "trace.h"
+
+// operator tables, generated from the lists in postfix.h
+#define OPERATOR_ARITY(id, name, arity) arity,
+#define SYMBOL_ENTRY(id, symbol, arity) [symbol] = OP_##id + 1,
+#define WORD_ENTRY(id, name, arity) {name, OP_##id},
+
+static const signed char ARITY[OP_COUNT] = {
+    SYMBOL_OPERATORS(OPERATOR_ARITY)
+    WORD_OPERATORS(OPERATOR_ARITY)
+};
+
+// symbol character -> operator + 1, 0 if not an operator
+static const signed char SYMBOLS[128] = {
+    SYMBOL_OPERATORS(SYMBOL_ENTRY)
+};
+
+static const struct
+{
+    const char *name;
+    char op;
+} WORDS[] = {
+    WORD_OPERATORS(WORD_ENTRY)
+};
+
+// helper function declarations
+static const char *evaluateExpression(char *string, symbolTable *symbols, float *value, char *isFloat);
+static const char *collectDependencies(char *string, symbolTable *symbols, symbol *sym);
+static void formatResult(char *string, const char *error, float value, char isFloat);
+static const char *applyOperator(int op, float *stack, int *size);
+static float minimum(float a, float b);
+static float maximum(float a, float b);
+static int findSymbol(symbolTable *symbols, const char *name);
+static int dependsOn(symbolTable *symbols, const int *deps, int ndeps, int target);
+static void propagateChange(symbolTable *symbols, int changed);
+static void appendChar(token *t, int *j, char c);
+static float tokenValue(token *t);
+
+#define isDigit(c) ((c) >= '0' && (c) <= '9')
+#define isLetter(c) (((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z'))
+#define isSpace(c) ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r')
+
+void evaluatePostfix(char *string)
+{
+    /**
+     * @brief The function evaluates postfix
+     * expression given in string
+     *
+     * After evaluation, the value is written
+     * to the string itself
+     *
+     * @arg Takes the string as argument
+     * @return void
+     *
+     */
+
+    // check if the string is valid
+    // i.e. the pointer is valid and not null
+    if (!string)
+        return;
+
+    float value;
+    char isFloat;
+    const char *error = evaluateExpression(string, NULL, &value, &isFloat);
+
+    formatResult(string, error, value, isFloat);
+}
+
+void evaluateSession(symbolTable *symbols, char *string)
+{
+    /**
+     * @brief evaluates string like evaluatePostfix,
+     * names in it are read from symbols.
+     *
+     * "<expression> store <name>" also keeps the
+     * expression under name, every stored expression
+     * using name is re-evaluated, and nothing else.
+     *
+     * the result is written to the string itself
+     */
+
+    if (!string)
+        return;
+
+    // look for a trailing "store <name>"
+    int end = strlen(string);
+    while (end && isSpace(string[end - 1]))
+        end--;
+
+    int nameStart = end;
+    while (nameStart && !isSpace(string[nameStart - 1]))
+        nameStart--;
+
+    int storeEnd = nameStart;
+    while (storeEnd && isSpace(string[storeEnd - 1]))
+        storeEnd--;
+
+    int storeStart = storeEnd - 5;
+    if (storeStart < 0 || strncmp(string + storeStart, "store", 5) || (storeStart && !isSpace(string[storeStart - 1])))
+    {
+        float value;
+        char isFloat;
+        const char *error = evaluateExpression(string, symbols, &value, &isFloat);
+
+        formatResult(string, error, value, isFloat);
+        return;
+    }
+
+    // the name has to be a plain word that is not taken by an operator
+    int index = nameStart;
+    token name = nextWord(string, &index);
+    if (!isLetter(string[nameStart]) || index != end || name.type != 3 || !strcmp(name.val, "store"))
+    {
+        strcpy(string, ERROR_NAME);
+        return;
+    }
+
+    // what is left is the expression
+    string[storeStart] = 0;
+
+    symbol stored = {0};
+    strcpy(stored.name, name.val);
+
+    // a missing name is not stored, it could never be fixed
+    const char *error = collectDependencies(string, symbols, &stored);
+    if (error)
+    {
+        free(stored.deps);
+        strcpy(string, error);
+        return;
+    }
+
+    int target = findSymbol(symbols, name.val);
+
+    if (target != -1 && dependsOn(symbols, stored.deps, stored.ndeps, target))
+    {
+        free(stored.deps);
+        strcpy(string, ERROR_CIRCULAR);
+        return;
+    }
+
+    if (target == -1)
+    {
+        if (symbols->count == MAX_SYMBOLS)
+        {
+            free(stored.deps);
+            strcpy(string, ERROR_TOO_MANY);
+            return;
+        }
+
+        if (symbols->count == symbols->capacity)
+        {
+            symbols->capacity = symbols->capacity ? 2 * symbols->capacity : 8;
+            symbols->symbols = (symbol *)realloc(symbols->symbols, symbols->capacity * sizeof(symbol));
+        }
+
+        target = symbols->count++;
+    }
+    else
+    {
+        free(symbols->symbols[target].expression);
+        free(symbols->symbols[target].deps);
+    }
+
+    stored.error = evaluateExpression(string, symbols, &stored.value, &stored.isFloat);
+    stored.expression = strdup(string);
+    symbols->symbols[target] = stored;
+
+    propagateChange(symbols, target);
+
+    formatResult(string, stored.error, stored.value, stored.isFloat);
+}
+
+void symbolTableFree(symbolTable *symbols)
+{
+    /**
+     * @brief releases every stored expression,
+     * the table is empty afterwards
+     */
+
+    for (int i = 0; i < symbols->count; i++)
+    {
+        free(symbols->symbols[i].expression);
+        free(symbols->symbols[i].deps);
+    }
+
+    free(symbols->symbols);
+    symbols->symbols = 0;
+    symbols->count = 0;
+    symbols->capacity = 0;
+}
+
+static const char *evaluateExpression(char *string, symbolTable *symbols, float *value, char *isFloat)
+{
+    /**
+     * @brief evaluates the postfix expression in string
+     * without touching it. names are looked up in symbols.
+     *
+     * @return null on success, else the error message
+     */
+
+    // get the length of the string
+    int length = strlen(string);
+
+    // operands live on a fixed array, no allocation per token
+    float stack[POSTFIX_STACK_SIZE];
+    int size = 0;
+
+    // read through the string
+    int index = 0;
+    char hasFloat = 0;
+    const char *error = 0;
+    token t;
+
+    while (!error)
+    {
+        while (isSpace(string[index]))
+            index++;
+
+        if (index >= length) // read through entire string
+            break;
+
+        t = nextToken(string, &index);
+        TRACE_PROBE2(token, t.type, index);
+        if (t.type == 2) // operator
+        {
+            error = applyOperator(t.op, stack, &size);
+            continue;
+        }
+
+        if (size == POSTFIX_STACK_SIZE)
+        {
+            error = ERROR_TOO_LONG;
+            break;
+        }
+
+        if (t.type == 0 || t.type == 1) // number
+        {
+            hasFloat |= t.type;
+            stack[size++] = tokenValue(&t);
+        }
+        else if (t.type == 3 && symbols) // variable
+        {
+            int found = findSymbol(symbols, t.val);
+            if (found == -1)
+            {
+                error = ERROR_UNKNOWN;
+                break;
+            }
+
+            symbol *sym = &symbols->symbols[found];
+            if (sym->error)
+            {
+                error = sym->error;
+                break;
+            }
+
+            hasFloat |= sym->isFloat;
+            stack[size++] = sym->value;
+        }
+        else // invalid type
+        {
+            error = ERROR_INVALID;
+        }
+    }
+
+    if (!error && size != 1) // if not a valid postfix expression
+        error = ERROR_INVALID;
+
+    if (!error && !isfinite(stack[0]))
+        error = ERROR_MATH;
+
+    *value = error ? 0 : stack[0];
+    *isFloat = hasFloat;
+
+    return error;
+}
+
+static const char *collectDependencies(char *string, symbolTable *symbols, symbol *sym)
+{
+    /**
+     * @brief records in sym every stored name the
+     * expression in string uses, whether or not
+     * evaluation would get as far as reading it
+     *
+     * @return null on success, else the error message
+     */
+
+    int length = strlen(string);
+    int index = 0;
+
+    while (index < length)
+    {
+        token t = nextToken(string, &index);
+        if (t.type == -1) // evaluation reports it
+            break;
+        if (t.type != 3)
+            continue;
+
+        int found = findSymbol(symbols, t.val);
+        if (found == -1)
+            return ERROR_UNKNOWN;
+
+        int k = 0;
+        while (k < sym->ndeps && sym->deps[k] != found)
+            k++;
+        if (k == sym->ndeps)
+        {
+            sym->deps = (int *)realloc(sym->deps, (sym->ndeps + 1) * sizeof(int));
+            sym->deps[sym->ndeps++] = found;
+        }
+    }
+
+    return 0;
+}
+
+static void formatResult(char *string, const char *error, float value, char isFloat)
+{
+    /**
+     * @brief writes the answer the client gets into string
+     */
+
+    if (error)
+    {
+        strcpy(string, error);
+        return;
+    }
+
+    // select output format, only values in int range can be printed as one
+    float ans = value;
+    if (isFloat == 0 && ans >= -2147483648.0f && ans < 2147483648.0f && ans == (int)ans)
+    {
+        sprintf(string, "%d", (int)ans);
+    }
+    else
+    {
+        sprintf(string, "%f", ans);
+    }
+}
+
+static int findSymbol(symbolTable *symbols, const char *name)
+{
+    /**
+     * @brief index of name in symbols, -1 if absent
+     */
+
+    for (int i = 0; i < symbols->count; i++)
+    {
+        if (!strcmp(symbols->symbols[i].name, name))
+            return i;
+    }
+
+    return -1;
+}
+
+static int dependsOn(symbolTable *symbols, const int *deps, int ndeps, int target)
+{
+    /**
+     * @brief whether an expression using deps uses target,
+     * directly or through other names. every symbol is
+     * searched once, however many paths lead to it
+     */
+
+    char *seen = (char *)calloc(symbols->count, 1);
+    int *stack = (int *)malloc(symbols->count * sizeof(int));
+    int size = 0, found = 0;
+
+    for (int i = 0; i < ndeps; i++)
+    {
+        if (!seen[deps[i]])
+        {
+            seen[deps[i]] = 1;
+            stack[size++] = deps[i];
+        }
+    }
+
+    while (size && !found)
+    {
+        int from = stack[--size];
+        found = from == target;
+
+        symbol *sym = &symbols->symbols[from];
+        for (int i = 0; i < sym->ndeps; i++)
+        {
+            if (!seen[sym->deps[i]])
+            {
+                seen[sym->deps[i]] = 1;
+                stack[size++] = sym->deps[i];
+            }
+        }
+    }
+
+    free(seen);
+    free(stack);
+
+    return found;
+}
+
+static void propagateChange(symbolTable *symbols, int changed)
+{
+    /**
+     * @brief re-evaluates the stored expressions that
+     * use changed, directly or not, each exactly once
+     * and only after everything it uses is up to date.
+     * every symbol and every use is looked at once
+     */
+
+    int count = symbols->count;
+
+    // the users of symbol s are users[first[s]] up to users[first[s + 1]]
+    int *first = (int *)calloc(count + 1, sizeof(int));
+    for (int i = 0; i < count; i++)
+        for (int k = 0; k < symbols->symbols[i].ndeps; k++)
+            first[symbols->symbols[i].deps[k] + 1]++;
+    for (int s = 0; s < count; s++)
+        first[s + 1] += first[s];
+
+    int *users = (int *)malloc((first[count] + 1) * sizeof(int));
+    int *waiting = (int *)malloc(count * sizeof(int));
+    memcpy(waiting, first, count * sizeof(int));
+    for (int i = 0; i < count; i++)
+        for (int k = 0; k < symbols->symbols[i].ndeps; k++)
+            users[waiting[symbols->symbols[i].deps[k]]++] = i;
+
+    // mark everything downstream of changed
+    char *dirty = (char *)calloc(count, 1);
+    int *queue = (int *)malloc(count * sizeof(int));
+    int head = 0, tail = 0;
+
+    queue[tail++] = changed;
+    while (head < tail)
+    {
+        int s = queue[head++];
+        for (int u = first[s]; u < first[s + 1]; u++)
+        {
+            if (!dirty[users[u]])
+            {
+                dirty[users[u]] = 1;
+                queue[tail++] = users[u];
+            }
+        }
+    }
+
+    // waiting counts the uses of symbols that are not up to date yet
+    head = tail = 0;
+    for (int i = 0; i < count; i++)
+    {
+        waiting[i] = 0;
+        for (int k = 0; dirty[i] && k < symbols->symbols[i].ndeps; k++)
+            waiting[i] += dirty[symbols->symbols[i].deps[k]];
+        if (dirty[i] && !waiting[i])
+            queue[tail++] = i;
+    }
+
+    // re-evaluate in dependency order
+    while (head < tail)
+    {
+        int s = queue[head++];
+        symbol *sym = &symbols->symbols[s];
+        sym->error = evaluateExpression(sym->expression, symbols, &sym->value, &sym->isFloat);
+
+        for (int u = first[s]; u < first[s + 1]; u++)
+        {
+            if (dirty[users[u]] && !--waiting[users[u]])
+                queue[tail++] = users[u];
+        }
+    }
+
+    free(first);
+    free(users);
+    free(waiting);
+    free(dirty);
+    free(queue);
+}
+
+static const char *applyOperator(int op, float *stack, int *size)
+{
+    /**
+     * @brief pops the operands of op, pushes the result
+     *
+     * the switch is dense over the operator enum, so it
+     * compiles to a jump table and + - * / cost the same
+     * however many operators are added after them
+     *
+     * @return null on success, else the error message
+     */
+
+    int arity = ARITY[op];
+    if (arity < 0) // n-ary, fold the whole stack
+        arity = *size;
+
+    if (!arity || *size < arity)
+        return ERROR_INVALID;
+
+    float *args = stack + *size - arity;
+    float a = args[0];
+    float b = arity > 1 ? args[1] : 0;
+
+    switch (op) // perform operation on basis of operator type
+    {
+    case OP_ADD:
+        a += b;
+        break;
+    case OP_SUB:
+        a -= b;
+        break;
+    case OP_MUL:
+        a *= b;
+        break;
+    case OP_DIV:
+        if (b == 0) // check division by 0
+            return ERROR_DIVISION;
+        a /= b;
+        break;
+    case OP_MOD:
+        if (b == 0)
+            return ERROR_DIVISION;
+        a = fmodf(a, b);
+        break;
+    case OP_POW:
+        a = powf(a, b);
+        break;
+    case OP_NEG:
+        a = -a;
+        break;
+    case OP_SQRT:
+        a = sqrtf(a);
+        break;
+    case OP_ABS:
+        a = fabsf(a);
+        break;
+    case OP_MIN:
+        for (int i = 1; i < arity; i++)
+            a = minimum(a, args[i]);
+        break;
+    case OP_MAX:
+        for (int i = 1; i < arity; i++)
+            a = maximum(a, args[i]);
+        break;
+    case OP_SUM:
+        for (int i = 1; i < arity; i++)
+            a += args[i];
+        break;
+    default:
+        return ERROR_INVALID;
+    }
+
+    args[0] = a;
+    *size -= arity - 1;
+
+    return 0;
+}
+
+static float minimum(float a, float b)
+{
+    /**
+     * @brief fminf with -0 below 0. fminf may return
+     * either zero, and which one depends on how the
+     * compiler expands it, so answers differed by build
+     */
+
+    if (a == b)
+        return signbit(a) ? a : b;
+
+    return fminf(a, b);
+}
+
+static float maximum(float a, float b)
+{
+    if (a == b)
+        return signbit(a) ? b : a;
+
+    return fmaxf(a, b);
+}
+
+token nextToken(char *string, int *index)
+{
+    /**
+     * @brief returns the next token starting from
+     * index
+     */
+
+    while (isSpace(string[*index]))
+        (*index)++;
+
+    token t;
+    t.val[0] = 0;
+
+    char c = string[*index];
+
+    // a minus glued to a digit is a negative literal
+    if (isDigit(c) || (c == '-' && isDigit(string[*index + 1])))
+    {
+        t = nextNumber(string, index);
+    }
+    else if (c > 0 && SYMBOLS[(int)c])
+    {
+        t = nextOperator(string, index);
+    }
+    else if (isLetter(c))
+    {
+        t = nextWord(string, index);
+    }
+    else
+    {
+        t.type = -1;
+    }
+
+    return t;
+}
+
+token nextNumber(char *string, int *index)
+{
+    /**
+     * @brief reads the next number
+     * starting from index
+     *
+     * assumes that string[index] is a
+     * numeric character or a minus sign
+     * followed by one.
+     * accepts an exponent like 1.5e-3,
+     * which makes it a floating point number
+     */
+
+    token t;
+    t.type = 0;
+    memset(t.val, 0, TOKEN_LENGTH);
+
+    // i stores the index from which next character is to be read
+    int i = (*index);
+
+    // j stores the index at which next character is to be written
+    int j = 0;
+
+    // to maintain a check if decimal point has already been encountered
+    char gotDecimalPoint = 0;
+
+    if (string[i] == '-')
+        appendChar(&t, &j, string[i++]);
+
+    // iterate over the string to fetch full number
+    while (isDigit(string[i]) || string[i] == '.')
+    {
+        if (string[i] == '.')
+        {
+            if (gotDecimalPoint)
+                break;
+            else
+                gotDecimalPoint = 1;
+        }
+
+        appendChar(&t, &j, string[i++]);
+    }
+
+    // exponent, only if digits follow the e
+    char sign = 0;
+    if (string[i] == 'e' || string[i] == 'E')
+        sign = string[i + 1] == '+' || string[i + 1] == '-';
+    if ((string[i] == 'e' || string[i] == 'E') && isDigit(string[i + 1 + sign]))
+    {
+        gotDecimalPoint = 1;
+
+        appendChar(&t, &j, string[i++]);
+        if (sign)
+            appendChar(&t, &j, string[i++]);
+        while (isDigit(string[i]))
+            appendChar(&t, &j, string[i++]);
+    }
+
+    // if decimal point is encountered, change type to float
+    if (gotDecimalPoint && t.type == 0)
+        t.type = 1;
+
+    // update index to new value
+    *index = i;
+
+    return t;
+}
+
+token nextOperator(char *string, int *index)
+{
+    /**
+     * @brief reads the next operator
+     * starting from index
+     *
+     * assumes that string[index] is an
+     * operator
+     */
+
+    token t;
+    t.type = 2;
+    memset(t.val, 0, TOKEN_LENGTH);
+
+    t.val[0] = string[*index];
+    t.op = SYMBOLS[(int)t.val[0]] - 1;
+    (*index)++;
+
+    return t;
+}
+
+token nextWord(char *string, int *index)
+{
+    /**
+     * @brief reads the next word starting
+     * from index and looks it up among the
+     * named operators, else it is a name
+     *
+     * assumes that string[index] is a letter
+     */
+
+    token t;
+    t.type = -1;
+    memset(t.val, 0, TOKEN_LENGTH);
+
+    int i = (*index);
+    int j = 0;
+
+    while (isLetter(string[i]) || isDigit(string[i]) || string[i] == '_')
+        appendChar(&t, &j, string[i++]);
+
+    *index = i;
+
+    // a word longer than a token stays invalid
+    if (j == TOKEN_LENGTH)
+        return t;
+
+    // anything that is not an operator names a variable
+    t.type = 3;
+
+    for (int k = 0; k < sizeof(WORDS) / sizeof(WORDS[0]); k++)
+    {
+        if (!strcmp(t.val, WORDS[k].name))
+        {
+            t.type = 2;
+            t.op = WORDS[k].op;
+            break;
+        }
+    }
+
+    return t;
+}
+
+static void appendChar(token *t, int *j, char c)
+{
+    /**
+     * @brief append c to the token value,
+     * a token that does not fit is marked
+     * invalid and j is left at TOKEN_LENGTH
+     */
+
+    if (*j < TOKEN_LENGTH - 1)
+    {
+        t->val[(*j)++] = c;
+        return;
+    }
+
+    t->type = -1;
+    *j = TOKEN_LENGTH;
+}
+
+static float tokenValue(token *t)
+{
+    /**
+     * @brief numeric value of a number token.
+     * short integers are parsed inline, they are exact
+     * in a double so the result is the same as atof's
+     */
+
+    char *c = t->val;
+    int negative = (*c == '-');
+    c += negative;
+
+    if (t->type == 0 && strlen(c) <= 9)
+    {
+        int value = 0;
+        while (*c)
+            value = value * 10 + (*c++ - '0');
+
+        // negated as a float, "-0" is -0.0 like atof's
+        return negative ? -(float)value : value;
+    }
+
+    return atof(t->val);
+}
@@ -0,0 +1,105 @@
+#ifndef POSTFIX_H
+#define POSTFIX_H
+
+#define TOKEN_LENGTH 64
+#define POSTFIX_STACK_SIZE 1024
+#define MAX_SYMBOLS 256 // stored names per session
+#define POSTFIX_ANSWER_LEN 64 // room an evaluated string needs for any answer
+
+// answers sent instead of a value
+#define ERROR_INVALID "INVALID EXPRESSION"
+#define ERROR_DIVISION "DIVISION BY ZERO"
+#define ERROR_MATH "MATH ERROR"
+#define ERROR_TOO_LONG "EXPRESSION TOO LONG"
+#define ERROR_UNKNOWN "UNKNOWN VARIABLE"
+#define ERROR_CIRCULAR "CIRCULAR REFERENCE"
+#define ERROR_NAME "INVALID NAME"
+#define ERROR_TOO_MANY "TOO MANY VARIABLES"
+#define POSTFIX_ERRORS {ERROR_INVALID, ERROR_DIVISION, ERROR_MATH, ERROR_TOO_LONG, \
+                        ERROR_UNKNOWN, ERROR_CIRCULAR, ERROR_NAME, ERROR_TOO_MANY}
+
+/**
+ * @brief operators and functions understood by the evaluator.
+ * symbols are single characters, words are spelled out.
+ * arity -1 folds every value currently on the stack.
+ *
+ * adding an operator only needs an entry here and a case
+ * in applyOperator, the tokenizer tables are generated.
+ */
+#define SYMBOL_OPERATORS(X) \
+    X(ADD, '+', 2)          \
+    X(SUB, '-', 2)          \
+    X(MUL, '*', 2)          \
+    X(DIV, '/', 2)          \
+    X(MOD, '%', 2)          \
+    X(POW, '^', 2)
+
+#define WORD_OPERATORS(X) \
+    X(NEG, "neg", 1)      \
+    X(SQRT, "sqrt", 1)    \
+    X(ABS, "abs", 1)      \
+    X(MIN, "min", -1)     \
+    X(MAX, "max", -1)     \
+    X(SUM, "sum", -1)
+
+#define OPERATOR_ENUM(id, name, arity) OP_##id,
+
+enum
+{
+    SYMBOL_OPERATORS(OPERATOR_ENUM)
+    WORD_OPERATORS(OPERATOR_ENUM)
+    OP_COUNT
+};
+
+typedef struct
+{
+    /**
+     * @brief structure used to store a token.
+     * type  0: integer number
+     * type  1: floating point number
+     * type  2: operator, op indexes the operator table
+     * type  3: name of a stored variable
+     * type -1: invalid
+     */
+    char val[TOKEN_LENGTH];
+    char type;
+    char op;
+} token;
+
+typedef struct
+{
+    /**
+     * @brief a named result kept by evaluateSession.
+     * expression is re-evaluated whenever one of the
+     * symbols listed in deps changes, error is null
+     * while value holds a valid result.
+     */
+    char name[TOKEN_LENGTH];
+    char *expression;
+    int *deps;
+    int ndeps;
+    float value;
+    char isFloat;
+    const char *error;
+} symbol;
+
+typedef struct
+{
+    /**
+     * @brief the variables of one session,
+     * deps refer to symbols by index
+     */
+    symbol *symbols;
+    int count;
+    int capacity;
+} symbolTable;
+
+void evaluatePostfix(char *string);
+void evaluateSession(symbolTable *symbols, char *string);
+void symbolTableFree(symbolTable *symbols);
+token nextToken(char *string, int *index);
+token nextNumber(char *string, int *index);
+token nextOperator(char *string, int *index);
+token nextWord(char *string, int *index);
+
+#endif
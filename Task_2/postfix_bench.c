@@ -0,0 +1,326 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "postfix.h"
+
+#define DEFAULT_ROUNDS 200
+#define CORPUS_SIZE 1000
+#define MAX_STRING_LEN 1024
+
+/**
+ * @brief throughput benchmark of evaluatePostfix against
+ * the engine it replaced (copied below as legacy*, with its
+ * missing return and stack leaks fixed so it survives the loop),
+ * on a corpus of random + - * / expressions both understand.
+ * a corpus using the extended operators is timed for the
+ * new engine alone.
+ *
+ * > gcc -O2 postfix_bench.c postfix.c -o postfix_bench -lm
+ * > ./postfix_bench [ROUNDS]
+ */
+
+// legacy engine: linked list stack, switch on the operator character
+typedef struct _node
+{
+    float val;
+    struct _node *next;
+} node;
+
+typedef struct
+{
+    node *head;
+    int size;
+} stack;
+
+static stack *makeStack()
+{
+    stack *s = (stack *)malloc(sizeof(stack));
+    s->head = 0;
+    s->size = 0;
+
+    return s;
+}
+
+static void push(stack *s, float val)
+{
+    node *n = (node *)malloc(sizeof(node));
+    n->val = val;
+    n->next = s->head;
+    s->head = n;
+    s->size += 1;
+}
+
+static float pop(stack *s)
+{
+    if (!s->head)
+        return 0;
+
+    node *temp = s->head;
+    s->head = temp->next;
+
+    float val = temp->val;
+
+    free(temp);
+    (s->size)--;
+
+    return val;
+}
+
+static token legacyNextToken(char *string, int *index)
+{
+    while (string[*index] == ' ')
+        (*index)++;
+
+    token t;
+    memset(t.val, 0, TOKEN_LENGTH);
+
+    char c = string[*index];
+    if (c >= '0' && c <= '9')
+    {
+        t.type = 0;
+
+        int i = (*index);
+        int j = 0;
+        char gotDecimalPoint = 0;
+
+        while ((string[i] >= '0' && string[i] <= '9') || string[i] == '.')
+        {
+            if (string[i] == '.')
+            {
+                if (gotDecimalPoint)
+                    break;
+                else
+                    gotDecimalPoint = 1;
+            }
+
+            t.val[j] = string[i];
+            i++;
+            j++;
+        }
+
+        if (gotDecimalPoint)
+            t.type = 1;
+
+        *index = i;
+    }
+    else if (c == '+' || c == '-' || c == '*' || c == '/')
+    {
+        t.type = 2;
+        t.val[0] = c;
+        (*index)++;
+    }
+    else
+    {
+        t.type = -1;
+    }
+
+    return t;
+}
+
+static void legacyEvaluatePostfix(char *string)
+{
+    int length = strlen(string);
+
+    stack *s = makeStack();
+
+    int index = 0;
+    char hasFloat = 0;
+    token t;
+
+    while (index < length)
+    {
+        t = legacyNextToken(string, &index);
+        if (t.type == 0 || t.type == 1)
+        {
+            hasFloat |= t.type;
+            push(s, atof(t.val));
+        }
+        else if (t.type == 2)
+        {
+            char op = t.val[0];
+            float a, b;
+
+            if (s->size < 2)
+            {
+                strcpy(string, "INVALID EXPRESSION");
+                while (s->size)
+                    pop(s);
+                free(s);
+                return;
+            }
+            b = pop(s);
+            a = pop(s);
+
+            switch (op)
+            {
+            case '+':
+                a += b;
+                break;
+            case '-':
+                a -= b;
+                break;
+            case '*':
+                a *= b;
+                break;
+            case '/':
+                if (b == 0)
+                {
+                    strcpy(string, "DIVISION BY ZERO");
+                    while (s->size)
+                        pop(s);
+                    free(s);
+                    return;
+                }
+                a /= b;
+                break;
+            }
+
+            push(s, a);
+        }
+        else
+        {
+            strcpy(string, "INVALID EXPRESSION");
+            while (s->size)
+                pop(s);
+            free(s);
+            return;
+        }
+    }
+
+    if (s->size == 1)
+    {
+        float ans = s->head->val;
+        if (ans == (int)ans && hasFloat == 0)
+            sprintf(string, "%d", (int)ans);
+        else
+            sprintf(string, "%f", ans);
+    }
+    else
+        strcpy(string, "INVALID EXPRESSION");
+
+    while (s->size)
+        pop(s);
+
+    free(s);
+}
+
+// corpus generation
+static void randomExpression(char *string, int extended)
+{
+    /**
+     * @brief writes a random valid postfix expression
+     * of 2 to 32 operands into string
+     */
+
+    static const char *basic[] = {"+", "-", "*", "/"};
+    static const char *more[] = {"+", "-", "*", "/", "%", "^", "neg", "abs", "max", "sum"};
+
+    int operands = 2 + rand() % 31;
+    int depth = 0;
+    int length = 0;
+
+    for (int pushed = 0; pushed < operands || depth > 1;)
+    {
+        if (pushed < operands && (depth < 2 || rand() % 2))
+        {
+            if (rand() % 4)
+                length += sprintf(string + length, "%d ", 1 + rand() % 99);
+            else
+                length += sprintf(string + length, "%d.%d ", rand() % 99, rand() % 10);
+            pushed++;
+            depth++;
+            continue;
+        }
+
+        const char *op = extended ? more[rand() % 10] : basic[rand() % 4];
+        length += sprintf(string + length, "%s ", op);
+
+        if (!strcmp(op, "neg") || !strcmp(op, "abs"))
+            continue;
+        if (!strcmp(op, "max") || !strcmp(op, "sum"))
+            depth = 1;
+        else
+            depth--;
+    }
+
+    // no trailing space, the legacy engine rejects it
+    string[length - 1] = 0;
+}
+
+static double elapsedNs(struct timespec start, struct timespec end)
+{
+    return (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+}
+
+static double timeEngine(void (*evaluate)(char *), char (*corpus)[MAX_STRING_LEN + 1], int rounds)
+{
+    /**
+     * @brief nanoseconds per expression of evaluate
+     * over the corpus, copying each expression first
+     * as evaluation happens in place
+     */
+
+    char buffer[MAX_STRING_LEN + 1];
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int r = 0; r < rounds; r++)
+    {
+        for (int i = 0; i < CORPUS_SIZE; i++)
+        {
+            strcpy(buffer, corpus[i]);
+            evaluate(buffer);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return elapsedNs(start, end) / ((double)rounds * CORPUS_SIZE);
+}
+
+int main(int argc, char **argv)
+{
+    int rounds = DEFAULT_ROUNDS;
+    if (argc > 1)
+        rounds = atoi(argv[1]);
+
+    srand(42);
+
+    static char basic[CORPUS_SIZE][MAX_STRING_LEN + 1];
+    static char extended[CORPUS_SIZE][MAX_STRING_LEN + 1];
+    for (int i = 0; i < CORPUS_SIZE; i++)
+    {
+        randomExpression(basic[i], 0);
+        randomExpression(extended[i], 1);
+    }
+
+    // both engines have to agree before their speed means anything
+    int mismatches = 0;
+    for (int i = 0; i < CORPUS_SIZE; i++)
+    {
+        char a[MAX_STRING_LEN + 1], b[MAX_STRING_LEN + 1];
+        strcpy(a, basic[i]);
+        strcpy(b, basic[i]);
+        legacyEvaluatePostfix(a);
+        evaluatePostfix(b);
+
+        if (strcmp(a, b) && !(strstr(b, "ERROR") && strstr(a, "inf")))
+        {
+            if (!mismatches)
+                fprintf(stderr, "mismatch on \"%s\": legacy %s, new %s\n", basic[i], a, b);
+            mismatches++;
+        }
+    }
+
+    double legacy = timeEngine(legacyEvaluatePostfix, basic, rounds);
+    double current = timeEngine(evaluatePostfix, basic, rounds);
+    double more = timeEngine(evaluatePostfix, extended, rounds);
+
+    fprintf(stdout, "corpus: %d expressions x %d rounds, %d mismatches\n", CORPUS_SIZE, rounds, mismatches);
+    fprintf(stdout, "legacy engine, + - * /     : %8.1f ns/expr\n", legacy);
+    fprintf(stdout, "new engine,    + - * /     : %8.1f ns/expr (%.2fx)\n", current, legacy / current);
+    fprintf(stdout, "new engine,    extended ops: %8.1f ns/expr\n", more);
+
+    return mismatches != 0;
+}
@@ -0,0 +1,437 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "postfix.h"
+
+#define DEFAULT_ROUNDS 1000000
+#define MAX_STRING_LEN 1024
+#define MAX_REPORTED 10
+
+/**
+ * @brief differential tester: every evaluator in CANDIDATES
+ * has to give the same answer as the reference evaluator
+ * below, on random expressions (valid ones, near misses
+ * and junk) or on the lines of stdin.
+ *
+ * the reference is written for reading, not for speed:
+ * a faster evaluator lands once it is added to CANDIDATES
+ * and this runs clean.
+ *
+ * > gcc -O2 postfix_diff.c postfix.c -o postfix_diff -lm
+ * > ./postfix_diff [ROUNDS SEED]
+ * > ./postfix_diff - < queries.txt
+ *
+ * a session whose names share their dependencies is checked
+ * first, re-storing names there has to stay linear.
+ */
+
+// reference evaluator
+static int isBlank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static int isNumeral(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static int isAlpha(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static float referenceMin(float a, float b, int max)
+{
+    // nan is ignored, -0 counts as less than 0
+    if (isnan(a) || isnan(b))
+        return isnan(a) ? b : a;
+    if (a == 0 && b == 0)
+        return (signbit(a) != 0) == max ? b : a;
+
+    return (a < b) == max ? b : a;
+}
+
+static const char *referenceOperator(const char *word, int length, float *stack, int *size)
+{
+    /**
+     * @brief apply the operator spelled by word if it is one
+     *
+     * @return null once applied, "" if word is no operator,
+     * else the error message
+     */
+
+    static const char *binary = "+-*/%^";
+    static const char *folding[] = {"min", "max", "sum"};
+    static const char *unary[] = {"neg", "sqrt", "abs"};
+
+    if (length == 1 && strchr(binary, word[0]))
+    {
+        if (*size < 2)
+            return ERROR_INVALID;
+
+        float b = stack[--*size];
+        float a = stack[--*size];
+
+        if ((word[0] == '/' || word[0] == '%') && b == 0)
+            return ERROR_DIVISION;
+
+        switch (word[0])
+        {
+        case '+':
+            stack[(*size)++] = a + b;
+            break;
+        case '-':
+            stack[(*size)++] = a - b;
+            break;
+        case '*':
+            stack[(*size)++] = a * b;
+            break;
+        case '/':
+            stack[(*size)++] = a / b;
+            break;
+        case '%':
+            stack[(*size)++] = fmodf(a, b);
+            break;
+        default:
+            stack[(*size)++] = powf(a, b);
+        }
+
+        return 0;
+    }
+
+    for (int i = 0; i < 3; i++)
+    {
+        if ((int)strlen(unary[i]) != length || strncmp(word, unary[i], length))
+            continue;
+
+        if (*size < 1)
+            return ERROR_INVALID;
+
+        float a = stack[*size - 1];
+        stack[*size - 1] = i == 0 ? -a : i == 1 ? sqrtf(a) : fabsf(a);
+
+        return 0;
+    }
+
+    for (int i = 0; i < 3; i++)
+    {
+        if ((int)strlen(folding[i]) != length || strncmp(word, folding[i], length))
+            continue;
+
+        if (*size < 1)
+            return ERROR_INVALID;
+
+        // left to right over the whole stack
+        float a = stack[0];
+        for (int k = 1; k < *size; k++)
+            a = i == 2 ? a + stack[k] : referenceMin(a, stack[k], i);
+
+        stack[0] = a;
+        *size = 1;
+
+        return 0;
+    }
+
+    return "";
+}
+
+static void referenceEvaluate(char *string)
+{
+    /**
+     * @brief the documented language: numbers (a minus glued
+     * to a digit, one decimal point, an exponent), the operators
+     * of postfix.h and nothing else. tokens are at most
+     * TOKEN_LENGTH - 1 characters, the stack holds
+     * POSTFIX_STACK_SIZE values. integer answers are printed
+     * as integers unless a literal had a point or an exponent
+     */
+
+    float stack[POSTFIX_STACK_SIZE];
+    int size = 0;
+    int isFloat = 0;
+    const char *error = 0;
+    const char *p = string;
+
+    while (!error)
+    {
+        while (isBlank(*p))
+            p++;
+        if (!*p)
+            break;
+
+        const char *start = p;
+
+        if (isNumeral(*p) || (*p == '-' && isNumeral(p[1])))
+        {
+            int points = 0, exponent = 0;
+
+            if (*p == '-')
+                p++;
+            while (isNumeral(*p) || (*p == '.' && !points))
+                points += *p++ == '.';
+
+            int sign = (*p == 'e' || *p == 'E') && (p[1] == '+' || p[1] == '-');
+            if ((*p == 'e' || *p == 'E') && isNumeral(p[1 + sign]))
+            {
+                exponent = 1;
+                p += 1 + sign;
+                while (isNumeral(*p))
+                    p++;
+            }
+
+            if (size == POSTFIX_STACK_SIZE)
+                error = ERROR_TOO_LONG;
+            else if (p - start >= TOKEN_LENGTH)
+                error = ERROR_INVALID;
+            else
+            {
+                char text[TOKEN_LENGTH] = {0};
+                memcpy(text, start, p - start);
+
+                stack[size++] = (float)strtod(text, NULL);
+                isFloat |= points || exponent;
+            }
+            continue;
+        }
+
+        if (isAlpha(*p))
+        {
+            while (isAlpha(*p) || isNumeral(*p) || *p == '_')
+                p++;
+        }
+        else if (strchr("+-*/%^", *p))
+        {
+            p++;
+        }
+
+        // a word that is no operator is a name, there are none here
+        error = p == start ? "" : referenceOperator(start, p - start, stack, &size);
+        if (error && !*error)
+            error = size == POSTFIX_STACK_SIZE ? ERROR_TOO_LONG : ERROR_INVALID;
+    }
+
+    if (!error && size != 1)
+        error = ERROR_INVALID;
+    if (!error && !isfinite(stack[0]))
+        error = ERROR_MATH;
+
+    if (error)
+        strcpy(string, error);
+    else if (!isFloat && stack[0] == floorf(stack[0]) && stack[0] >= -2147483648.0f && stack[0] < 2147483648.0f)
+        sprintf(string, "%d", (int)stack[0]);
+    else
+        sprintf(string, "%f", stack[0]);
+}
+
+// evaluators checked against the reference
+static void sessionEvaluate(char *string)
+{
+    // an empty session answers like evaluatePostfix, except that names are unknown instead of invalid
+    symbolTable symbols = {0};
+
+    evaluateSession(&symbols, string);
+    symbolTableFree(&symbols);
+
+    if (!strcmp(string, ERROR_UNKNOWN))
+        strcpy(string, ERROR_INVALID);
+}
+
+static const struct
+{
+    const char *name;
+    void (*evaluate)(char *);
+} CANDIDATES[] = {
+    {"evaluatePostfix", evaluatePostfix},
+    {"evaluateSession", sessionEvaluate},
+};
+
+// input generation
+static void appendToken(char *string, int *length)
+{
+    /**
+     * @brief one random token and separator. mostly small
+     * valid ones, with the corners of the grammar mixed in
+     */
+
+    static const char *operators[] = {"+", "-", "*", "/", "%", "^", "neg", "sqrt", "abs", "min", "max", "sum"};
+    static const char *corners[] = {
+        "0", "-0", "0.0", "1.", "-1.5", "2147483647", "2147483648", "-2147483648", "16777217",
+        "999999999", "1000000000", "3.4e38", "1e39", "-1e39", "1e-45", "1e", "1e+", "2E-3", "5e+2",
+        "1.2.3", ".5", "-.5", "--1", "-", "x", "e5", "nan", "inf", "neg1", "a_1", "\t", "#", "\x80",
+    };
+
+    int pick = rand() % 100;
+    if (pick < 45)
+        *length += sprintf(string + *length, "%d", rand() % 200 - 50);
+    else if (pick < 55)
+        *length += sprintf(string + *length, "%d.%d", rand() % 100 - 20, rand() % 1000);
+    else if (pick < 85)
+        *length += sprintf(string + *length, "%s", operators[rand() % 12]);
+    else if (pick < 97)
+        *length += sprintf(string + *length, "%s", corners[rand() % (sizeof(corners) / sizeof(corners[0]))]);
+    else
+    {
+        // a token near TOKEN_LENGTH
+        int n = TOKEN_LENGTH - 3 + rand() % 6;
+        char c = rand() % 2 ? '7' : 'q';
+        for (int i = 0; i < n; i++)
+            string[(*length)++] = c;
+    }
+
+    // usually a space, sometimes tokens run together
+    int gap = rand() % 10;
+    if (gap < 8)
+        string[(*length)++] = ' ';
+    else if (gap == 8)
+        string[(*length)++] = '\t';
+    string[*length] = 0;
+}
+
+static void randomExpression(char *string)
+{
+    int length = 0;
+    int tokens = rand() % 8 ? 1 + rand() % 12 : 1 + rand() % 200;
+
+    string[0] = 0;
+    while (tokens-- && length < MAX_STRING_LEN - 2 * TOKEN_LENGTH)
+        appendToken(string, &length);
+
+    // now and then a stack deeper than POSTFIX_STACK_SIZE
+    if (!(rand() % 200))
+    {
+        length = 0;
+        for (int i = 0; i < POSTFIX_STACK_SIZE / 2 + 2; i++)
+            length += sprintf(string + length, "1 ");
+        string[length - 1] = 0;
+    }
+}
+
+static int compare(const char *input, long *mismatches)
+{
+    /**
+     * @brief run input through the reference and every candidate
+     *
+     * @return 1 if a candidate disagreed
+     */
+
+    char expected[MAX_STRING_LEN + POSTFIX_ANSWER_LEN];
+    strcpy(expected, input);
+    referenceEvaluate(expected);
+
+    int failed = 0;
+    for (int i = 0; i < sizeof(CANDIDATES) / sizeof(CANDIDATES[0]); i++)
+    {
+        char answer[MAX_STRING_LEN + POSTFIX_ANSWER_LEN];
+        strcpy(answer, input);
+        CANDIDATES[i].evaluate(answer);
+
+        if (!strcmp(answer, expected))
+            continue;
+
+        if (*mismatches < MAX_REPORTED)
+            fprintf(stdout, "mismatch on \"%s\": reference %s, %s %s\n", input, expected, CANDIDATES[i].name,
+                    answer);
+        (*mismatches)++;
+        failed = 1;
+    }
+
+    return failed;
+}
+
+static int checkDiamondChain(long *mismatches)
+{
+    /**
+     * @brief a session of MAX_SYMBOLS names, each using the two
+     * before it, so every name is reached by exponentially many
+     * paths. storing the first again and closing a cycle have
+     * to visit each name once, or this never finishes
+     *
+     * @return 1 if an answer was wrong
+     */
+
+    symbolTable symbols = {0};
+    char query[MAX_STRING_LEN + POSTFIX_ANSWER_LEN];
+
+    strcpy(query, "1 store v0");
+    evaluateSession(&symbols, query);
+    strcpy(query, "v0 store v1");
+    evaluateSession(&symbols, query);
+    for (int i = 2; i < MAX_SYMBOLS; i++)
+    {
+        sprintf(query, "v%d v%d max store v%d", i - 1, i - 2, i);
+        evaluateSession(&symbols, query);
+    }
+
+    // storing the last name again searches the whole chain for a cycle
+    char last[64];
+    sprintf(last, "v%d v%d max store v%d", MAX_SYMBOLS - 2, MAX_SYMBOLS - 3, MAX_SYMBOLS - 1);
+
+    const char *checks[][2] = {
+        {"7 store v0", "7"},
+        {NULL, "7"},
+        {last, "7"},
+        {"v1 v0 + store v0", ERROR_CIRCULAR},
+        {NULL, "7"},
+    };
+
+    int failed = 0;
+    for (int i = 0; i < sizeof(checks) / sizeof(checks[0]); i++)
+    {
+        // null reads the last name of the chain
+        if (checks[i][0])
+            strcpy(query, checks[i][0]);
+        else
+            sprintf(query, "v%d", MAX_SYMBOLS - 1);
+        evaluateSession(&symbols, query);
+
+        if (!strcmp(query, checks[i][1]))
+            continue;
+
+        fprintf(stdout, "mismatch on the diamond chain, check %d: expected %s, evaluateSession %s\n", i,
+                checks[i][1], query);
+        (*mismatches)++;
+        failed = 1;
+    }
+
+    symbolTableFree(&symbols);
+
+    return failed;
+}
+
+int main(int argc, char **argv)
+{
+    long rounds = argc > 1 ? atol(argv[1]) : DEFAULT_ROUNDS;
+    long checked = 0, mismatches = 0;
+    char input[MAX_STRING_LEN + 1];
+
+    checkDiamondChain(&mismatches);
+
+    if (argc > 1 && !strcmp(argv[1], "-"))
+    {
+        // one query per line, as the server reads them
+        while (fgets(input, sizeof(input), stdin))
+        {
+            input[strcspn(input, "\n")] = 0;
+            compare(input, &mismatches);
+            checked++;
+        }
+    }
+    else
+    {
+        srand(argc > 2 ? atoi(argv[2]) : 1);
+
+        for (; checked < rounds; checked++)
+        {
+            randomExpression(input);
+            compare(input, &mismatches);
+        }
+    }
+
+    fprintf(stdout, "%ld expressions, %d evaluators, %ld mismatches\n", checked,
+            (int)(sizeof(CANDIDATES) / sizeof(CANDIDATES[0])), mismatches);
+
+    return mismatches != 0;
+}
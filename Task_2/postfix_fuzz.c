@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "postfix.h"
+
+#define MAX_INPUT_LEN (1 << 20)
+
+/**
+ * @brief fuzz entry points for the tokenizer and the evaluator.
+ * every input is tokenized with nextToken, evaluated with
+ * evaluatePostfix and then, line by line, with evaluateSession
+ * on one symbol table. broken invariants abort, so the
+ * fuzzer keeps the input that broke them.
+ *
+ * libFuzzer, with the sanitizers:
+ * > clang -g -O1 -fsanitize=fuzzer,address,undefined -DLIBFUZZER postfix_fuzz.c postfix.c -o postfix_fuzz -lm
+ * > ./postfix_fuzz corpus/
+ *
+ * AFL, or any compiler, runs the files given (stdin without any):
+ * > afl-gcc -O1 postfix_fuzz.c postfix.c -o postfix_fuzz -lm
+ * > afl-fuzz -i corpus -o findings ./postfix_fuzz @@
+ * > gcc -g -fsanitize=address,undefined postfix_fuzz.c postfix.c -o postfix_fuzz -lm && ./postfix_fuzz crash-*
+ */
+
+static void check(int condition, const char *what, const char *input)
+{
+    if (condition)
+        return;
+
+    fprintf(stderr, "postfix_fuzz: %s on \"%s\"\n", what, input);
+    abort();
+}
+
+static char *terminatedCopy(const uint8_t *data, size_t size, size_t room)
+{
+    /**
+     * @brief the input as the server would hand it over,
+     * a string with room for the answer after it
+     */
+
+    char *string = (char *)malloc(size + 1 + room);
+    memcpy(string, data, size);
+    string[size] = 0;
+
+    return string;
+}
+
+void fuzzNextToken(const uint8_t *data, size_t size)
+{
+    /**
+     * @brief tokenize the whole input like evaluateExpression
+     * does: every token must be terminated inside its value,
+     * move the index forward and never past the string
+     */
+
+    char *string = terminatedCopy(data, size, 0);
+    int length = strlen(string);
+    int index = 0;
+
+    while (index < length)
+    {
+        int before = index;
+        token t = nextToken(string, &index);
+
+        check(memchr(t.val, 0, TOKEN_LENGTH) != NULL, "unterminated token", string);
+        check(index <= length, "index past the string", string);
+
+        // the evaluator stops at an invalid token, anything else has to consume input
+        if (t.type == -1)
+            break;
+        check(index > before, "token without input", string);
+
+        if (t.type == 0 || t.type == 1)
+            check(t.val[0] && strlen(t.val) < TOKEN_LENGTH, "bad number", string);
+        else if (t.type == 2)
+            check(t.op >= 0 && t.op < OP_COUNT, "operator out of the table", string);
+        else
+            check(t.type == 3 && t.val[0], "unknown token type", string);
+    }
+
+    free(string);
+}
+
+void fuzzEvaluatePostfix(const uint8_t *data, size_t size)
+{
+    /**
+     * @brief evaluate the input as one expression, then each of
+     * its lines as a query of one session. the answer has to
+     * be an error message or a number within POSTFIX_ANSWER_LEN
+     */
+
+    static const char *errors[] = POSTFIX_ERRORS;
+
+    char *string = terminatedCopy(data, size, POSTFIX_ANSWER_LEN);
+    char *input = strdup(string);
+
+    evaluatePostfix(string);
+
+    check(strlen(string) < POSTFIX_ANSWER_LEN, "answer too long", input);
+
+    int known = 0;
+    for (int i = 0; i < sizeof(errors) / sizeof(errors[0]); i++)
+        known |= !strcmp(string, errors[i]);
+
+    char *end;
+    strtod(string, &end);
+    check(known || (string[0] && !*end), "answer is neither a number nor an error", input);
+
+    // sessions see the same bytes one line at a time
+    symbolTable symbols = {0};
+    char *line = input;
+
+    while (line)
+    {
+        char *next = strchr(line, '\n');
+        if (next)
+            *next++ = 0;
+
+        char *query = terminatedCopy((const uint8_t *)line, strlen(line), POSTFIX_ANSWER_LEN);
+        evaluateSession(&symbols, query);
+        check(strlen(query) < POSTFIX_ANSWER_LEN && query[0], "bad session answer", line);
+        free(query);
+
+        line = next;
+    }
+
+    check(symbols.count <= MAX_SYMBOLS, "too many symbols", input);
+    symbolTableFree(&symbols);
+
+    free(input);
+    free(string);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    fuzzNextToken(data, size);
+    fuzzEvaluatePostfix(data, size);
+
+    return 0;
+}
+
+#ifndef LIBFUZZER
+
+static void runFile(FILE *file, const char *name)
+{
+    static uint8_t data[MAX_INPUT_LEN];
+    size_t size = fread(data, 1, sizeof(data), file);
+
+    if (ferror(file))
+    {
+        fprintf(stderr, "Error: Couldn't read %s\n", name);
+        exit(1);
+    }
+
+    LLVMFuzzerTestOneInput(data, size);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        runFile(stdin, "stdin");
+        return 0;
+    }
+
+    for (int i = 1; i < argc; i++)
+    {
+        FILE *file = fopen(argv[i], "rb");
+        if (!file)
+        {
+            fprintf(stderr, "Error: Couldn't open %s\n", argv[i]);
+            return 1;
+        }
+
+        runFile(file, argv[i]);
+        fclose(file);
+    }
+
+    return 0;
+}
+
+#endif
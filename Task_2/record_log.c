@@ -0,0 +1,449 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "record_log.h"
+#include "trace.h"
+
+typedef struct
+{
+    /**
+     * @brief the log of this process. batch takes the
+     * appended records, spare is the batch being committed.
+     * first_ms is when the oldest record of batch came in.
+     * durable is the last record committed, watchers are the
+     * eventfds written after a commit. broken is set once a
+     * commit failed. everything but fd, durable and broken is
+     * guarded by lock
+     */
+    int fd;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    char *batch;
+    int batch_len;
+    int batch_size;
+    int batch_records;
+    char *spare;
+    int spare_size;
+    unsigned long first_ms;
+    int sync_ms;
+    int batch_bytes;
+    char stopping;
+    char broken;
+    unsigned long durable;
+    int *watchers;
+    int num_watchers;
+    pthread_t committer;
+    recordLogCounters counters;
+} recordLog;
+
+// global variables
+static recordLog LOG = {
+    .fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .sync_ms = DEFAULT_RECORDS_SYNC_MS,
+    .batch_bytes = DEFAULT_RECORDS_BATCH,
+};
+static unsigned int CRC_TABLE[256];
+static pthread_once_t CRC_TABLE_BUILT = PTHREAD_ONCE_INIT;
+extern pthread_mutex_t TERMINAL_LOG; // defined by the program using the log
+
+// function declarations
+static void *commitRecords(void *arg);
+static int writeAll(int fd, const char *data, int len);
+static void cutTornBatch(int fd, off_t end, int written);
+static void recoverTail(int fd, const char *path);
+static void buildCrcTable();
+static unsigned long nowMs();
+
+// function definitions
+int recordLogOpen(const char *path, int recover)
+{
+    /**
+     * @brief open path for appending, it is created if
+     * missing and never truncated, and start the committer
+     *
+     * @return -1 with the reason on stderr
+     */
+
+    LOG.fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (LOG.fd == -1)
+    {
+        fprintf(stderr, "Error: Couldn't open the record log %s\n", path);
+        return -1;
+    }
+
+    if (recover)
+        recoverTail(LOG.fd, path);
+
+    // the latency bound is kept on the monotonic clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&LOG.wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&LOG.committer, NULL, commitRecords, NULL))
+    {
+        fprintf(stderr, "Error: Couldn't start committing to %s\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+void recordLogTune(int syncMs, int batchBytes)
+{
+    pthread_mutex_lock(&LOG.lock);
+    LOG.sync_ms = syncMs;
+    LOG.batch_bytes = batchBytes;
+    pthread_cond_signal(&LOG.wake);
+    pthread_mutex_unlock(&LOG.lock);
+}
+
+unsigned long recordLogAppend(const char *record, int len)
+{
+    /**
+     * @brief add one record, without its newline, to the
+     * batch. it is on disk once the batch is committed
+     *
+     * @return its number, durable once recordLogDurable reaches it
+     */
+
+    char checksum[RECORD_CHECKSUM_LEN + 2];
+    snprintf(checksum, sizeof(checksum), " %08x\n", recordChecksum(record, len));
+
+    pthread_mutex_lock(&LOG.lock);
+
+    // the committer is gone or about to be, and the file with it, or can't commit any more
+    if (LOG.stopping || LOG.broken)
+    {
+        LOG.counters.failed++;
+        pthread_mutex_unlock(&LOG.lock);
+        return RECORD_REFUSED;
+    }
+
+    int need = LOG.batch_len + len + RECORD_CHECKSUM_LEN + 1;
+    if (need > LOG.batch_size)
+    {
+        LOG.batch_size = need > 2 * LOG.batch_size ? need : 2 * LOG.batch_size;
+        LOG.batch = (char *)realloc(LOG.batch, LOG.batch_size);
+    }
+
+    // the committer sleeps until a batch starts, or fills up
+    if (!LOG.batch_len)
+    {
+        LOG.first_ms = nowMs();
+        pthread_cond_signal(&LOG.wake);
+    }
+    else if (LOG.batch_len < LOG.batch_bytes && need >= LOG.batch_bytes)
+        pthread_cond_signal(&LOG.wake);
+
+    memcpy(LOG.batch + LOG.batch_len, record, len);
+    memcpy(LOG.batch + LOG.batch_len + len, checksum, RECORD_CHECKSUM_LEN + 1);
+    LOG.batch_len = need;
+    LOG.batch_records++;
+    unsigned long number = ++LOG.counters.appended;
+
+    pthread_mutex_unlock(&LOG.lock);
+
+    return number;
+}
+
+unsigned long recordLogDurable()
+{
+    return __atomic_load_n(&LOG.durable, __ATOMIC_ACQUIRE);
+}
+
+int recordLogBroken()
+{
+    return __atomic_load_n(&LOG.broken, __ATOMIC_ACQUIRE);
+}
+
+void recordLogWatch(int fd)
+{
+    pthread_mutex_lock(&LOG.lock);
+    LOG.watchers = (int *)realloc(LOG.watchers, (LOG.num_watchers + 1) * sizeof(int));
+    LOG.watchers[LOG.num_watchers++] = fd;
+    pthread_mutex_unlock(&LOG.lock);
+}
+
+void recordLogClose()
+{
+    /**
+     * @brief commit whatever is left and close the log
+     */
+
+    if (LOG.fd == -1)
+        return;
+
+    pthread_mutex_lock(&LOG.lock);
+    LOG.stopping = 1;
+    pthread_cond_signal(&LOG.wake);
+    pthread_mutex_unlock(&LOG.lock);
+
+    pthread_join(LOG.committer, NULL);
+    close(LOG.fd);
+    LOG.fd = -1;
+}
+
+void recordLogGetCounters(recordLogCounters *counters)
+{
+    pthread_mutex_lock(&LOG.lock);
+    *counters = LOG.counters;
+    pthread_mutex_unlock(&LOG.lock);
+}
+
+unsigned int recordChecksum(const char *data, int len)
+{
+    /**
+     * @brief crc32 as zlib and python's zlib.crc32 compute it
+     */
+
+    pthread_once(&CRC_TABLE_BUILT, buildCrcTable);
+
+    unsigned int crc = 0xffffffff;
+    for (int i = 0; i < len; i++)
+        crc = CRC_TABLE[(crc ^ (unsigned char)data[i]) & 0xff] ^ (crc >> 8);
+
+    return crc ^ 0xffffffff;
+}
+
+int recordVerify(char *line)
+{
+    /**
+     * @brief check one line of a log and cut its newline
+     * and checksum off in place
+     *
+     * @return 1 for a record, 0 for a line without a checksum
+     * (logs of servers before the checksums), -1 for a
+     * damaged one
+     */
+
+    int length = strlen(line);
+    while (length && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+        line[--length] = 0;
+
+    if (length < RECORD_CHECKSUM_LEN || line[length - RECORD_CHECKSUM_LEN] != ' ')
+        return 0;
+
+    char *end;
+    char *digits = line + length - RECORD_CHECKSUM_LEN + 1;
+    unsigned long checksum = strtoul(digits, &end, 16);
+    if (end != line + length || strspn(digits, "0123456789abcdef") != RECORD_CHECKSUM_LEN - 1)
+        return 0;
+
+    if (checksum != recordChecksum(line, length - RECORD_CHECKSUM_LEN))
+        return -1;
+
+    line[length - RECORD_CHECKSUM_LEN] = 0;
+    return 1;
+}
+
+static void *commitRecords(void *arg)
+{
+    /**
+     * @brief the committer: take the batch once it is due,
+     * write it and fdatasync it while the workers fill the
+     * next one. records arriving during an fdatasync are
+     * committed together by the following one
+     */
+
+    pthread_mutex_lock(&LOG.lock);
+
+    while (1)
+    {
+        while (!LOG.batch_len && !LOG.stopping)
+            pthread_cond_wait(&LOG.wake, &LOG.lock);
+        if (!LOG.batch_len)
+            break;
+
+        // more records join the batch until its oldest one is due
+        while (LOG.batch_len < LOG.batch_bytes && !LOG.stopping && nowMs() < LOG.first_ms + LOG.sync_ms)
+        {
+            unsigned long due = LOG.first_ms + LOG.sync_ms;
+            struct timespec deadline = {due / 1000, (due % 1000) * 1000000L};
+            pthread_cond_timedwait(&LOG.wake, &LOG.lock, &deadline);
+        }
+
+        char *data = LOG.batch;
+        int len = LOG.batch_len;
+        int records = LOG.batch_records;
+        unsigned long last = LOG.counters.appended;
+
+        LOG.batch = LOG.spare;
+        LOG.spare = data;
+        int size = LOG.batch_size;
+        LOG.batch_size = LOG.spare_size;
+        LOG.spare_size = size;
+        LOG.batch_len = LOG.batch_records = 0;
+
+        pthread_mutex_unlock(&LOG.lock);
+
+        TRACE_PROBE2(commit_start, records, len);
+        off_t end = lseek(LOG.fd, 0, SEEK_END);
+        int written = writeAll(LOG.fd, data, len);
+        int failed = written < len || fdatasync(LOG.fd) == -1;
+        int error = errno;
+        TRACE_PROBE2(commit_done, records, failed);
+
+        // the next batch would land after an unterminated line
+        if (written > 0 && written < len)
+            cutTornBatch(LOG.fd, end, written);
+
+        if (failed)
+        {
+            pthread_mutex_lock(&TERMINAL_LOG);
+            fprintf(stderr, "Error: Couldn't commit %d records, %s, refusing records from now on\n", records, strerror(error));
+            pthread_mutex_unlock(&TERMINAL_LOG);
+        }
+
+        pthread_mutex_lock(&LOG.lock);
+        LOG.counters.commits++;
+
+        /**
+         * @brief after a failed commit nothing is durable any
+         * more: the records appended meanwhile are dropped with
+         * it and no new ones are taken, durable stays where it is
+         */
+        if (failed)
+        {
+            LOG.counters.failed += records + LOG.batch_records;
+            LOG.batch_len = LOG.batch_records = 0;
+            __atomic_store_n(&LOG.broken, 1, __ATOMIC_RELEASE);
+        }
+        else
+        {
+            LOG.counters.committed += records;
+            __atomic_store_n(&LOG.durable, last, __ATOMIC_RELEASE);
+        }
+
+        uint64_t wake = 1;
+        for (int i = 0; i < LOG.num_watchers; i++)
+            write(LOG.watchers[i], &wake, sizeof(wake));
+    }
+
+    pthread_mutex_unlock(&LOG.lock);
+
+    return NULL;
+}
+
+static int writeAll(int fd, const char *data, int len)
+{
+    /**
+     * @return the bytes written, less than len after an error
+     */
+
+    int total = 0;
+    while (total < len)
+    {
+        int written = write(fd, data + total, len - total);
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written <= 0)
+        {
+            if (!written)
+                errno = ENOSPC;
+            break;
+        }
+
+        total += written;
+    }
+
+    return total;
+}
+
+static void cutTornBatch(int fd, off_t end, int written)
+{
+    /**
+     * @brief cut a batch that was only partly written back
+     * off the log, unless another server appended after it
+     */
+
+    int error = errno;
+    struct stat st;
+    if (end != -1 && !fstat(fd, &st) && st.st_size == end + written)
+        ftruncate(fd, end);
+    errno = error;
+}
+
+static void recoverTail(int fd, const char *path)
+{
+    /**
+     * @brief a crash during a commit can leave the last batch
+     * torn: an unterminated last line, or lines of zeros where
+     * the file grew before its data reached the disk. those are
+     * cut off. anything else stays, readers skip lines whose
+     * checksum fails
+     */
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !st.st_size)
+        return;
+
+    off_t from = st.st_size > RECORD_TAIL_SCAN ? st.st_size - RECORD_TAIL_SCAN : 0;
+    int len = st.st_size - from;
+    char *tail = (char *)malloc(len);
+
+    if (pread(fd, tail, len, from) != len)
+    {
+        free(tail);
+        return;
+    }
+
+    // keep is the length of the tail that stays
+    int keep = len;
+    while (keep && tail[keep - 1] != '\n')
+        keep--;
+
+    while (keep)
+    {
+        int start = keep - 1;
+        while (start && tail[start - 1] != '\n')
+            start--;
+
+        if (!memchr(tail + start, 0, keep - start))
+            break;
+        keep = start;
+    }
+
+    // without a newline in sight this is no torn batch
+    if (!keep && from)
+        keep = len;
+
+    if (keep < len && ftruncate(fd, from + keep) == 0)
+        fprintf(stdout, "Cut %d bytes of a torn batch off %s\n", len - keep, path);
+
+    free(tail);
+}
+
+static void buildCrcTable()
+{
+    for (unsigned int i = 0; i < 256; i++)
+    {
+        unsigned int c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        CRC_TABLE[i] = c;
+    }
+}
+
+static unsigned long nowMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000UL + now.tv_nsec / 1000000;
+}
@@ -0,0 +1,62 @@
+#ifndef RECORD_LOG_H
+#define RECORD_LOG_H
+
+#define RECORD_CHECKSUM_LEN 9        // a space and 8 hex digits end every line
+#define RECORD_TAIL_SCAN (1 << 20)   // bytes at the end of the log checked for a torn batch
+#define DEFAULT_RECORDS_SYNC_MS 0    // longest a record waits for its fdatasync to start
+#define DEFAULT_RECORDS_BATCH (1 << 20) // bytes of records that start a commit right away
+#define RECORD_REFUSED (~0UL)        // the number of a record appended after recordLogClose or a failed commit
+
+/**
+ * @brief append-only, checksummed record log.
+ *
+ * a record is one line, "<record> <crc32>\n" with the crc32
+ * (the zlib one) of the record in 8 hex digits, so a torn or
+ * damaged line is told apart from a record.
+ *
+ * recordLogAppend only copies the record into the current
+ * batch. a committer thread writes each batch with one
+ * O_APPEND write and makes it durable with one fdatasync,
+ * shared by every record in it (group commit). a batch is
+ * committed once its oldest record waited syncMs, or when it
+ * holds batchBytes. two servers may append to one log, a
+ * batch never interleaves with another.
+ *
+ * records are numbered from 1 in the order they are appended.
+ * recordLogDurable is the last one a commit finished with,
+ * every eventfd given to recordLogWatch is written after each
+ * commit, so whoever holds back answers until their records
+ * are on disk learns when to look again.
+ *
+ * a commit that failed leaves recordLogDurable where it was
+ * and breaks the log: its records, the ones appended while it
+ * ran and every later one count as failed, recordLogBroken
+ * tells, and the watchers are written so nobody keeps waiting.
+ * a batch written only in part is cut back off the file.
+ *
+ * opened with recover, a batch a crash left half written at
+ * the end of the log is cut off first. once recordLogClose
+ * started, records are refused: they count as failed and
+ * their number, RECORD_REFUSED, never becomes durable.
+ */
+
+typedef struct
+{
+    unsigned long appended;
+    unsigned long committed;
+    unsigned long commits; // fdatasyncs
+    unsigned long failed;  // records lost to write errors
+} recordLogCounters;
+
+int recordLogOpen(const char *path, int recover);
+void recordLogTune(int syncMs, int batchBytes);
+unsigned long recordLogAppend(const char *record, int len);
+unsigned long recordLogDurable();
+int recordLogBroken();
+void recordLogWatch(int fd);
+void recordLogClose();
+void recordLogGetCounters(recordLogCounters *counters);
+unsigned int recordChecksum(const char *data, int len);
+int recordVerify(char *line);
+
+#endif
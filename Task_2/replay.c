@@ -0,0 +1,712 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <string.h>
+
+#include "postfix.h"
+#include "record_log.h"
+#include "calc_client.h"
+
+#define DEFAULT_RECORDS "server_records.txt"
+#define DEFAULT_SPEEDUP 1
+#define DEFAULT_PORT 8080
+#define DEFAULT_INTERFACE "127.0.0.1"
+#define MAX_STRING_LEN 1024
+#define MAX_REPORTED_MISMATCHES 10
+#define MAX_EVENTS 64
+
+/**
+ * @brief replays a server_records.txt against a running server.
+ *
+ * every client of every server run in the records becomes
+ * one connection sending its queries in order, at their original
+ * offsets divided by SPEEDUP (0 sends as fast as possible).
+ * the connections are in line mode and one epoll loop drives
+ * them all: a query goes out at its time even while earlier
+ * ones wait for their answers, as the recorded client sent it.
+ * answers are checked against the recorded ones and the
+ * latency of every query is reported. lines whose checksum
+ * fails are skipped and counted.
+ *
+ * > ./replay [RECORDS SPEEDUP PORT ADDRESS]
+ */
+
+// stream states
+enum
+{
+    STREAM_WAITING,    // not connected yet
+    STREAM_CONNECTING,
+    STREAM_GREETING,   // waiting for the client id the server opens with
+    STREAM_READY,
+    STREAM_DONE
+};
+
+// data structures
+typedef struct
+{
+    char *query;
+    char *answer;
+    double at;   // seconds on the replay timeline
+    double sent; // seconds since the replay started, when it was queued
+} request;
+
+typedef struct
+{
+    /**
+     * @brief the queries of one recorded client on one
+     * connection. next is the first query not sent yet and
+     * done the first one not answered yet, the ones between
+     * are in flight and answered in order. out holds the
+     * lines the socket didn't take yet, in the bytes short
+     * of a whole answer
+     */
+    uint id;
+    double start; // connection time on the replay timeline
+    request *requests;
+    int count;
+    int capacity;
+    int fd;
+    int state;
+    uint32_t watching;
+    int next;
+    int done;
+    char *out;
+    int out_len;
+    int out_sent;
+    int out_cap;
+    char in[MAX_STRING_LEN + 2];
+    int in_len;
+    double *latencies; // microseconds per answered query
+    int answered;
+    int mismatches;
+    int failed;
+} stream;
+
+// global variables
+double SPEEDUP = DEFAULT_SPEEDUP;
+struct sockaddr_storage SERVER_ADDRESS;
+socklen_t SERVER_ADDRESS_LEN;
+struct timespec REPLAY_START;
+pthread_mutex_t TERMINAL_LOG; // record_log.c prints under it
+int REPORTED_MISMATCHES;
+int EPOLL_FD;
+int OPEN_STREAMS;
+stream **DUE; // min-heap of the streams with something left to send, by streamDue
+int DUE_COUNT;
+
+// function declarations
+int parseRecord(char *line, uint *id, char **query, char **answer, double *elapsed);
+void replayStreams(stream **all, int streams);
+void startStream(stream *s);
+void queueQuery(stream *s);
+void flushStream(stream *s);
+void readAnswers(stream *s);
+void watchStream(stream *s, uint32_t events);
+void finishStream(stream *s);
+double streamDue(stream *s);
+void duePush(stream *s);
+stream *duePop();
+double timelineNow();
+double secondsSince(struct timespec start);
+int compareLatency(const void *a, const void *b);
+
+// The main function
+int main(int argc, char **argv)
+{
+    setbuf(stdout, NULL);
+
+    const char *RECORDS = DEFAULT_RECORDS;
+    int PORT = DEFAULT_PORT;
+    const char *INTERFACE = DEFAULT_INTERFACE;
+
+    // decode arguments
+    if (argc > 1)
+        RECORDS = argv[1];
+    if (argc > 2)
+        SPEEDUP = atof(argv[2]);
+    if (argc > 3)
+        PORT = atoi(argv[3]);
+    if (argc > 4)
+        INTERFACE = argv[4];
+
+    // an address with a colon is ipv6
+    int parsed;
+    if (strchr(INTERFACE, ':'))
+    {
+        struct sockaddr_in6 *inet6Address = (struct sockaddr_in6 *)&SERVER_ADDRESS;
+        inet6Address->sin6_family = AF_INET6;
+        inet6Address->sin6_port = htons(PORT);
+        parsed = inet_pton(AF_INET6, INTERFACE, &inet6Address->sin6_addr);
+        SERVER_ADDRESS_LEN = sizeof(struct sockaddr_in6);
+    }
+    else
+    {
+        struct sockaddr_in *inetAddress = (struct sockaddr_in *)&SERVER_ADDRESS;
+        inetAddress->sin_family = AF_INET;
+        inetAddress->sin_port = htons(PORT);
+        parsed = inet_pton(AF_INET, INTERFACE, &inetAddress->sin_addr);
+        SERVER_ADDRESS_LEN = sizeof(struct sockaddr_in);
+    }
+
+    if (parsed != 1)
+    {
+        fprintf(stderr, "Error: Invalid address %s\n", INTERFACE);
+        exit(EINVAL);
+    }
+
+    FILE *records = fopen(RECORDS, "r");
+    if (!records)
+    {
+        fprintf(stderr, "Error: Couldn't open %s\n", RECORDS);
+        exit(errno);
+    }
+
+    /**
+     * @brief rebuild the per client streams.
+     * elapsed times are relative to each client's connection,
+     * the order of the lines is the order the server answered in.
+     * a client seen for the first time is placed so its first
+     * query lines up with the latest query before it.
+     * a "#" line starts another run of the server, the client
+     * ids start over with it.
+     */
+    stream **byId = 0;
+    uint idSlots = 0;
+    stream **all = 0;
+    int streams = 0;
+    int requests = 0;
+    int skipped = 0;
+    int corrupt = 0;
+    double now = 0;
+
+    char *line = 0;
+    size_t lineSize = 0;
+    while (getline(&line, &lineSize, records) != -1)
+    {
+        uint id;
+        char *query, *answer;
+        double elapsed;
+
+        if (recordVerify(line) == -1)
+        {
+            corrupt++;
+            continue;
+        }
+
+        if (line[0] == '#')
+        {
+            if (idSlots)
+                memset(byId, 0, idSlots * sizeof(stream *));
+            continue;
+        }
+
+        if (!parseRecord(line, &id, &query, &answer, &elapsed))
+        {
+            skipped++;
+            continue;
+        }
+
+        if (id >= idSlots)
+        {
+            uint slots = idSlots ? idSlots : 64;
+            while (slots <= id)
+                slots *= 2;
+
+            byId = (stream **)realloc(byId, slots * sizeof(stream *));
+            memset(byId + idSlots, 0, (slots - idSlots) * sizeof(stream *));
+            idSlots = slots;
+        }
+
+        stream *s = byId[id];
+        if (!s)
+        {
+            s = byId[id] = (stream *)calloc(1, sizeof(stream));
+            s->id = id;
+            s->start = now - elapsed;
+            if (s->start < 0)
+                s->start = 0;
+
+            all = (stream **)realloc(all, (streams + 1) * sizeof(stream *));
+            all[streams++] = s;
+        }
+
+        if (s->count == s->capacity)
+        {
+            s->capacity = s->capacity ? 2 * s->capacity : 16;
+            s->requests = (request *)realloc(s->requests, s->capacity * sizeof(request));
+        }
+
+        request *r = &s->requests[s->count++];
+        r->query = strdup(query);
+        r->answer = strdup(answer);
+        r->at = s->start + elapsed;
+
+        if (r->at > now)
+            now = r->at;
+        requests++;
+    }
+
+    free(line);
+    fclose(records);
+
+    fprintf(stdout, "Replaying %d queries from %d clients, %d lines skipped, %d failed their checksum, speedup %g\n",
+            requests, streams, skipped, corrupt, SPEEDUP);
+
+    // every client of a busy recording may be connected at once
+    struct rlimit files;
+    if (!getrlimit(RLIMIT_NOFILE, &files))
+    {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &REPLAY_START);
+
+    replayStreams(all, streams);
+
+    // gather the results
+    double *latencies = (double *)malloc((requests + 1) * sizeof(double));
+    int answered = 0, mismatches = 0, failed = 0;
+
+    for (int i = 0; i < streams; i++)
+    {
+        stream *s = all[i];
+
+        memcpy(latencies + answered, s->latencies, s->answered * sizeof(double));
+        answered += s->answered;
+        mismatches += s->mismatches;
+        failed += s->failed;
+    }
+
+    double duration = secondsSince(REPLAY_START);
+
+    fprintf(stdout, "\nanswered %d of %d queries in %.3f s (%.0f queries/s)\n",
+            answered, requests, duration, duration > 0 ? answered / duration : 0);
+    fprintf(stdout, "mismatched answers: %d\n", mismatches);
+    fprintf(stdout, "queries lost to connection errors: %d\n", failed);
+
+    if (answered)
+    {
+        qsort(latencies, answered, sizeof(double), compareLatency);
+
+        double total = 0;
+        for (int i = 0; i < answered; i++)
+            total += latencies[i];
+
+        fprintf(stdout, "latency (us): min %.1f  p50 %.1f  p90 %.1f  p99 %.1f  max %.1f  mean %.1f\n",
+                latencies[0], latencies[answered / 2], latencies[answered * 9 / 10],
+                latencies[answered * 99 / 100], latencies[answered - 1], total / answered);
+    }
+
+    // a failed replay is scriptable
+    return (mismatches || failed) ? 1 : 0;
+}
+
+// function definitions
+int parseRecord(char *line, uint *id, char **query, char **answer, double *elapsed)
+{
+    /**
+     * @brief split "<client_id> <query> <answer> <time_elapsed>"
+     * in place. the query may hold spaces and so may an
+     * error answer, the answer is either one of the
+     * engine's error messages or the last word.
+     *
+     * @return 1 if the line is a record, else 0
+     */
+
+    static const char *errors[] = POSTFIX_ERRORS;
+
+    int length = strlen(line);
+    while (length && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+        line[--length] = 0;
+
+    char *end;
+    *id = strtoul(line, &end, 10);
+    if (end == line || *end != ' ')
+        return 0;
+    char *rest = end + 1;
+
+    // time elapsed is the last word
+    char *last = strrchr(rest, ' ');
+    if (!last)
+        return 0;
+    *elapsed = strtod(last + 1, &end);
+    if (end == last + 1 || *end)
+        return 0;
+    *last = 0;
+
+    // the answer is what is left at the end
+    char *split = 0;
+    for (int i = 0; i < sizeof(errors) / sizeof(errors[0]); i++)
+    {
+        int n = strlen(errors[i]);
+        int m = strlen(rest);
+        if (m >= n + 1 && !strcmp(rest + m - n, errors[i]) && rest[m - n - 1] == ' ')
+        {
+            split = rest + m - n - 1;
+            break;
+        }
+    }
+    if (!split)
+        split = strrchr(rest, ' ');
+    if (!split)
+        return 0;
+
+    *split = 0;
+    *query = rest;
+    *answer = split + 1;
+
+    return 1;
+}
+
+void replayStreams(stream **all, int streams)
+{
+    /**
+     * @brief the event loop: connect every stream and queue
+     * its queries as they come due on the timeline, then
+     * read answers and send queued lines as the sockets allow,
+     * until every stream is answered or broken
+     */
+
+    EPOLL_FD = epoll_create1(0);
+    if (EPOLL_FD == -1)
+    {
+        fprintf(stderr, "Error: Couldn't create an epoll instance %d\n", errno);
+        exit(errno);
+    }
+
+    // a stream is in the heap once at most
+    DUE = (stream **)malloc((streams + 1) * sizeof(stream *));
+
+    for (int i = 0; i < streams; i++)
+    {
+        all[i]->fd = -1;
+        all[i]->latencies = (double *)malloc((all[i]->count + 1) * sizeof(double));
+        duePush(all[i]);
+    }
+    OPEN_STREAMS = streams;
+
+    struct epoll_event events[MAX_EVENTS];
+
+    while (OPEN_STREAMS)
+    {
+        double now = timelineNow();
+        while (DUE_COUNT && streamDue(DUE[0]) <= now)
+        {
+            stream *s = duePop();
+
+            if (s->state == STREAM_WAITING)
+                startStream(s);
+            else if (s->state != STREAM_DONE)
+                queueQuery(s);
+
+            if (s->state != STREAM_DONE && s->next < s->count)
+                duePush(s);
+        }
+
+        // sleep until the next query is due, scaled by SPEEDUP
+        int timeout = -1;
+        if (DUE_COUNT)
+        {
+            double wait = (streamDue(DUE[0]) - timelineNow()) / SPEEDUP;
+            timeout = wait > 0 ? (int)(wait * 1000) + 1 : 0;
+        }
+
+        int n = epoll_wait(EPOLL_FD, events, MAX_EVENTS, timeout);
+
+        for (int i = 0; i < n; i++)
+        {
+            stream *s = (stream *)events[i].data.ptr;
+
+            if (s->state == STREAM_CONNECTING)
+            {
+                int error = 0;
+                socklen_t length = sizeof(error);
+                getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+
+                if (error)
+                {
+                    fprintf(stderr, "Error: client %u failed to connect to server %d\n", s->id, error);
+                    finishStream(s);
+                    continue;
+                }
+
+                s->state = STREAM_GREETING;
+                watchStream(s, EPOLLIN);
+                continue;
+            }
+
+            if (s->state != STREAM_DONE && events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                readAnswers(s);
+            if (s->state == STREAM_READY && events[i].events & EPOLLOUT)
+                flushStream(s);
+        }
+    }
+
+    close(EPOLL_FD);
+    free(DUE);
+}
+
+void startStream(stream *s)
+{
+    /**
+     * @brief connect without blocking the loop,
+     * the hello is the first line out
+     */
+
+    s->fd = socket(SERVER_ADDRESS.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (s->fd == -1 || (connect(s->fd, (struct sockaddr *)&SERVER_ADDRESS, SERVER_ADDRESS_LEN) < 0 && errno != EINPROGRESS))
+    {
+        fprintf(stderr, "Error: client %u failed to connect to server %d\n", s->id, errno);
+        finishStream(s);
+        return;
+    }
+
+    // queries are small, don't let nagle hold them back
+    int one = 1;
+    setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    s->out_cap = strlen(CALC_LINE_HELLO) + MAX_STRING_LEN + 1;
+    s->out = (char *)malloc(s->out_cap);
+    s->out_len = strlen(CALC_LINE_HELLO);
+    memcpy(s->out, CALC_LINE_HELLO, s->out_len);
+
+    s->state = STREAM_CONNECTING;
+    watchStream(s, EPOLLOUT);
+}
+
+void queueQuery(stream *s)
+{
+    /**
+     * @brief the next query is due, its line goes out
+     * right away unless the server hasn't greeted yet
+     */
+
+    request *r = &s->requests[s->next++];
+    int length = strlen(r->query);
+
+    if (s->out_len + length + 1 > s->out_cap)
+    {
+        s->out_cap = 2 * (s->out_len + length + 1);
+        s->out = (char *)realloc(s->out, s->out_cap);
+    }
+    memcpy(s->out + s->out_len, r->query, length);
+    s->out[s->out_len + length] = '\n';
+    s->out_len += length + 1;
+
+    r->sent = secondsSince(REPLAY_START);
+
+    if (s->state == STREAM_READY)
+        flushStream(s);
+}
+
+void flushStream(stream *s)
+{
+    /**
+     * @brief send as much of the queued lines as
+     * the socket takes, the rest waits for EPOLLOUT
+     */
+
+    while (s->out_sent < s->out_len)
+    {
+        int sent = send(s->fd, s->out + s->out_sent, s->out_len - s->out_sent, MSG_NOSIGNAL);
+        if (sent == -1 && errno == EINTR)
+            continue;
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            watchStream(s, EPOLLIN | EPOLLOUT);
+            return;
+        }
+        if (sent <= 0)
+        {
+            finishStream(s);
+            return;
+        }
+
+        s->out_sent += sent;
+    }
+
+    s->out_len = s->out_sent = 0;
+    watchStream(s, EPOLLIN);
+}
+
+void readAnswers(stream *s)
+{
+    /**
+     * @brief read what arrived and match each whole
+     * answer line to the oldest query in flight
+     */
+
+    // the first bytes are the client id, nothing was sent before them
+    if (s->state == STREAM_GREETING)
+    {
+        char buffer[MAX_STRING_LEN];
+        int valread = recv(s->fd, buffer, sizeof(buffer), 0);
+        if (valread == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return;
+        if (valread <= 0)
+        {
+            finishStream(s);
+            return;
+        }
+
+        s->state = STREAM_READY;
+        flushStream(s);
+        return;
+    }
+
+    int valread = recv(s->fd, s->in + s->in_len, sizeof(s->in) - 1 - s->in_len, 0);
+    if (valread == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if (valread <= 0)
+    {
+        finishStream(s);
+        return;
+    }
+    s->in_len += valread;
+
+    int start = 0;
+    for (int i = 0; i < s->in_len; i++)
+    {
+        if (s->in[i] != '\n')
+            continue;
+
+        // an answer nobody asked for
+        if (s->done == s->next)
+        {
+            finishStream(s);
+            return;
+        }
+
+        s->in[i] = 0;
+        char *answer = s->in + start;
+        request *r = &s->requests[s->done++];
+        start = i + 1;
+
+        s->latencies[s->answered++] = (secondsSince(REPLAY_START) - r->sent) * 1e6;
+
+        if (strcmp(answer, r->answer))
+        {
+            s->mismatches++;
+            if (REPORTED_MISMATCHES++ < MAX_REPORTED_MISMATCHES)
+                fprintf(stdout, "client %u: \"%s\" recorded %s, got %s\n", s->id, r->query, r->answer, answer);
+        }
+    }
+
+    s->in_len -= start;
+    memmove(s->in, s->in + start, s->in_len);
+
+    // no answer is longer than a query may be
+    if (s->done == s->count || s->in_len == sizeof(s->in) - 1)
+        finishStream(s);
+}
+
+void watchStream(stream *s, uint32_t events)
+{
+    if (s->watching == events)
+        return;
+
+    struct epoll_event event = {events, {.ptr = s}};
+    epoll_ctl(EPOLL_FD, s->watching ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, s->fd, &event);
+    s->watching = events;
+}
+
+void finishStream(stream *s)
+{
+    /**
+     * @brief close the connection, the queries
+     * without an answer count as lost
+     */
+
+    s->failed = s->count - s->done;
+    s->state = STREAM_DONE;
+    OPEN_STREAMS--;
+
+    if (s->fd != -1)
+        close(s->fd);
+    s->fd = -1;
+
+    free(s->out);
+    s->out = 0;
+}
+
+double streamDue(stream *s)
+{
+    // when on the replay timeline the stream has something to do next
+    return s->state == STREAM_WAITING ? s->start : s->requests[s->next].at;
+}
+
+void duePush(stream *s)
+{
+    int i = DUE_COUNT++;
+    while (i && streamDue(DUE[(i - 1) / 2]) > streamDue(s))
+    {
+        DUE[i] = DUE[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    DUE[i] = s;
+}
+
+stream *duePop()
+{
+    stream *top = DUE[0];
+    stream *last = DUE[--DUE_COUNT];
+
+    int i = 0;
+    while (2 * i + 1 < DUE_COUNT)
+    {
+        int child = 2 * i + 1;
+        if (child + 1 < DUE_COUNT && streamDue(DUE[child + 1]) < streamDue(DUE[child]))
+            child++;
+        if (streamDue(DUE[child]) >= streamDue(last))
+            break;
+
+        DUE[i] = DUE[child];
+        i = child;
+    }
+    DUE[i] = last;
+
+    return top;
+}
+
+double timelineNow()
+{
+    /**
+     * @brief seconds of the recorded timeline that passed,
+     * everything is due at once without a SPEEDUP
+     */
+
+    if (SPEEDUP <= 0)
+        return 1e300;
+
+    return secondsSince(REPLAY_START) * SPEEDUP;
+}
+
+double secondsSince(struct timespec start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int compareLatency(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
@@ -1,590 +1,3696 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <errno.h>
 #include <time.h>
+#include <signal.h>
+
+#include <fcntl.h>
+#include <stddef.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sched.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include <string.h>
+#include <poll.h>
+
+#include "postfix.h"
+#include "shm_channel.h"
+#include "tls_layer.h"
+#include "trace.h"
+#include "record_log.h"
+#include "calc_client.h"
 
 #define DEFAULT_PORT 8080
 #define DEFAULT_MAX_CONN 100
+#define DEFAULT_ADDRESS "0.0.0.0"
 #define MAX_STRING_LEN 1024
-#define TOKEN_LENGTH 64
+#define SESSION_SHARDS 16 // must be a power of 2
+#define DEFAULT_IDLE_TIMEOUT 300000 // milliseconds, 0 disables
+#define DEFAULT_READ_TIMEOUT 10000  // milliseconds, 0 disables
+#define DEFAULT_WRITE_TIMEOUT 10000 // milliseconds, 0 disables
+#define TIMER_TICK_MS 10
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define MAX_EVENTS 256
+#define DRAIN_TIMEOUT 30000 // milliseconds allowed for in-flight work on shutdown
+#define HANDOFF_RETRY 1     // seconds before accepting a successor again after an error
+#define HANDOFF_PATH "server_handoff.sock"
+#define MAX_LISTENERS 16
+#define LISTENER_NAME_LEN 128
+#define CHANNEL_BATCH 256 // ring messages served per wake up, then other clients get a turn
+#define CHANNEL_EVENT 1   // tag bit of epoll data, the event is for a connection's channel
+#define ERROR_CHANNEL "CHANNEL REFUSED"
+#define SOURCE_SHARDS 16 // must be a power of 2
+#define DEFAULT_DRR_QUANTUM 1024 // query bytes a connection is served per round, longer queries take several
+#define DEFAULT_READ_LEN 16384 // bytes read at once in line mode
+#define MAX_READ_LEN 65536
+#define RECORDS_PATH "server_records.txt"
+#define CONFIG_LINE_LEN 1024
 #define DEBUG 0
 
-// global variables
-int SOCKET_FD;
-uint NEXT_CLIENT_ID;
-pthread_mutex_t TERMINAL_LOG, FILE_LOG, ASSIGN_CLIENT_ID;
-FILE *SERVER_RECORDS;
+// data structures
+typedef struct _session
+{
+    /**
+     * @brief per-client entry of the session table.
+     * id and socket never change after registration,
+     * the counters are only updated with atomic builtins
+     * so readers never need the owning thread to pause.
+     */
+    uint id;
+    int socket;
+    time_t connected_at;
+    unsigned long requests;
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+    unsigned long throttled;
+    time_t last_seen;
+    struct _session *next;
+} session;
+
+typedef struct
+{
+    /**
+     * @brief one shard of the session table.
+     * lock only guards the list links, so it is held
+     * just long enough to insert, unlink or walk the shard.
+     */
+    pthread_mutex_t lock;
+    session *head;
+} sessionShard;
+
+typedef struct _timer
+{
+    /**
+     * @brief intrusive timer linked into one slot
+     * of a timerWheel. pprev is null while the
+     * timer is not armed.
+     */
+    unsigned long expires;
+    struct _timer *next;
+    struct _timer **pprev;
+} timer;
+
+typedef struct
+{
+    /**
+     * @brief hierarchical timer wheel.
+     * a slot on level n spans 64^n ticks, timers are
+     * cascaded one level down whenever the level below
+     * wraps around, so add, delete and expire are all O(1).
+     * each wheel is owned by a single worker, no locking.
+     */
+    unsigned long now;
+    unsigned long count;
+    timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+} timerWheel;
+
+typedef struct
+{
+    /**
+     * @brief token bucket, refilled at the configured rate
+     * up to the burst whenever tokens are taken.
+     * refilled is in milliseconds of CLOCK_MONOTONIC.
+     */
+    double tokens;
+    unsigned long refilled;
+} bucket;
+
+typedef struct _source
+{
+    /**
+     * @brief rate limit shared by every client from one
+     * address. ipv4 addresses are kept ipv4-mapped, so a
+     * client counts the same on a dual-stack listener.
+     * the entry lives while connections refer to it,
+     * everything is guarded by its shard lock.
+     */
+    struct in6_addr address;
+    int refs;
+    bucket b;
+    unsigned long throttled;
+    struct _source *next;
+} source;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    source *head;
+} sourceShard;
+
+typedef struct
+{
+    /**
+     * @brief one listening socket. address is what it was
+     * opened for and name its printable form. the counters
+     * are only updated with atomic builtins, the acceptor
+     * and the workers share them. tls listeners wrap every
+     * connection in a tls session.
+     */
+    int fd;
+    char tls;
+    struct sockaddr_storage address;
+    socklen_t address_len;
+    char name[LISTENER_NAME_LEN];
+    unsigned long accepted;
+    unsigned long active;
+    unsigned long accept_errors;
+} listener;
+
+typedef struct _connection
+{
+    /**
+     * @brief state of one client connection.
+     * session has to stay the first member so a
+     * session pointer from the table is also a
+     * connection pointer.
+     *
+     * pending holds the part of a response the socket
+     * could not take yet, reading is paused until it drains.
+     * symbols keeps the variables the client stored.
+     * partial holds an unterminated line in line mode.
+     *
+     * tokens is the client's rate limit, src the one of its
+     * address. queries beyond the deficit round robin quantum
+     * or the tokens park the connection: its socket leaves
+     * epoll (watching is the interest it has there) and the
+     * worker's backlog answers the rest round by round.
+     * throttled is set while tokens are short, throttled_waiting
+     * are the queries waiting for them that were counted already.
+     *
+     * from is the listener that accepted the connection,
+     * tls its session while the listener uses tls, no query
+     * is read before handshaking is done.
+     * local clients came through a unix socket, they can
+     * move their queries onto a shared memory channel:
+     * channel_wake is written by the client, channel_peer
+     * by us. closed connections wait in the worker's closed
+     * list until the events of the current batch are handled.
+     *
+     * traced is set while the spans of the current read
+     * go to the worker's trace ring.
+     *
+     * last_record is the number of the client's latest record.
+     * answers wait until their records are durable: held is the
+     * record they wait for, the answers are kept in pending
+     * (reading stays paused) or in channel_held for the channel,
+     * and the connection is on the worker's held list.
+     *
+     * prev and next link the worker's list.
+     */
+    session s;
+    timer t;
+    symbolTable symbols;
+    int start_time;
+    struct timespec started;
+    char *pending;
+    int pending_len;
+    int pending_sent;
+    char line_mode;
+    char discarding;
+    char *partial;
+    int partial_len;
+    bucket tokens;
+    source *src;
+    int deficit;
+    uint32_t watching;
+    char parked;
+    char throttled;
+    char channel_throttled;
+    int throttled_waiting;
+    struct _connection *parked_prev;
+    struct _connection *parked_next;
+    listener *from;
+    tlsSession *tls;
+    char handshaking;
+    char local;
+    char closed;
+    char traced;
+    shmChannel *channel;
+    int channel_wake;
+    int channel_peer;
+    unsigned long last_record;
+    unsigned long held;
+    char *channel_held; // answers, each null terminated
+    int channel_held_len;
+    int channel_held_count;
+    struct _connection *held_prev;
+    struct _connection *held_next;
+    struct _connection *prev;
+    struct _connection *next;
+} connection;
+
+typedef struct _accepted
+{
+    /**
+     * @brief a connection on its way from the acceptor
+     * to a worker. the worker allocates the connection
+     * itself, so its memory is first touched on the
+     * worker's cpu and comes from that numa node.
+     */
+    int socket;
+    listener *from;
+    struct sockaddr_storage peer;
+    uint id;
+    struct _accepted *next;
+} accepted;
+
+typedef struct
+{
+    /**
+     * @brief an event loop thread.
+     * accepted connections are queued on incoming
+     * and wake_fd is signalled, everything else is
+     * only touched by the worker itself.
+     * cpu is the one the worker is pinned to, -1 while
+     * it floats. handed and steered count the connections
+     * the acceptor gave it, steered ones because their
+     * packets arrive on its cpu.
+     * a connection has a socket and maybe a channel in
+     * epoll, closed keeps it allocated until both of its
+     * events of a batch are handled. parked lists the
+     * connections with queries left for serveBacklog,
+     * held the ones whose answers wait for the record log,
+     * the log writes wake_fd after each commit.
+     * trace is allocated once trace_sample is set,
+     * trace_tick counts the reads it samples from.
+     * quiet is odd while the loop holds no tunables.
+     */
+    int index;
+    int epoll_fd;
+    int wake_fd;
+    pthread_mutex_t lock;
+    accepted *incoming;
+    connection *connections;
+    connection *closed;
+    connection *parked;
+    connection *held;
+    char draining;
+    timerWheel wheel;
+    struct timespec started;
+    int cpu;
+    int node;
+    unsigned long handed;
+    unsigned long steered;
+    traceRing *trace;
+    unsigned long trace_tick;
+    unsigned long quiet;
+    pthread_t thread;
+} worker;
+
+typedef struct
+{
+    /**
+     * @brief the settings a SIGHUP reload may change.
+     * readers take the current set once per use with
+     * currentTunables, a reload publishes a whole new
+     * set so nobody sees half of one. a replaced set is
+     * freed once waitForReaders saw every thread that
+     * reads them hold none.
+     * timeouts are in milliseconds and 0 disables them,
+     * a rate of 0 is unlimited, socket buffers of 0 keep
+     * the kernel's size.
+     */
+    int backlog;
+    int idle_timeout;
+    int read_timeout;
+    int write_timeout;
+    double client_rate, client_burst; // queries per second and burst
+    double source_rate, source_burst;
+    int drr_quantum;
+    int max_query; // at most MAX_STRING_LEN
+    int read_len;  // at most MAX_READ_LEN
+    int socket_rcvbuf;
+    int socket_sndbuf;
+    int records_sync_ms; // longest a record waits for its fdatasync
+    int records_batch;   // bytes of records committed without waiting
+    char records_durable; // answers wait for their records' fdatasync
+    char log_connections;
+    int trace_sample; // one read in this many is traced, 0 is off
+    cpu_set_t accept_cpus; // empty while the acceptor floats
+} tunables;
+
+typedef struct
+{
+    /**
+     * @brief what only a restart changes, from the
+     * options and the config file
+     */
+    const char *listens[MAX_LISTENERS];
+    int num_listens;
+    const char *unix_paths[MAX_LISTENERS];
+    int num_unix_paths;
+    int port;
+    int workers; // 0 is one per online cpu
+    const char *tls_cert;
+    const char *tls_key;
+    const char *tls_tickets;
+    long tls_session_cache;
+} settings;
+
+// global variables
+listener LISTENERS[MAX_LISTENERS];
+int NUM_LISTENERS;
+uint NEXT_CLIENT_ID;
+pthread_mutex_t TERMINAL_LOG;
+sessionShard SESSIONS[SESSION_SHARDS];
+worker *WORKERS;
+int NUM_WORKERS;
+tunables STARTUP_TUNABLES = {
+    .backlog = DEFAULT_MAX_CONN,
+    .idle_timeout = DEFAULT_IDLE_TIMEOUT,
+    .read_timeout = DEFAULT_READ_TIMEOUT,
+    .write_timeout = DEFAULT_WRITE_TIMEOUT,
+    .drr_quantum = DEFAULT_DRR_QUANTUM,
+    .max_query = MAX_STRING_LEN,
+    .read_len = DEFAULT_READ_LEN,
+    .records_sync_ms = DEFAULT_RECORDS_SYNC_MS,
+    .records_batch = DEFAULT_RECORDS_BATCH,
+    .records_durable = 1,
+    .log_connections = 1,
+};
+tunables *TUNABLES = &STARTUP_TUNABLES;
+const char *CONFIG_PATH; // set once startup is done, reloads wait for it
+unsigned long ACCEPT_QUIET = 1; // odd while the acceptor holds no tunables
+char *STARTUP_LINES;     // the restart-only lines of the config file, "key=value\n" each
+sourceShard SOURCES[SOURCE_SHARDS];
+cpu_set_t WORKER_CPUS;          // empty while the workers float
+int WORKER_OF_CPU[CPU_SETSIZE]; // the worker pinned to each cpu, -1 for none
+pthread_t ACCEPT_THREAD;
+int STOP_FD;
+char STOPPING;
+char TAKEOVER;
+char HANDED_OFF;
+char HANDING_OFF; // accepting paused while the listeners are sent
+char ACCEPTING = 1;
+pthread_mutex_t ACCEPT_LOCK = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ACCEPT_STOPPED = PTHREAD_COND_INITIALIZER;
+
+// data structure method declarations
+void sessionRegister(session *c);
+void sessionRemove(session *c);
+void sessionTouch(session *c, int bytes_in, int bytes_out);
+void sessionForEach(void (*visit)(const session *, void *), void *arg);
+void timerLink(timerWheel *w, timer *t);
+void timerUnlink(timer *t);
+void timerAdd(timerWheel *w, timer *t, unsigned long ticks);
+void timerDelete(timerWheel *w, timer *t);
+void timerAdvance(timerWheel *w, unsigned long ticks, void (*expire)(timer *, void *), void *arg);
+unsigned long timerNext(timerWheel *w);
+int bucketTake(bucket *b, double rate, double burst, int want, unsigned long now);
+void bucketReturn(bucket *b, double burst, int tokens);
+source *sourceAcquire(const struct sockaddr *address);
+void sourceRelease(source *src);
+sourceShard *sourceShardOf(const struct in6_addr *address);
+void sourceForEach(void (*visit)(const source *, void *), void *arg);
+
+// helper function declarations
+int listenerAdd(const char *spec, int port);
+void listenerName(const struct sockaddr *address, char *name);
+void serverSetup(int MAX_CONN);
+void openListener(listener *l, int MAX_CONN);
+void serverStart();
+int resumeAccepting();
+void clientConnect();
+void *handleConnections(void *arg);
+void startWorkers();
+worker *steerConnection(int peer_socket, int *next_worker);
+int parseCpus(const char *spec, cpu_set_t *set);
+int cpuNode(int cpu);
+unsigned long workerTicks(worker *w);
+unsigned long workerMs(worker *w);
+int workerTimeout(worker *w);
+void acceptIncoming(worker *w);
+void greetClient(worker *w, connection *c);
+void continueHandshake(worker *w, connection *c);
+void serveReadable(worker *w, connection *c);
+void serveRequest(worker *w, connection *c);
+void serveQueries(worker *w, connection *c);
+int countQueries(const char *data, int len);
+int takeTokens(connection *c, int want);
+void returnTokens(connection *c, int tokens);
+void countThrottled(connection *c, int answered, int waiting);
+void watchSocket(worker *w, connection *c, uint32_t events);
+void updateParked(worker *w, connection *c);
+void serveBacklog(worker *w);
+int backlogReady(worker *w);
+unsigned long monotonicMs();
+int parseRate(const char *spec, double *rate, double *burst);
+const tunables *currentTunables();
+void tunablesHold(unsigned long *quiet);
+void tunablesRelease(unsigned long *quiet);
+void waitForReaders();
+int configLoad(const char *path, tunables *t, settings *s);
+int configApply(const char *key, const char *value, tunables *t, settings *s);
+int configInt(const char *value, long min, long max, long *result);
+void configReload();
+int traceSampled(worker *w);
+void traceWrite();
+void answerQuery(worker *w, connection *c, char *buffer, int valread);
+int receiveLocal(worker *w, connection *c, char *buffer, int len);
+void attachChannel(worker *w, connection *c, int *fds, int count);
+void serveChannel(worker *w, connection *c);
+int sendResponse(worker *w, connection *c, char *data, int len);
+int holdAnswers(worker *w, connection *c, char *data, int len);
+void releaseHeld(worker *w);
+void releaseChannel(worker *w, connection *c);
+void unholdConnection(worker *w, connection *c);
+void flushPending(worker *w, connection *c);
+void armTimeout(worker *w, connection *c);
+void closeConnection(worker *w, connection *c);
+void expireConnection(timer *t, void *arg);
+void releaseClosed(worker *w);
+void drainWorker(worker *w);
+void drainReadable(worker *w, connection *c);
+void stopServer();
+void stopWorkers();
+void takeoverListeners();
+void *handoffListener(void *arg);
+void *adminSignals(void *arg);
+void adminSignalSet(sigset_t *set);
+void printSession(const session *c, void *arg);
+void printSource(const source *src, void *arg);
+
+// The main function
+int main(int argc, char **argv)
+{
+    NEXT_CLIENT_ID = 0;
+    setbuf(stdout, NULL);
+
+    for (int i = 0; i < SESSION_SHARDS; i++)
+    {
+        pthread_mutex_init(&SESSIONS[i].lock, NULL);
+        SESSIONS[i].head = 0;
+    }
+
+    for (int i = 0; i < SOURCE_SHARDS; i++)
+        pthread_mutex_init(&SOURCES[i].lock, NULL);
+
+    /**
+     * @brief admin signals are blocked here so that every
+     * thread created later inherits the mask and only
+     * adminSignals ever receives them
+     */
+    sigset_t admin;
+    adminSignalSet(&admin);
+    pthread_sigmask(SIG_BLOCK, &admin, NULL);
+
+    // the acceptor is this thread, a reload may pin it again
+    ACCEPT_THREAD = pthread_self();
+
+    pthread_t admin_thread;
+    pthread_create(&admin_thread, NULL, adminSignals, NULL);
+
+    STOP_FD = eventfd(0, EFD_NONBLOCK);
+
+    /**
+     * @brief options come before the positional arguments
+     * and are taken in order, a later one overrides what
+     * an earlier one or the config file set.
+     * --config FILE reads settings from FILE, SIGHUP reloads
+     * the ones that are safe to change while serving,
+     * --takeover receives the listening sockets from
+     * a running server instead of binding new ones,
+     * --listen ADDRESS[:PORT] replaces the listener of the
+     * positional arguments and may be given several times,
+     * --unix PATH also listens on a unix socket for
+     * clients on this host, --tls CERT KEY serves tls on
+     * every tcp listener, --tls-tickets FILE shares the
+     * session ticket keys with the next server,
+     * --rate QPS[:BURST] limits the queries of each client,
+     * --source-rate QPS[:BURST] those of each client address,
+     * --cpus LIST runs one worker pinned to each listed cpu,
+     * --accept-cpus LIST pins the acceptor,
+     * --trace N traces one in N reads into the trace rings
+     */
+    tunables *t = &STARTUP_TUNABLES;
+    settings s = {0};
+    s.port = DEFAULT_PORT;
+    const char *configPath = 0;
+
+    while (argc > 1 && !strncmp(argv[1], "--", 2))
+    {
+        if (!strcmp(argv[1], "--takeover"))
+            TAKEOVER = 1;
+        else if (!strcmp(argv[1], "--config") && argc > 2)
+        {
+            configPath = argv[2];
+            if (configLoad(configPath, t, &s) == -1)
+                exit(EINVAL);
+            argc--;
+            argv++;
+        }
+        else if (!strcmp(argv[1], "--listen") && argc > 2 && s.num_listens < MAX_LISTENERS)
+        {
+            s.listens[s.num_listens++] = argv[2];
+            argc--;
+            argv++;
+        }
+        else if (!strcmp(argv[1], "--unix") && argc > 2 && s.num_unix_paths < MAX_LISTENERS)
+        {
+            s.unix_paths[s.num_unix_paths++] = argv[2];
+            argc--;
+            argv++;
+        }
+        else if (!strcmp(argv[1], "--tls") && argc > 3)
+        {
+            s.tls_cert = argv[2];
+            s.tls_key = argv[3];
+            argc -= 2;
+            argv += 2;
+        }
+        else if (!strcmp(argv[1], "--tls-tickets") && argc > 2)
+        {
+            s.tls_tickets = argv[2];
+            argc--;
+            argv++;
+        }
+        else if ((!strcmp(argv[1], "--rate") || !strcmp(argv[1], "--source-rate")) && argc > 2)
+        {
+            int perSource = !strcmp(argv[1], "--source-rate");
+
+            if (parseRate(argv[2], perSource ? &t->source_rate : &t->client_rate,
+                          perSource ? &t->source_burst : &t->client_burst) == -1)
+            {
+                fprintf(stderr, "Error: Invalid rate %s\n", argv[2]);
+                exit(EINVAL);
+            }
+            argc--;
+            argv++;
+        }
+        else if (!strcmp(argv[1], "--trace") && argc > 2)
+        {
+            t->trace_sample = atoi(argv[2]);
+            if (t->trace_sample < 1)
+            {
+                fprintf(stderr, "Error: Invalid trace sample %s\n", argv[2]);
+                exit(EINVAL);
+            }
+            argc--;
+            argv++;
+        }
+        else if ((!strcmp(argv[1], "--cpus") || !strcmp(argv[1], "--accept-cpus")) && argc > 2)
+        {
+            if (parseCpus(argv[2], !strcmp(argv[1], "--cpus") ? &WORKER_CPUS : &t->accept_cpus) == -1)
+            {
+                fprintf(stderr, "Error: Invalid cpu list %s\n", argv[2]);
+                exit(EINVAL);
+            }
+            argc--;
+            argv++;
+        }
+        else
+        {
+            fprintf(stderr, "Error: Unknown option %s\n", argv[1]);
+            exit(EINVAL);
+        }
+
+        argc--;
+        argv++;
+    }
+
+    /**
+     * @brief the records of every run stay, each run starts
+     * with a line of its own so client ids of two runs are
+     * told apart. a server taking over continues the run
+     * of the previous one, which is still appending: only
+     * a fresh start repairs a batch torn by a crash
+     */
+    if (recordLogOpen(RECORDS_PATH, !TAKEOVER) == -1)
+        exit(errno ? errno : EINVAL);
+    recordLogTune(t->records_sync_ms, t->records_batch);
+
+    if (!TAKEOVER)
+    {
+        char started[64];
+        time_t now = time(NULL);
+        int len = strftime(started, sizeof(started), "# server started %Y-%m-%dT%H:%M:%S", localtime(&now));
+        recordLogAppend(started, len);
+    }
+
+    const char *ADDR = DEFAULT_ADDRESS;
+
+    // decode arguments
+    // if port number is specified specifically as
+    // a command line argument, update the port
+    // value from default value
+    if (argc > 1)
+        s.port = atoi(argv[1]);
+    if (argc > 2)
+        t->backlog = atoi(argv[2]);
+    if (argc > 3)
+        ADDR = argv[3];
+    if (argc > 4)
+        t->idle_timeout = atoi(argv[4]);
+    if (argc > 5)
+        t->read_timeout = atoi(argv[5]);
+    if (argc > 6)
+        t->write_timeout = atoi(argv[6]);
+
+    // --listen addresses without a port use PORT
+    if (!s.num_listens)
+        s.listens[s.num_listens++] = ADDR;
+
+    for (int i = 0; i < s.num_listens + s.num_unix_paths; i++)
+    {
+        const char *spec = i < s.num_listens ? s.listens[i] : s.unix_paths[i - s.num_listens];
+
+        if (listenerAdd(spec, s.port) == -1)
+        {
+            fprintf(stderr, "Error: Invalid listen address %s\n", spec);
+            exit(EINVAL);
+        }
+    }
+
+    if (!s.tls_cert != !s.tls_key)
+    {
+        fprintf(stderr, "Error: A tls certificate needs its key and a key its certificate\n");
+        exit(EINVAL);
+    }
+
+    if (s.tls_cert && tlsSetup(s.tls_cert, s.tls_key, s.tls_tickets, s.tls_session_cache) == -1)
+        exit(EINVAL);
+
+    NUM_WORKERS = s.workers;
+
+    // from here on SIGHUP reloads the config file
+    __atomic_store_n(&CONFIG_PATH, configPath, __ATOMIC_RELEASE);
+
+    serverSetup(t->backlog);
+
+    tunablesHold(&ACCEPT_QUIET);
+    int traced = currentTunables()->trace_sample;
+    tunablesRelease(&ACCEPT_QUIET);
+
+    if (traced)
+        traceWrite();
+
+    // in-flight work is drained, every record is written. a worker
+    // that missed DRAIN_TIMEOUT gets its records refused from here
+    // on, answers waiting for them are never sent
+    recordLogClose();
+
+    pthread_mutex_lock(&TERMINAL_LOG);
+    fprintf(stdout, "Server stopped\n");
+    pthread_mutex_unlock(&TERMINAL_LOG);
+
+    return 0;
+}
+
+// data structure method definitions
+void sessionRegister(session *c)
+{
+    /**
+     * @brief insert the session into the shard
+     * selected by its client id
+     */
+
+    sessionShard *shard = &SESSIONS[c->id & (SESSION_SHARDS - 1)];
+
+    pthread_mutex_lock(&shard->lock);
+    c->next = shard->head;
+    shard->head = c;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void sessionRemove(session *c)
+{
+    /**
+     * @brief unlink the session from its shard.
+     * the caller still owns the memory.
+     */
+
+    sessionShard *shard = &SESSIONS[c->id & (SESSION_SHARDS - 1)];
+
+    pthread_mutex_lock(&shard->lock);
+    session **link = &shard->head;
+    while (*link && *link != c)
+        link = &(*link)->next;
+    if (*link)
+        *link = c->next;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void sessionTouch(session *c, int bytes_in, int bytes_out)
+{
+    /**
+     * @brief account one served request.
+     * lock free, readers may observe the counters
+     * mid update but never a torn value.
+     */
+
+    __atomic_add_fetch(&c->requests, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->bytes_in, bytes_in, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->bytes_out, bytes_out, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->last_seen, time(NULL), __ATOMIC_RELAXED);
+}
+
+void sessionForEach(void (*visit)(const session *, void *), void *arg)
+{
+    /**
+     * @brief call visit on every live session.
+     * shards are locked one at a time, so at most
+     * one shard is ever blocked for registration
+     * and no worker is blocked while serving requests
+     */
+
+    for (int i = 0; i < SESSION_SHARDS; i++)
+    {
+        pthread_mutex_lock(&SESSIONS[i].lock);
+        for (session *c = SESSIONS[i].head; c; c = c->next)
+            visit(c, arg);
+        pthread_mutex_unlock(&SESSIONS[i].lock);
+    }
+}
+
+void timerLink(timerWheel *w, timer *t)
+{
+    /**
+     * @brief put an armed timer in the slot
+     * matching its distance from now
+     */
+
+    unsigned long delta = t->expires - w->now;
+
+    // clamp timers beyond the range of the top level
+    if (delta >= (1UL << (TIMER_SLOT_BITS * TIMER_LEVELS)))
+    {
+        delta = (1UL << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1;
+        t->expires = w->now + delta;
+    }
+
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >= (1UL << (TIMER_SLOT_BITS * (level + 1))))
+        level++;
+
+    timer **head = &w->slots[level][(t->expires >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1)];
+
+    t->next = *head;
+    if (*head)
+        (*head)->pprev = &t->next;
+    *head = t;
+    t->pprev = head;
+}
+
+void timerUnlink(timer *t)
+{
+    /**
+     * @brief take a timer out of its slot
+     */
+
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+    t->next = 0;
+    t->pprev = 0;
+}
+
+void timerAdd(timerWheel *w, timer *t, unsigned long ticks)
+{
+    /**
+     * @brief arm t to expire ticks from now,
+     * re-arming an armed timer moves it
+     */
+
+    timerDelete(w, t);
+
+    t->expires = w->now + (ticks ? ticks : 1);
+    timerLink(w, t);
+    w->count++;
+}
+
+void timerDelete(timerWheel *w, timer *t)
+{
+    /**
+     * @brief disarm t, does nothing if
+     * it is not armed
+     */
+
+    if (!t->pprev)
+        return;
+
+    timerUnlink(t);
+    w->count--;
+}
+
+void timerAdvance(timerWheel *w, unsigned long ticks, void (*expire)(timer *, void *), void *arg)
+{
+    /**
+     * @brief move the wheel forward by ticks
+     * and call expire on every timer that ran out.
+     * expired timers are disarmed before expire is
+     * called, so it is free to release them.
+     */
+
+    // nothing armed, nothing to cascade
+    if (!w->count)
+    {
+        w->now += ticks;
+        return;
+    }
+
+    while (ticks--)
+    {
+        w->now++;
+
+        // refill lower levels whenever they wrap around
+        for (int level = 1; level < TIMER_LEVELS; level++)
+        {
+            if (w->now & ((1UL << (TIMER_SLOT_BITS * level)) - 1))
+                break;
+
+            timer **head = &w->slots[level][(w->now >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1)];
+            timer *list = *head;
+            *head = 0;
+
+            while (list)
+            {
+                timer *next = list->next;
+                timerLink(w, list);
+                list = next;
+            }
+        }
+
+        timer **head = &w->slots[0][w->now & (TIMER_SLOTS - 1)];
+        while (*head)
+        {
+            timer *t = *head;
+            timerUnlink(t);
+            w->count--;
+            expire(t, arg);
+        }
+    }
+}
+
+unsigned long timerNext(timerWheel *w)
+{
+    /**
+     * @brief ticks until the wheel has work: a level 0 slot
+     * expires, or a slot of a higher level is cascaded down.
+     * at most 64 slots per level are looked at
+     */
+
+    unsigned long next = 0;
+
+    for (int level = 0; level < TIMER_LEVELS; level++)
+    {
+        int shift = TIMER_SLOT_BITS * level;
+
+        for (unsigned long k = 1; k <= TIMER_SLOTS; k++)
+        {
+            unsigned long due = (((w->now >> shift) + k) << shift) - w->now;
+            if (next && due >= next)
+                break;
+
+            if (w->slots[level][((w->now >> shift) + k) & (TIMER_SLOTS - 1)])
+            {
+                next = due;
+                break;
+            }
+        }
+    }
+
+    return next ? next : 1;
+}
+
+// helper function definitions
+int bucketTake(bucket *b, double rate, double burst, int want, unsigned long now)
+{
+    /**
+     * @brief take up to want tokens
+     *
+     * @return the tokens taken
+     */
+
+    // another worker may have refilled a shared bucket a moment later
+    if (now > b->refilled)
+    {
+        b->tokens += (now - b->refilled) * rate / 1000;
+        if (b->tokens > burst)
+            b->tokens = burst;
+        b->refilled = now;
+    }
+
+    int taken = want < b->tokens ? want : (int)b->tokens;
+    b->tokens -= taken;
+
+    return taken;
+}
+
+void bucketReturn(bucket *b, double burst, int tokens)
+{
+    b->tokens += tokens;
+    if (b->tokens > burst)
+        b->tokens = burst;
+}
+
+source *sourceAcquire(const struct sockaddr *address)
+{
+    /**
+     * @brief find or create the entry of a client address,
+     * taking a reference for the connection
+     */
+
+    struct in6_addr key;
+
+    if (address->sa_family == AF_INET6)
+        key = ((const struct sockaddr_in6 *)address)->sin6_addr;
+    else
+    {
+        // ::ffff:a.b.c.d, what a dual-stack listener reports
+        memset(&key, 0, sizeof(key));
+        key.s6_addr[10] = key.s6_addr[11] = 0xff;
+        memcpy(&key.s6_addr[12], &((const struct sockaddr_in *)address)->sin_addr, 4);
+    }
+
+    sourceShard *shard = sourceShardOf(&key);
+
+    pthread_mutex_lock(&shard->lock);
+    source *src = shard->head;
+    while (src && memcmp(&src->address, &key, sizeof(key)))
+        src = src->next;
+
+    if (!src)
+    {
+        src = (source *)calloc(1, sizeof(source));
+        src->address = key;
+        src->b.tokens = currentTunables()->source_burst;
+        src->b.refilled = monotonicMs();
+        src->next = shard->head;
+        shard->head = src;
+    }
+    src->refs++;
+    pthread_mutex_unlock(&shard->lock);
+
+    return src;
+}
+
+void sourceRelease(source *src)
+{
+    /**
+     * @brief drop a connection's reference, the entry
+     * goes with the address's last connection
+     */
+
+    sourceShard *shard = sourceShardOf(&src->address);
+
+    pthread_mutex_lock(&shard->lock);
+    if (!--src->refs)
+    {
+        source **link = &shard->head;
+        while (*link != src)
+            link = &(*link)->next;
+        *link = src->next;
+        free(src);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+sourceShard *sourceShardOf(const struct in6_addr *address)
+{
+    unsigned hash = 0;
+    for (int i = 0; i < 16; i++)
+        hash = hash * 31 + address->s6_addr[i];
+
+    return &SOURCES[hash & (SOURCE_SHARDS - 1)];
+}
+
+void sourceForEach(void (*visit)(const source *, void *), void *arg)
+{
+    for (int i = 0; i < SOURCE_SHARDS; i++)
+    {
+        pthread_mutex_lock(&SOURCES[i].lock);
+        for (source *src = SOURCES[i].head; src; src = src->next)
+            visit(src, arg);
+        pthread_mutex_unlock(&SOURCES[i].lock);
+    }
+}
+
+int listenerAdd(const char *spec, int port)
+{
+    /**
+     * @brief add a listener for spec: a path with a slash for a
+     * unix socket, an ipv4 address, or an ipv6 address in brackets,
+     * either followed by :port or using port. a bare ipv6 address
+     * takes port too. "[::]" is dual-stack, it takes ipv4 clients
+     * as well.
+     *
+     * @return -1 if spec is not an address or there are too many
+     */
+
+    if (NUM_LISTENERS == MAX_LISTENERS)
+        return -1;
+
+    listener *l = &LISTENERS[NUM_LISTENERS];
+    memset(l, 0, sizeof(listener));
+    l->fd = -1;
+
+    if (strchr(spec, '/'))
+    {
+        struct sockaddr_un *address = (struct sockaddr_un *)&l->address;
+        if (strlen(spec) >= sizeof(address->sun_path))
+            return -1;
+
+        address->sun_family = AF_UNIX;
+        strcpy(address->sun_path, spec);
+        l->address_len = sizeof(struct sockaddr_un);
+    }
+    else
+    {
+        char host[INET6_ADDRSTRLEN] = {0};
+        const char *hostStart = spec;
+        const char *hostEnd = strrchr(spec, ':');
+
+        if (spec[0] == '[')
+        {
+            hostStart = spec + 1;
+            hostEnd = strchr(spec, ']');
+            if (!hostEnd || (hostEnd[1] && hostEnd[1] != ':'))
+                return -1;
+        }
+        else if (!hostEnd || strchr(spec, ':') != hostEnd)
+        {
+            // no port, or a bare ipv6 address
+            hostEnd = spec + strlen(spec);
+        }
+
+        if (hostEnd - hostStart >= (long)sizeof(host))
+            return -1;
+        memcpy(host, hostStart, hostEnd - hostStart);
+
+        const char *portStart = strchr(hostEnd, ':');
+        if (portStart)
+            port = atoi(portStart + 1);
+
+        struct sockaddr_in *inet = (struct sockaddr_in *)&l->address;
+        struct sockaddr_in6 *inet6 = (struct sockaddr_in6 *)&l->address;
+
+        if (inet_pton(AF_INET, host, &inet->sin_addr) == 1)
+        {
+            inet->sin_family = AF_INET;
+            inet->sin_port = htons(port);
+            l->address_len = sizeof(struct sockaddr_in);
+        }
+        else if (inet_pton(AF_INET6, host, &inet6->sin6_addr) == 1)
+        {
+            inet6->sin6_family = AF_INET6;
+            inet6->sin6_port = htons(port);
+            l->address_len = sizeof(struct sockaddr_in6);
+        }
+        else
+            return -1;
+    }
+
+    listenerName((struct sockaddr *)&l->address, l->name);
+    NUM_LISTENERS++;
+
+    return 0;
+}
+
+void listenerName(const struct sockaddr *address, char *name)
+{
+    /**
+     * @brief printable form of a listening address,
+     * also used to match listeners on takeover
+     */
+
+    char host[INET6_ADDRSTRLEN] = {0};
+
+    if (address->sa_family == AF_UNIX)
+        snprintf(name, LISTENER_NAME_LEN, "%s", ((struct sockaddr_un *)address)->sun_path);
+    else if (address->sa_family == AF_INET6)
+    {
+        const struct sockaddr_in6 *inet6 = (const struct sockaddr_in6 *)address;
+        inet_ntop(AF_INET6, &inet6->sin6_addr, host, sizeof(host));
+        snprintf(name, LISTENER_NAME_LEN, "[%s]:%d", host, ntohs(inet6->sin6_port));
+    }
+    else
+    {
+        const struct sockaddr_in *inet = (const struct sockaddr_in *)address;
+        inet_ntop(AF_INET, &inet->sin_addr, host, sizeof(host));
+        snprintf(name, LISTENER_NAME_LEN, "%s:%d", host, ntohs(inet->sin_port));
+    }
+}
+
+void serverSetup(int MAX_CONN)
+{
+    /**
+     * @brief open every listener, taking over
+     * the ones a running server already has
+     */
+
+    if (TAKEOVER)
+        takeoverListeners();
+
+    for (int i = 0; i < NUM_LISTENERS; i++)
+    {
+        if (LISTENERS[i].fd == -1)
+            openListener(&LISTENERS[i], MAX_CONN);
+
+        // unix sockets stay plaintext, they never leave the host
+        LISTENERS[i].tls = tlsEnabled() && LISTENERS[i].address.ss_family != AF_UNIX;
+    }
+
+    serverStart();
+}
+
+void openListener(listener *l, int MAX_CONN)
+{
+    // create a socket
+    int socketFD = socket(l->address.ss_family, SOCK_STREAM, 0);
+
+    if (socketFD == -1)
+    {
+        pthread_mutex_lock(&TERMINAL_LOG);
+        fprintf(stderr, "Error: Attempt to create a socket for %s failed...\n", l->name);
+        pthread_mutex_unlock(&TERMINAL_LOG);
+        exit(errno);
+    }
+    else
+    {
+        pthread_mutex_lock(&TERMINAL_LOG);
+        fprintf(stdout, "Socket Created successfully...\n");
+        pthread_mutex_unlock(&TERMINAL_LOG);
+    }
+
+    if (l->address.ss_family == AF_INET6)
+    {
+        // the any address serves ipv4 too, a specific one only itself
+        struct sockaddr_in6 *inet6 = (struct sockaddr_in6 *)&l->address;
+        int v6only = !IN6_IS_ADDR_UNSPECIFIED(&inet6->sin6_addr);
+        setsockopt(socketFD, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+    }
+
+    // a unix socket path left behind by an earlier run
+    if (l->address.ss_family == AF_UNIX)
+        unlink(((struct sockaddr_un *)&l->address)->sun_path);
+
+    // binding address to the socket
+    if (bind(socketFD, (struct sockaddr *)&l->address, l->address_len) < 0)
+    {
+        pthread_mutex_lock(&TERMINAL_LOG);
+        fprintf(stderr, "Error: Failed to bind the socket to %s\n", l->name);
+        pthread_mutex_unlock(&TERMINAL_LOG);
+        exit(errno);
+    }
+    else
+    {
+        pthread_mutex_lock(&TERMINAL_LOG);
+        fprintf(stdout, "Socket Binded successfully...\n");
+        pthread_mutex_unlock(&TERMINAL_LOG);
+    }
+
+    // convert socket to listening socket
+    if (listen(socketFD, MAX_CONN) == -1)
+    {
+        /**
+         * @note MAX_CONN is not necessarily required for
+         * our tcp server because tcp server supports
+         * retransmission. Effectively, if queue size in
+         * our case exceeds MAX_CONN, request will be declined
+         * but re-attempted in future
+         *
+         */
+        pthread_mutex_lock(&TERMINAL_LOG);
+        fprintf(stderr, "Error: Listen failed on %s\n", l->name);
+        pthread_mutex_unlock(&TERMINAL_LOG);
+        exit(errno);
+    }
+    else
+    {
+        pthread_mutex_lock(&TERMINAL_LOG);
+        fprintf(stdout, "Server Listening on %s...\n\n", l->name);
+        pthread_mutex_unlock(&TERMINAL_LOG);
+    }
+
+    l->fd = socketFD;
+}
+
+void serverStart()
+{
+    /**
+     * @brief serve the listening sockets until the
+     * server is stopped, then drain the workers
+     */
+
+    // accept loop polls, a peer process may share the sockets
+    for (int i = 0; i < NUM_LISTENERS; i++)
+        fcntl(LISTENERS[i].fd, F_SETFL, fcntl(LISTENERS[i].fd, F_GETFL) | O_NONBLOCK);
+
+    // the acceptor is this thread, the handoff thread inherits its cpus
+    tunablesHold(&ACCEPT_QUIET);
+    cpu_set_t acceptCpus = currentTunables()->accept_cpus;
+    tunablesRelease(&ACCEPT_QUIET);
+
+    if (CPU_COUNT(&acceptCpus) && pthread_setaffinity_np(ACCEPT_THREAD, sizeof(cpu_set_t), &acceptCpus))
+    {
+        fprintf(stderr, "Error: Couldn't pin the acceptor to the --accept-cpus\n");
+        exit(EINVAL);
+    }
+
+    startWorkers();
+
+    pthread_t handoff_thread;
+    pthread_create(&handoff_thread, NULL, handoffListener, NULL);
+
+    clientConnect();
+
+    // a failed handoff goes back to accepting
+    while (resumeAccepting())
+        clientConnect();
+
+    // only our descriptors go, a successor keeps listening
+    for (int i = 0; i < NUM_LISTENERS; i++)
+        close(LISTENERS[i].fd);
+
+    // the successor waits for the listeners, don't exit before they are sent
+    if (__atomic_load_n(&HANDED_OFF, __ATOMIC_ACQUIRE))
+        pthread_join(handoff_thread, NULL);
+
+    stopWorkers();
+
+    if (!HANDED_OFF)
+    {
+        unlink(HANDOFF_PATH);
+        for (int i = 0; i < NUM_LISTENERS; i++)
+            if (LISTENERS[i].address.ss_family == AF_UNIX)
+                unlink(((struct sockaddr_un *)&LISTENERS[i].address)->sun_path);
+    }
+}
+
+int resumeAccepting()
+{
+    /**
+     * @brief clientConnect returned, wait for a handoff
+     * in progress to finish
+     *
+     * @return 1 if the listeners are still ours and
+     * the server was not stopped, accepting goes on
+     */
+
+    pthread_mutex_lock(&ACCEPT_LOCK);
+    while (HANDING_OFF)
+        pthread_cond_wait(&ACCEPT_STOPPED, &ACCEPT_LOCK);
+
+    // a stop arriving now leaves STOP_FD readable again
+    uint64_t wake;
+    int resume = !HANDED_OFF && !__atomic_load_n(&STOPPING, __ATOMIC_ACQUIRE);
+    if (resume)
+        read(STOP_FD, &wake, sizeof(wake));
+    resume = resume && !__atomic_load_n(&STOPPING, __ATOMIC_ACQUIRE);
+
+    ACCEPTING = resume;
+    pthread_mutex_unlock(&ACCEPT_LOCK);
+
+    return resume;
+}
+
+void clientConnect()
+{
+    /**
+     * @brief the acceptor, every listener feeds
+     * the same workers in turn
+     */
+
+    int next_worker = 0;
+
+    // the listeners, then the stop event
+    struct pollfd fds[MAX_LISTENERS + 1];
+    for (int i = 0; i < NUM_LISTENERS; i++)
+    {
+        fds[i].fd = LISTENERS[i].fd;
+        fds[i].events = POLLIN;
+    }
+    fds[NUM_LISTENERS].fd = STOP_FD;
+    fds[NUM_LISTENERS].events = POLLIN;
+
+    tunablesHold(&ACCEPT_QUIET);
+
+    while (1)
+    {
+        if (currentTunables()->log_connections)
+        {
+            pthread_mutex_lock(&TERMINAL_LOG);
+            fprintf(stdout, "Waiting for new connection ...\n");
+            pthread_mutex_unlock(&TERMINAL_LOG);
+        }
+
+        // wait for a connection request or for the server to stop
+        tunablesRelease(&ACCEPT_QUIET);
+        while (poll(fds, NUM_LISTENERS + 1, -1) == -1 && errno == EINTR)
+            ;
+        tunablesHold(&ACCEPT_QUIET);
+
+        if (fds[NUM_LISTENERS].revents)
+        {
+            pthread_mutex_lock(&ACCEPT_LOCK);
+            ACCEPTING = 0;
+            pthread_cond_broadcast(&ACCEPT_STOPPED);
+            pthread_mutex_unlock(&ACCEPT_LOCK);
+            tunablesRelease(&ACCEPT_QUIET);
+            break;
+        }
+
+        for (int i = 0; i < NUM_LISTENERS; i++)
+        {
+            if (!fds[i].revents)
+                continue;
+
+            listener *l = &LISTENERS[i];
+
+            // attempt to accept the connection request
+            struct sockaddr_storage peer;
+            socklen_t peer_len = sizeof(peer);
+            int peer_socket = accept(l->fd, (struct sockaddr *)&peer, &peer_len);
+
+            // another process sharing the socket got it first
+            if (peer_socket == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                continue;
+
+            // handle case if couldn't connect
+            if (peer_socket == -1)
+            {
+                __atomic_fetch_add(&l->accept_errors, 1, __ATOMIC_RELAXED);
+
+                pthread_mutex_lock(&TERMINAL_LOG);
+                fprintf(stderr, "Could't connect with the client on %s %d\n", l->name, errno);
+                pthread_mutex_unlock(&TERMINAL_LOG);
+
+                continue;
+            }
+            if (currentTunables()->log_connections)
+            {
+                pthread_mutex_lock(&TERMINAL_LOG);
+                fprintf(stdout, "Connection established with socket file descriptor %d\n", peer_socket);
+                pthread_mutex_unlock(&TERMINAL_LOG);
+            }
+
+            // workers never block on a client
+            fcntl(peer_socket, F_SETFL, fcntl(peer_socket, F_GETFL) | O_NONBLOCK);
+
+            // the worker allocates the connection, this will be freed by it
+            accepted *a = (accepted *)malloc(sizeof(accepted));
+            a->socket = peer_socket;
+            a->from = l;
+            a->peer = peer;
+
+            __atomic_fetch_add(&l->accepted, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&l->active, 1, __ATOMIC_RELAXED);
+
+            // assigning a client id to the client
+            a->id = __atomic_fetch_add(&NEXT_CLIENT_ID, 1, __ATOMIC_RELAXED);
+
+            worker *w = steerConnection(peer_socket, &next_worker);
+
+            pthread_mutex_lock(&w->lock);
+            a->next = w->incoming;
+            w->incoming = a;
+            pthread_mutex_unlock(&w->lock);
+
+            uint64_t wake = 1;
+            write(w->wake_fd, &wake, sizeof(wake));
+        }
+    }
+}
+
+void startWorkers()
+{
+    /**
+     * @brief starts NUM_WORKERS event loops, one per online
+     * cpu unless the config says otherwise, or one pinned
+     * to each of the --cpus. a pinned worker is created on
+     * its cpu, so its stack, its allocations and the
+     * connections it allocates are node-local
+     */
+
+    if (CPU_COUNT(&WORKER_CPUS))
+        NUM_WORKERS = CPU_COUNT(&WORKER_CPUS);
+    else if (!NUM_WORKERS)
+        NUM_WORKERS = sysconf(_SC_NPROCESSORS_ONLN);
+    if (NUM_WORKERS < 1)
+        NUM_WORKERS = 1;
+
+    WORKERS = (worker *)calloc(NUM_WORKERS, sizeof(worker));
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        WORKER_OF_CPU[cpu] = -1;
+
+    for (int i = 0, cpu = 0; i < NUM_WORKERS; i++)
+    {
+        worker *w = &WORKERS[i];
+        w->index = i;
+        w->cpu = w->node = -1;
+        w->quiet = 1;
+        w->epoll_fd = epoll_create1(0);
+        w->wake_fd = eventfd(0, EFD_NONBLOCK);
+        pthread_mutex_init(&w->lock, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &w->started);
+
+        if (w->epoll_fd == -1 || w->wake_fd == -1)
+        {
+            pthread_mutex_lock(&TERMINAL_LOG);
+            fprintf(stderr, "Error: Couldn't create event loop for worker %d\n", i);
+            pthread_mutex_unlock(&TERMINAL_LOG);
+            exit(errno);
+        }
+
+        // a null data pointer marks the wake up descriptor
+        struct epoll_event event = {0};
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->wake_fd, &event);
+        recordLogWatch(w->wake_fd);
+
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+
+        if (CPU_COUNT(&WORKER_CPUS))
+        {
+            while (!CPU_ISSET(cpu, &WORKER_CPUS))
+                cpu++;
+
+            cpu_set_t one;
+            CPU_ZERO(&one);
+            CPU_SET(cpu, &one);
+            pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &one);
+
+            w->cpu = cpu;
+            w->node = cpuNode(cpu);
+            WORKER_OF_CPU[cpu++] = i;
+        }
+
+        if (pthread_create(&w->thread, &attr, handleConnections, w))
+        {
+            pthread_mutex_lock(&TERMINAL_LOG);
+            fprintf(stderr, "Error: Couldn't start worker %d on cpu %d\n", i, w->cpu);
+            pthread_mutex_unlock(&TERMINAL_LOG);
+            exit(EINVAL);
+        }
+        pthread_attr_destroy(&attr);
+
+        if (w->cpu != -1)
+        {
+            pthread_mutex_lock(&TERMINAL_LOG);
+            fprintf(stdout, "Worker %d pinned to cpu %d, node %d\n", i, w->cpu, w->node);
+            pthread_mutex_unlock(&TERMINAL_LOG);
+        }
+    }
+}
+
+worker *steerConnection(int peer_socket, int *next_worker)
+{
+    /**
+     * @brief the worker for a new connection. with pinned
+     * workers that is the one on the cpu the kernel received
+     * its packets on (the cpu of the nic's rss queue, or the
+     * one rps picked), so a connection's packets and its
+     * queries are handled on one core. other connections go
+     * to the next worker in turn
+     */
+
+    worker *w = 0;
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+
+    if (CPU_COUNT(&WORKER_CPUS) &&
+        !getsockopt(peer_socket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) &&
+        cpu >= 0 && cpu < CPU_SETSIZE && WORKER_OF_CPU[cpu] != -1)
+    {
+        w = &WORKERS[WORKER_OF_CPU[cpu]];
+        __atomic_fetch_add(&w->steered, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        w = &WORKERS[*next_worker];
+        *next_worker = (*next_worker + 1) % NUM_WORKERS;
+    }
+
+    __atomic_fetch_add(&w->handed, 1, __ATOMIC_RELAXED);
+
+    return w;
+}
+
+int parseCpus(const char *spec, cpu_set_t *set)
+{
+    /**
+     * @brief a cpu list like 0-3,8,10-11
+     */
+
+    CPU_ZERO(set);
+
+    while (*spec)
+    {
+        char *end;
+        long first = strtol(spec, &end, 10), last = first;
+
+        if (end == spec)
+            return -1;
+        if (*end == '-')
+        {
+            spec = end + 1;
+            last = strtol(spec, &end, 10);
+            if (end == spec)
+                return -1;
+        }
+
+        if (first < 0 || last < first || last >= CPU_SETSIZE)
+            return -1;
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, set);
+
+        if (*end == ',')
+            end++;
+        else if (*end)
+            return -1;
+        spec = end;
+    }
+
+    return CPU_COUNT(set) ? 0 : -1;
+}
+
+int cpuNode(int cpu)
+{
+    /**
+     * @brief the numa node of a cpu as sysfs links it, -1 if unknown
+     */
+
+    char path[64];
+
+    for (int node = 0; node < 1024; node++)
+    {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+        if (!access(path, F_OK))
+            return node;
+    }
+
+    return -1;
+}
+
+void *handleConnections(void *arg)
+{
+    /**
+     * @brief event loop of one worker.
+     * It serves every client handed to the worker
+     * and expires the ones that stay silent too long.
+     *
+     */
+
+    worker *w = (worker *)arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    tunablesHold(&w->quiet);
+
+    // a draining worker leaves once its last client is gone
+    while (!w->draining || w->connections)
+    {
+        // nothing read from the tunables outlives an iteration
+        int timeout = workerTimeout(w);
+        tunablesRelease(&w->quiet);
+        int n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, timeout);
+        tunablesHold(&w->quiet);
+
+        /**
+         * @brief an empty wheel may have slept for a long time,
+         * bring it up to date before arming new timers.
+         * nothing can expire on an empty wheel, so no connection
+         * in events gets released under our feet
+         */
+        if (!w->wheel.count)
+            w->wheel.now = workerTicks(w);
+
+        for (int i = 0; i < n; i++)
+        {
+            uintptr_t data = (uintptr_t)events[i].data.ptr;
+            connection *c = (connection *)(data & ~(uintptr_t)CHANNEL_EVENT);
+
+            if (!c)
+                acceptIncoming(w);
+            else if (c->closed)
+                continue;
+            else if (data & CHANNEL_EVENT)
+                serveChannel(w, c);
+            else if (c->handshaking)
+                continueHandshake(w, c);
+            else if (c->pending)
+                flushPending(w, c);
+            else
+                serveReadable(w, c);
+        }
+
+        // answers whose records were committed meanwhile go out
+        if (w->held)
+            releaseHeld(w);
+
+        // one more round for the parked clients, after everyone who had something to read
+        serveBacklog(w);
+
+        if (!w->draining && __atomic_load_n(&STOPPING, __ATOMIC_ACQUIRE))
+            drainWorker(w);
+
+        // expire whatever ran out meanwhile
+        timerAdvance(&w->wheel, workerTicks(w) - w->wheel.now, expireConnection, w);
+
+        releaseClosed(w);
+    }
+
+    releaseClosed(w);
+    tunablesRelease(&w->quiet);
+
+    return NULL;
+}
+
+unsigned long workerTicks(worker *w)
+{
+    /**
+     * @brief timer ticks elapsed since the worker started
+     */
+
+    return workerMs(w) / TIMER_TICK_MS;
+}
+
+unsigned long workerMs(worker *w)
+{
+    /**
+     * @brief milli seconds elapsed since the worker started,
+     * clock_gettime is served by the vdso so this costs no syscall
+     */
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - w->started.tv_sec) * 1000 + (now.tv_nsec - w->started.tv_nsec) / 1000000;
+}
+
+int workerTimeout(worker *w)
+{
+    /**
+     * @brief how long epoll_wait may sleep: not at all while
+     * the backlog has queries to answer, a tick while some
+     * client waits for tokens, else until the wheel's next
+     * expiry or cascade, for ever with nothing armed
+     */
+
+    if (backlogReady(w))
+        return 0;
+    if (w->parked)
+        return TIMER_TICK_MS;
+    if (!w->wheel.count)
+        return -1;
+
+    unsigned long due = (w->wheel.now + timerNext(&w->wheel)) * TIMER_TICK_MS;
+    unsigned long now = workerMs(w);
+
+    return due > now ? due - now : 0;
+}
+
+void acceptIncoming(worker *w)
+{
+    /**
+     * @brief take over the connections queued
+     * by clientConnect for this worker
+     */
+
+    uint64_t wake;
+    read(w->wake_fd, &wake, sizeof(wake));
+
+    const tunables *cfg = currentTunables();
+
+    pthread_mutex_lock(&w->lock);
+    accepted *list = w->incoming;
+    w->incoming = 0;
+    pthread_mutex_unlock(&w->lock);
+
+    while (list)
+    {
+        accepted *a = list;
+        list = list->next;
+
+        // allocated on this worker's cpu, freed by it too
+        connection *c = (connection *)calloc(1, sizeof(connection));
+        c->s.socket = a->socket;
+        c->s.id = a->id;
+        c->from = a->from;
+        TRACE_PROBE2(connection_open, c->s.id, c->s.socket);
+        c->local = a->from->address.ss_family == AF_UNIX;
+
+        if (cfg->socket_rcvbuf)
+            setsockopt(c->s.socket, SOL_SOCKET, SO_RCVBUF, &cfg->socket_rcvbuf, sizeof(int));
+        if (cfg->socket_sndbuf)
+            setsockopt(c->s.socket, SOL_SOCKET, SO_SNDBUF, &cfg->socket_sndbuf, sizeof(int));
+
+        // local clients have no address to limit
+        if (cfg->source_rate > 0 && !c->local)
+            c->src = sourceAcquire((struct sockaddr *)&a->peer);
+        free(a);
+
+        c->start_time = time(NULL);
+        clock_gettime(CLOCK_MONOTONIC, &c->started);
+        c->s.connected_at = c->s.last_seen = c->start_time;
+
+        c->prev = 0;
+        c->next = w->connections;
+        if (w->connections)
+            w->connections->prev = c;
+        w->connections = c;
+
+        c->tokens.tokens = cfg->client_burst;
+        c->tokens.refilled = monotonicMs();
+
+        watchSocket(w, c, EPOLLIN);
+
+        // make the client visible in the session table
+        sessionRegister(&c->s);
+
+        if (!c->from->tls)
+        {
+            greetClient(w, c);
+            continue;
+        }
+
+        // the read timeout covers the handshake
+        c->tls = tlsAccept(c->s.socket);
+        c->handshaking = 1;
+        if (c->tls)
+            armTimeout(w, c);
+        else
+            closeConnection(w, c);
+    }
+}
+
+void greetClient(worker *w, connection *c)
+{
+    // sending the client id to client
+    char id_string[1000] = {0};
+    sprintf(id_string, "%u", c->s.id);
+    sendResponse(w, c, id_string, strlen(id_string));
+}
+
+void continueHandshake(worker *w, connection *c)
+{
+    /**
+     * @brief advance the tls handshake of a new client,
+     * it is greeted with its id once the handshake is done
+     */
+
+    if (tlsHandshake(c->tls) == -1)
+    {
+        if (errno != EAGAIN)
+        {
+            pthread_mutex_lock(&TERMINAL_LOG);
+            fprintf(stderr, "TLS handshake with client %u failed\n", c->s.id);
+            pthread_mutex_unlock(&TERMINAL_LOG);
+
+            closeConnection(w, c);
+            return;
+        }
+
+        // wait for the direction the handshake is stuck on
+        watchSocket(w, c, tlsWantsWrite(c->tls) ? EPOLLOUT : EPOLLIN);
+        return;
+    }
+
+    c->handshaking = 0;
+    watchSocket(w, c, EPOLLIN);
+
+    greetClient(w, c);
+
+    // a query may have come along with the last handshake message
+    if (!c->closed && !c->pending && tlsPending(c->tls))
+        serveReadable(w, c);
+}
+
+void serveReadable(worker *w, connection *c)
+{
+    /**
+     * @brief serve a readable client. records openssl
+     * already decrypted raise no event, they are served
+     * right away unless a response is stuck
+     */
+
+    do
+        serveRequest(w, c);
+    while (c->tls && !c->closed && !c->pending && !c->parked && tlsPending(c->tls));
+}
+
+void serveRequest(worker *w, connection *c)
+{
+    /**
+     * @brief read from a readable client, evaluate
+     * the queries and queue the answers.
+     *
+     * a client gets one answer per read, as the interactive
+     * client expects, unless it opened with CALC_LINE_HELLO.
+     * the connection is then in line mode: every newline
+     * terminated line is a query, its answer is sent back
+     * newline terminated, so a client can pipeline many
+     * queries and match answers in order.
+     */
+
+    // for information exchange, a pipelining client is read in bulk
+    const tunables *cfg = currentTunables();
+    char buffer[MAX_READ_LEN + 1];
+    int len = c->line_mode ? cfg->read_len : cfg->max_query;
+
+    c->traced = traceSampled(w);
+    unsigned long readStart = c->traced ? traceNow() : 0;
+    TRACE_PROBE1(read_start, c->s.id);
+
+    // read input from client
+    int valread = c->tls     ? tlsRecv(c->tls, buffer, len)
+                  : c->local ? receiveLocal(w, c, buffer, len)
+                             : recv(c->s.socket, buffer, len, 0);
+
+    TRACE_PROBE2(read_done, c->s.id, valread);
+    if (c->traced && valread > 0)
+        traceSpan(w->trace, TRACE_READ, c->s.id, readStart, traceNow());
+
+    // spurious wake up, nothing to read yet
+    if (valread == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+
+    // if client has shutdown
+    if (valread <= 0)
+    {
+        if (cfg->log_connections)
+        {
+            pthread_mutex_lock(&TERMINAL_LOG);
+            fprintf(stderr, "Shutting down connection with client %u\n", c->s.id);
+            pthread_mutex_unlock(&TERMINAL_LOG);
+        }
+
+        closeConnection(w, c);
+        return;
+    }
+
+    // queries wait in partial, a read of its own is one query outside of line mode
+    c->partial = (char *)realloc(c->partial, c->partial_len + valread);
+    memcpy(c->partial + c->partial_len, buffer, valread);
+    c->partial_len += valread;
+
+    // a hello split over reads waits for its rest, no query starts like it
+    if (!c->line_mode && c->partial[0] == CALC_LINE_HELLO[0])
+    {
+        int helloLen = strlen(CALC_LINE_HELLO);
+        int length = c->partial_len < helloLen ? c->partial_len : helloLen;
+
+        if (!memcmp(c->partial, CALC_LINE_HELLO, length))
+        {
+            if (length < helloLen)
+                return;
+
+            c->line_mode = 1;
+            c->partial_len -= helloLen;
+            memmove(c->partial, c->partial + helloLen, c->partial_len);
+        }
+    }
+
+    serveQueries(w, c);
+}
+
+void serveQueries(worker *w, connection *c)
+{
+    /**
+     * @brief answer the queries waiting in c->partial as far as
+     * the connection's deficit round robin quantum and its token
+     * buckets allow. with queries left the connection is parked:
+     * its socket is not read until serveBacklog has answered them,
+     * so a client pipelining thousands of queries gets one quantum
+     * per round of the worker like every other client.
+     */
+
+    const tunables *cfg = currentTunables();
+    c->deficit += cfg->drr_quantum;
+
+    char *answers = 0;
+    int answers_len = 0;
+    int start = 0;
+    int granted = 0, answered = 0;
+    int quantumUsed = 0, tokensShort = 0;
+
+    // one read outside of line mode is one query
+    if (!c->line_mode && c->partial_len)
+    {
+        if (takeTokens(c, 1))
+        {
+            char query[MAX_STRING_LEN + 1] = {0};
+            memcpy(query, c->partial, c->partial_len);
+            answerQuery(w, c, query, c->partial_len);
+
+            answers = strdup(query);
+            answers_len = strlen(query);
+            start = c->partial_len;
+            answered++;
+        }
+        else
+            tokensShort = 1;
+    }
+
+    for (int i = 0; c->line_mode && i < c->partial_len; i++)
+    {
+        int lineEnd = c->partial[i] == '\n';
+
+        // the rest of an overlong line is dropped up to its newline
+        if (c->discarding)
+        {
+            c->discarding = !lineEnd;
+            start = i + 1;
+            continue;
+        }
+
+        if (!lineEnd && i - start < cfg->max_query)
+            continue;
+
+        // a whole query, if this round still has room for it
+        if (i - start + 1 > c->deficit)
+        {
+            quantumUsed = 1;
+            break;
+        }
+
+        if (!granted)
+        {
+            int window = c->partial_len - start < c->deficit ? c->partial_len - start : c->deficit;
+            granted = takeTokens(c, countQueries(c->partial + start, window));
+
+            if (!granted)
+            {
+                tokensShort = 1;
+                break;
+            }
+        }
+        granted--;
+        answered++;
+        c->deficit -= i - start + 1;
+
+        char query[MAX_STRING_LEN + 1] = {0};
+        int length = i - start;
+        if (length && c->partial[start + length - 1] == '\r')
+            length--;
+
+        if (!lineEnd)
+        {
+            strcpy(query, ERROR_TOO_LONG);
+            c->discarding = 1;
+        }
+        else
+        {
+            memcpy(query, c->partial + start, length);
+            answerQuery(w, c, query, i - start + 1);
+        }
+
+        start = i + 1;
+
+        length = strlen(query);
+        answers = (char *)realloc(answers, answers_len + length + 1);
+        memcpy(answers + answers_len, query, length);
+        answers_len += length;
+        answers[answers_len++] = '\n';
+    }
+
+    returnTokens(c, granted);
+
+    c->partial_len -= start;
+    memmove(c->partial, c->partial + start, c->partial_len);
+
+    // the deficit only carries over while queries wait for it
+    if (!quantumUsed)
+        c->deficit = 0;
+
+    int waiting = !tokensShort ? 0 : c->line_mode ? countQueries(c->partial, c->partial_len) : 1;
+    countThrottled(c, answered, waiting);
+    c->throttled = tokensShort;
+
+    updateParked(w, c);
+
+    // all of the answers leave in one send, once their records are durable
+    if (answers_len && !holdAnswers(w, c, answers, answers_len))
+        sendResponse(w, c, answers, answers_len);
+
+    free(answers);
+}
+
+int countQueries(const char *data, int len)
+{
+    /**
+     * @brief newlines in data, at least one
+     * so an overlong line counts as a query
+     */
+
+    int count = 0;
+    const char *end = data + len;
+
+    while ((data = memchr(data, '\n', end - data)))
+    {
+        count++;
+        data++;
+    }
+
+    return count ? count : 1;
+}
+
+int takeTokens(connection *c, int want)
+{
+    /**
+     * @brief take tokens for want queries from the client's
+     * bucket and its address's bucket
+     *
+     * @return the queries that may be answered now
+     */
+
+    // a reload may have lifted the limit of the address
+    const tunables *cfg = currentTunables();
+    int perSource = c->src && cfg->source_rate > 0;
+
+    if (cfg->client_rate <= 0 && !perSource)
+        return want;
+
+    unsigned long now = monotonicMs();
+
+    if (cfg->client_rate > 0)
+        want = bucketTake(&c->tokens, cfg->client_rate, cfg->client_burst, want, now);
+
+    if (perSource && want)
+    {
+        sourceShard *shard = sourceShardOf(&c->src->address);
+
+        pthread_mutex_lock(&shard->lock);
+        int taken = bucketTake(&c->src->b, cfg->source_rate, cfg->source_burst, want, now);
+        pthread_mutex_unlock(&shard->lock);
+
+        // the client's own tokens stay unused
+        if (cfg->client_rate > 0)
+            bucketReturn(&c->tokens, cfg->client_burst, want - taken);
+        want = taken;
+    }
+
+    return want;
+}
+
+void returnTokens(connection *c, int tokens)
+{
+    /**
+     * @brief give back tokens taken for
+     * queries that were not there after all
+     */
+
+    if (tokens <= 0)
+        return;
+
+    const tunables *cfg = currentTunables();
+
+    if (cfg->client_rate > 0)
+        bucketReturn(&c->tokens, cfg->client_burst, tokens);
+
+    if (c->src && cfg->source_rate > 0)
+    {
+        sourceShard *shard = sourceShardOf(&c->src->address);
+
+        pthread_mutex_lock(&shard->lock);
+        bucketReturn(&c->src->b, cfg->source_burst, tokens);
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void countThrottled(connection *c, int answered, int waiting)
+{
+    /**
+     * @brief count the queries that wait for tokens, once
+     * however many rounds they wait. answered is what a round
+     * answered, the oldest queries and so the counted ones
+     * first, waiting the queries left waiting for tokens
+     */
+
+    c->throttled_waiting = answered < c->throttled_waiting ? c->throttled_waiting - answered : 0;
+    if (waiting <= c->throttled_waiting)
+        return;
+
+    unsigned long queries = waiting - c->throttled_waiting;
+    c->throttled_waiting = waiting;
+
+    __atomic_add_fetch(&c->s.throttled, queries, __ATOMIC_RELAXED);
+    if (c->src)
+        __atomic_add_fetch(&c->src->throttled, queries, __ATOMIC_RELAXED);
+}
+
+void watchSocket(worker *w, connection *c, uint32_t events)
+{
+    /**
+     * @brief set what epoll reports for the socket,
+     * no events takes the socket out of epoll
+     */
+
+    if (events == c->watching)
+        return;
+
+    struct epoll_event event = {0};
+    event.events = events;
+    event.data.ptr = c;
+
+    int op = !c->watching ? EPOLL_CTL_ADD : events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+    epoll_ctl(w->epoll_fd, op, c->s.socket, &event);
+
+    c->watching = events;
+}
+
+void updateParked(worker *w, connection *c)
+{
+    /**
+     * @brief park the connection while it has queries
+     * the worker could not answer yet, else let it read
+     */
+
+    int wait = c->throttled || c->channel_throttled || (!c->line_mode && c->partial_len);
+
+    // a complete line is left
+    if (c->line_mode && !wait)
+        wait = memchr(c->partial, '\n', c->partial_len) != NULL || (c->partial_len > currentTunables()->max_query && !c->discarding);
+
+    if (wait && !c->parked)
+    {
+        c->parked = 1;
+        c->parked_prev = 0;
+        c->parked_next = w->parked;
+        if (w->parked)
+            w->parked->parked_prev = c;
+        w->parked = c;
+    }
+    else if (!wait && c->parked)
+    {
+        c->parked = 0;
+        if (c->parked_prev)
+            c->parked_prev->parked_next = c->parked_next;
+        else
+            w->parked = c->parked_next;
+        if (c->parked_next)
+            c->parked_next->parked_prev = c->parked_prev;
+    }
+
+    if (!c->pending && !c->closed)
+        watchSocket(w, c, c->parked ? 0 : EPOLLIN);
+}
+
+void serveBacklog(worker *w)
+{
+    /**
+     * @brief one deficit round robin round: every parked
+     * connection is served one more quantum of its queries.
+     * the ones waiting for tokens just check their buckets.
+     */
+
+    connection *c = w->parked;
+    while (c)
+    {
+        connection *next = c->parked_next;
+
+        if (c->channel_throttled)
+            serveChannel(w, c);
+
+        if (!c->closed && !c->pending && c->parked)
+        {
+            c->traced = traceSampled(w);
+            serveQueries(w, c);
+        }
+
+        // the backlog is answered, openssl may hold decrypted records that raise no event
+        // and a draining worker takes one more read like drainWorker
+        if (!c->closed && !c->parked && !c->pending && !c->held)
+        {
+            char probe;
+            if (w->draining && ((c->tls && tlsPending(c->tls)) || recv(c->s.socket, &probe, 1, MSG_PEEK) > 0))
+                drainReadable(w, c);
+            else if (c->tls && tlsPending(c->tls))
+                serveReadable(w, c);
+            else if (w->draining)
+                closeConnection(w, c);
+        }
+
+        c = next;
+    }
+}
+
+int backlogReady(worker *w)
+{
+    /**
+     * @brief a parked connection can be served right away
+     */
+
+    for (connection *c = w->parked; c; c = c->parked_next)
+        if (!c->pending && !c->throttled && !c->channel_throttled)
+            return 1;
+
+    return 0;
+}
+
+unsigned long monotonicMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+int parseRate(const char *spec, double *rate, double *burst)
+{
+    /**
+     * @brief QPS[:BURST], the burst defaults to one second of queries
+     */
+
+    char *end;
+    *rate = strtod(spec, &end);
+    *burst = *end == ':' ? strtod(end + 1, &end) : *rate;
+
+    if (*end || *rate <= 0 || *burst < 1)
+        return -1;
+
+    return 0;
+}
+
+const tunables *currentTunables()
+{
+    return __atomic_load_n(&TUNABLES, __ATOMIC_SEQ_CST);
+}
+
+void tunablesHold(unsigned long *quiet)
+{
+    // the thread may load the tunables and use them until tunablesRelease
+    __atomic_fetch_add(quiet, 1, __ATOMIC_SEQ_CST);
+}
+
+void tunablesRelease(unsigned long *quiet)
+{
+    __atomic_fetch_add(quiet, 1, __ATOMIC_SEQ_CST);
+}
+
+void waitForReaders()
+{
+    /**
+     * @brief returns once every thread that reads the
+     * tunables held none since the call: the workers
+     * between two iterations, the acceptor while it
+     * waits for connections. one waiting already is
+     * past that point, a busy one takes an iteration
+     */
+
+    worker *workers = __atomic_load_n(&WORKERS, __ATOMIC_SEQ_CST);
+    int count = workers ? NUM_WORKERS : 0;
+
+    unsigned long seen[count + 1];
+    for (int i = 0; i < count; i++)
+        seen[i] = __atomic_load_n(&workers[i].quiet, __ATOMIC_SEQ_CST);
+    seen[count] = __atomic_load_n(&ACCEPT_QUIET, __ATOMIC_SEQ_CST);
+
+    struct timespec pause = {0, 1000000L};
+    for (int i = 0; i <= count; i++)
+    {
+        unsigned long *quiet = i < count ? &workers[i].quiet : &ACCEPT_QUIET;
+        while (!(seen[i] & 1) && __atomic_load_n(quiet, __ATOMIC_SEQ_CST) == seen[i])
+            nanosleep(&pause, NULL);
+    }
+}
+
+int configLoad(const char *path, tunables *t, settings *s)
+{
+    /**
+     * @brief read a config file of "key = value" lines,
+     * # starts a comment. with s the file is read at
+     * startup, without it for a reload: restart-only keys
+     * are then just compared with what the server started
+     * with. a reload starts from the current values, a
+     * key taken out of the file keeps its value.
+     *
+     * @return -1 with the reason on stderr, t may
+     * be partly updated then
+     */
+
+    FILE *file = fopen(path, "r");
+    if (!file)
+    {
+        pthread_mutex_lock(&TERMINAL_LOG);
+        fprintf(stderr, "Error: Couldn't open the config file %s\n", path);
+        pthread_mutex_unlock(&TERMINAL_LOG);
+        return -1;
+    }
+
+    char line[CONFIG_LINE_LEN];
+    int number = 0, ret = 0;
+
+    while (ret != -1 && fgets(line, sizeof(line), file))
+    {
+        number++;
+
+        line[strcspn(line, "#\r\n")] = 0;
+
+        char *key = line + strspn(line, " \t");
+        if (!*key)
+            continue;
+
+        char *equals = strchr(key, '=');
+        char *value = equals ? equals + 1 : 0;
+        if (!value)
+        {
+            ret = -1;
+            break;
+        }
+
+        // trim both sides of both
+        *equals = 0;
+        value += strspn(value, " \t");
+        for (char *end = value + strlen(value); end > value && (end[-1] == ' ' || end[-1] == '\t');)
+            *--end = 0;
+        for (char *end = equals; end > key && (end[-1] == ' ' || end[-1] == '\t');)
+            *--end = 0;
+
+        ret = configApply(key, value, t, s);
+    }
+
+    fclose(file);
+
+    if (ret == -1)
+    {
+        pthread_mutex_lock(&TERMINAL_LOG);
+        fprintf(stderr, "Error: Invalid setting on line %d of %s\n", number, path);
+        pthread_mutex_unlock(&TERMINAL_LOG);
+    }
+
+    return ret;
+}
+
+int configApply(const char *key, const char *value, tunables *t, settings *s)
+{
+    /**
+     * @brief one line of the config file
+     *
+     * @return -1 for an unknown key or an invalid value
+     */
+
+    static const char *restartOnly[] = {"listen", "unix", "port", "workers", "cpus", "tls_cert",
+                                        "tls_key", "tls_tickets", "tls_session_cache"};
+
+    long number;
+
+    for (int i = 0; i < sizeof(restartOnly) / sizeof(restartOnly[0]); i++)
+    {
+        if (strcmp(key, restartOnly[i]))
+            continue;
+
+        char recorded[2 * CONFIG_LINE_LEN + 2];
+        snprintf(recorded, sizeof(recorded), "%s=%s\n", key, value);
+
+        // on a reload, the line has to be one the server started with
+        if (!s)
+        {
+            if (!STARTUP_LINES || !strstr(STARTUP_LINES, recorded))
+            {
+                pthread_mutex_lock(&TERMINAL_LOG);
+                fprintf(stderr, "Warning: %s = %s only takes effect on a restart (--takeover keeps the clients)\n",
+                        key, value);
+                pthread_mutex_unlock(&TERMINAL_LOG);
+            }
+            return 0;
+        }
+
+        int length = STARTUP_LINES ? strlen(STARTUP_LINES) : 0;
+        STARTUP_LINES = (char *)realloc(STARTUP_LINES, length + strlen(recorded) + 1);
+        strcpy(STARTUP_LINES + length, recorded);
+        break;
+    }
+
+    if (!strcmp(key, "listen") || !strcmp(key, "unix"))
+    {
+        int isUnix = !strcmp(key, "unix");
+        int *count = isUnix ? &s->num_unix_paths : &s->num_listens;
+
+        if (*count == MAX_LISTENERS)
+            return -1;
+        (isUnix ? s->unix_paths : s->listens)[(*count)++] = strdup(value);
+    }
+    else if (!strcmp(key, "port"))
+    {
+        if (configInt(value, 0, 65535, &number) == -1)
+            return -1;
+        s->port = number;
+    }
+    else if (!strcmp(key, "workers"))
+    {
+        if (configInt(value, 0, CPU_SETSIZE, &number) == -1)
+            return -1;
+        s->workers = number;
+    }
+    else if (!strcmp(key, "cpus"))
+        return parseCpus(value, &WORKER_CPUS);
+    else if (!strcmp(key, "tls_cert"))
+        s->tls_cert = strdup(value);
+    else if (!strcmp(key, "tls_key"))
+        s->tls_key = strdup(value);
+    else if (!strcmp(key, "tls_tickets"))
+        s->tls_tickets = strdup(value);
+    else if (!strcmp(key, "tls_session_cache"))
+    {
+        if (configInt(value, 0, 1L << 30, &number) == -1)
+            return -1;
+        s->tls_session_cache = number;
+    }
+    // the rest may change on a reload
+    else if (!strcmp(key, "max_conn"))
+    {
+        if (configInt(value, 1, 65535, &number) == -1)
+            return -1;
+        t->backlog = number;
+    }
+    else if (!strcmp(key, "idle_timeout") || !strcmp(key, "read_timeout") || !strcmp(key, "write_timeout"))
+    {
+        if (configInt(value, 0, 86400000, &number) == -1)
+            return -1;
+        *(key[0] == 'i' ? &t->idle_timeout : key[0] == 'r' ? &t->read_timeout : &t->write_timeout) = number;
+    }
+    else if (!strcmp(key, "rate") || !strcmp(key, "source_rate"))
+    {
+        int perSource = !strcmp(key, "source_rate");
+        double *rate = perSource ? &t->source_rate : &t->client_rate;
+        double *burst = perSource ? &t->source_burst : &t->client_burst;
+
+        if (!strcmp(value, "0"))
+            *rate = *burst = 0;
+        else if (parseRate(value, rate, burst) == -1)
+            return -1;
+    }
+    else if (!strcmp(key, "drr_quantum"))
+    {
+        if (configInt(value, 1, 1L << 20, &number) == -1)
+            return -1;
+        t->drr_quantum = number;
+    }
+    else if (!strcmp(key, "max_query"))
+    {
+        if (configInt(value, 1, MAX_STRING_LEN, &number) == -1)
+            return -1;
+        t->max_query = number;
+    }
+    else if (!strcmp(key, "read_buffer"))
+    {
+        if (configInt(value, 1, MAX_READ_LEN, &number) == -1)
+            return -1;
+        t->read_len = number;
+    }
+    else if (!strcmp(key, "socket_rcvbuf") || !strcmp(key, "socket_sndbuf"))
+    {
+        if (configInt(value, 0, 1L << 30, &number) == -1)
+            return -1;
+        *(key[7] == 'r' ? &t->socket_rcvbuf : &t->socket_sndbuf) = number;
+    }
+    else if (!strcmp(key, "records_sync_ms"))
+    {
+        if (configInt(value, 0, 60000, &number) == -1)
+            return -1;
+        t->records_sync_ms = number;
+    }
+    else if (!strcmp(key, "records_batch"))
+    {
+        if (configInt(value, 1, 1L << 30, &number) == -1)
+            return -1;
+        t->records_batch = number;
+    }
+    else if (!strcmp(key, "records_durable"))
+    {
+        if (configInt(value, 0, 1, &number) == -1)
+            return -1;
+        t->records_durable = number;
+    }
+    else if (!strcmp(key, "log_connections"))
+    {
+        if (configInt(value, 0, 1, &number) == -1)
+            return -1;
+        t->log_connections = number;
+    }
+    else if (!strcmp(key, "trace_sample"))
+    {
+        if (configInt(value, 0, 1L << 30, &number) == -1)
+            return -1;
+        t->trace_sample = number;
+    }
+    else if (!strcmp(key, "accept_cpus"))
+        return parseCpus(value, &t->accept_cpus);
+    else
+        return -1;
+
+    return 0;
+}
+
+int configInt(const char *value, long min, long max, long *result)
+{
+    char *end;
+    *result = strtol(value, &end, 10);
+
+    return end == value || *end || *result < min || *result > max ? -1 : 0;
+}
+
+void configReload()
+{
+    /**
+     * @brief re-read the config file for SIGHUP. connections
+     * stay open, each picks the new values up the next time
+     * it reads one. a file with an error changes nothing
+     */
+
+    const char *path = __atomic_load_n(&CONFIG_PATH, __ATOMIC_ACQUIRE);
+    if (!path)
+    {
+        pthread_mutex_lock(&TERMINAL_LOG);
+        fprintf(stderr, "Error: No config file to reload, start the server with --config FILE\n");
+        pthread_mutex_unlock(&TERMINAL_LOG);
+        return;
+    }
+
+    const tunables *old = currentTunables();
+    tunables *next = (tunables *)malloc(sizeof(tunables));
+    *next = *old;
+
+    if (configLoad(path, next, NULL) == -1)
+    {
+        free(next);
+
+        pthread_mutex_lock(&TERMINAL_LOG);
+        fprintf(stderr, "Error: Config not reloaded, keeping the old settings\n");
+        pthread_mutex_unlock(&TERMINAL_LOG);
+        return;
+    }
+
+    // the listen queue of an open socket is resized by listening again
+    if (next->backlog != old->backlog)
+        for (int i = 0; i < NUM_LISTENERS; i++)
+            listen(LISTENERS[i].fd, next->backlog);
+
+    if (!CPU_EQUAL(&next->accept_cpus, &old->accept_cpus) && CPU_COUNT(&next->accept_cpus) &&
+        pthread_setaffinity_np(ACCEPT_THREAD, sizeof(cpu_set_t), &next->accept_cpus))
+    {
+        next->accept_cpus = old->accept_cpus;
+
+        pthread_mutex_lock(&TERMINAL_LOG);
+        fprintf(stderr, "Error: Couldn't pin the acceptor to the new accept_cpus, it stays where it was\n");
+        pthread_mutex_unlock(&TERMINAL_LOG);
+    }
+
+    if (next->records_sync_ms != old->records_sync_ms || next->records_batch != old->records_batch)
+        recordLogTune(next->records_sync_ms, next->records_batch);
+
+    __atomic_store_n(&TUNABLES, next, __ATOMIC_SEQ_CST);
+
+    // nobody loads the old set any more, it goes once no reader can still hold it
+    waitForReaders();
+    if (old != &STARTUP_TUNABLES)
+        free((tunables *)old);
+
+    pthread_mutex_lock(&TERMINAL_LOG);
+    fprintf(stdout, "Config reloaded from %s\n", path);
+    pthread_mutex_unlock(&TERMINAL_LOG);
+}
+
+void answerQuery(worker *w, connection *c, char *buffer, int valread)
+{
+    /**
+     * @brief evaluate one query in place and
+     * record it, valread is what it cost on the wire.
+     * a traced query leaves a span for the whole, the
+     * evaluation and handing the record to the log
+     */
+
+    char query[MAX_STRING_LEN + 1] = {0};
+    unsigned long spans[3] = {0};
+
+    // store query
+    strcpy(query, buffer);
+
+    if (c->traced)
+        spans[0] = traceNow();
+    TRACE_PROBE2(query_start, c->s.id, query);
+
+    // evaluate post fix expression in place, with the client's variables
+    evaluateSession(&c->symbols, buffer);
+
+    TRACE_PROBE2(query_evaluated, c->s.id, buffer);
+    if (c->traced)
+        spans[1] = traceNow();
+
+    // seconds since the client connected, to the millisecond for replays
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - c->started.tv_sec) + (now.tv_nsec - c->started.tv_nsec) / 1e9;
+
+    // log into file, the committer makes it durable
+    char record[MAX_STRING_LEN + POSTFIX_ANSWER_LEN + 64];
+    int len = snprintf(record, sizeof(record), "%d %s %s %.3f", c->s.id, query, buffer, elapsed);
+    c->last_record = recordLogAppend(record, len < sizeof(record) ? len : sizeof(record) - 1);
+
+    TRACE_PROBE1(query_done, c->s.id);
+    if (c->traced)
+    {
+        spans[2] = traceNow();
+        traceSpan(w->trace, TRACE_EVALUATE, c->s.id, spans[0], spans[1]);
+        traceSpan(w->trace, TRACE_RECORDS, c->s.id, spans[1], spans[2]);
+        traceSpan(w->trace, TRACE_QUERY, c->s.id, spans[0], spans[2]);
+    }
+
+    sessionTouch(&c->s, valread, strlen(buffer));
+}
+
+int traceSampled(worker *w)
+{
+    /**
+     * @brief whether the worker traces its next read,
+     * one in every trace_sample
+     */
+
+    int sample = currentTunables()->trace_sample;
+    if (!sample)
+        return 0;
+
+    if (!w->trace)
+        w->trace = traceRingNew(w->index);
+
+    return w->trace && !(w->trace_tick++ % sample);
+}
+
+void traceWrite()
+{
+    /**
+     * @brief dump the trace rings to TRACE_FILE
+     */
+
+    int spans = traceDump(TRACE_FILE);
+
+    pthread_mutex_lock(&TERMINAL_LOG);
+    if (spans == -1)
+        fprintf(stderr, "Error: Couldn't write %s\n", TRACE_FILE);
+    else
+        fprintf(stdout, "Trace of %d spans written to %s\n", spans, TRACE_FILE);
+    pthread_mutex_unlock(&TERMINAL_LOG);
+}
+
+int receiveLocal(worker *w, connection *c, char *buffer, int len)
+{
+    /**
+     * @brief recv for unix socket clients, which may pass
+     * descriptors to move onto a shared memory channel.
+     * the message carrying them is not a query.
+     */
+
+    int fds[3];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {buffer, len};
+
+    struct msghdr message = {0};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    int valread = recvmsg(c->s.socket, &message, MSG_CMSG_CLOEXEC);
+
+    struct cmsghdr *cmsg = valread > 0 ? CMSG_FIRSTHDR(&message) : NULL;
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        return valread;
+
+    // descriptors beyond the buffer were closed by the kernel
+    int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+
+    attachChannel(w, c, fds, count);
+
+    // nothing to evaluate
+    errno = EAGAIN;
+    return -1;
+}
+
+void attachChannel(worker *w, connection *c, int *fds, int count)
+{
+    /**
+     * @brief map the channel a local client passed as its
+     * memory, our wake up and its wake up descriptors, and
+     * serve the requests ring from this worker. the client
+     * is told "SHM" once the channel is in use.
+     * the memory has to be sealed against shrinking, a
+     * client cutting it under the mapping would crash us
+     * with SIGBUS on the next ring access.
+     */
+
+    shmChannel *channel = MAP_FAILED;
+    struct stat info;
+
+    int seals = count == 3 ? fcntl(fds[0], F_GET_SEALS) : -1;
+
+    if (count == 3 && !c->channel && seals != -1 && seals & F_SEAL_SHRINK && !fstat(fds[0], &info) &&
+        info.st_size >= (off_t)sizeof(shmChannel))
+        channel = (shmChannel *)mmap(NULL, sizeof(shmChannel), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+
+    if (channel != MAP_FAILED && (channel->magic != SHM_MAGIC || channel->size != SHM_RING_SIZE))
+    {
+        munmap(channel, sizeof(shmChannel));
+        channel = MAP_FAILED;
+    }
+
+    if (channel == MAP_FAILED)
+    {
+        for (int i = 0; i < count; i++)
+            close(fds[i]);
+
+        sendResponse(w, c, ERROR_CHANNEL, strlen(ERROR_CHANNEL));
+        return;
+    }
+
+    // the mapping keeps the memory
+    close(fds[0]);
+
+    c->channel = channel;
+    c->channel_wake = fds[1];
+    c->channel_peer = fds[2];
+    fcntl(c->channel_wake, F_SETFL, fcntl(c->channel_wake, F_GETFL) | O_NONBLOCK);
+
+    struct epoll_event event = {0};
+    event.events = EPOLLIN;
+    event.data.u64 = (uintptr_t)c | CHANNEL_EVENT;
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, c->channel_wake, &event);
+
+    // start out asleep, the client's first request wakes us
+    ringSleepEmpty(&channel->requests);
+
+    pthread_mutex_lock(&TERMINAL_LOG);
+    fprintf(stdout, "Client %u moved to a shared memory channel\n", c->s.id);
+    pthread_mutex_unlock(&TERMINAL_LOG);
+
+    sendResponse(w, c, "SHM", 3);
+}
+
+void serveChannel(worker *w, connection *c)
+{
+    /**
+     * @brief answer what the client queued in its requests
+     * ring, as long as the responses ring has room for an
+     * answer. either ring leaves a waiting flag behind when
+     * we stop, so the client writes channel_wake once there
+     * is work again.
+     */
+
+    uint64_t wake;
+    read(c->channel_wake, &wake, sizeof(wake));
+
+    // releaseHeld serves the channel again once its answers are out
+    if (c->held)
+        return;
+
+    const tunables *cfg = currentTunables();
+
+    // the batch is one read as far as sampling goes
+    c->traced = traceSampled(w);
+
+    shmRing *requests = &c->channel->requests;
+    shmRing *responses = &c->channel->responses;
+    char buffer[MAX_STRING_LEN + 1];
+
+    int served = 0, granted = 0, tokensShort = 0;
+    while (served < CHANNEL_BATCH)
+    {
+        // tokens for what is queued, the rest of the ring waits
+        if (!granted && ringPending(requests) && !(granted = takeTokens(c, CHANNEL_BATCH - served)))
+        {
+            tokensShort = 1;
+            break;
+        }
+
+        // held answers need their room too, a message takes at most 8 bytes more than its answer
+        int room = c->channel_held_len + 8 * c->channel_held_count + MAX_STRING_LEN + 8;
+        if (!ringFits(responses, room))
+        {
+            if (ringSleepFull(responses, room))
+                break;
+            continue;
+        }
+
+        int valread = ringRead(requests, buffer, sizeof(buffer), c->channel_peer);
+
+        if (valread == -1)
+        {
+            if (ringSleepEmpty(requests))
+                break;
+            continue;
+        }
+
+        if (valread == -2)
+        {
+            pthread_mutex_lock(&TERMINAL_LOG);
+            fprintf(stderr, "Error: Corrupt channel of client %u\n", c->s.id);
+            pthread_mutex_unlock(&TERMINAL_LOG);
+
+            closeConnection(w, c);
+            return;
+        }
+
+        answerQuery(w, c, buffer, valread);
+        if (cfg->records_durable)
+        {
+            int length = strlen(buffer) + 1;
+            c->channel_held = (char *)realloc(c->channel_held, c->channel_held_len + length);
+            memcpy(c->channel_held + c->channel_held_len, buffer, length);
+            c->channel_held_len += length;
+            c->channel_held_count++;
+        }
+        else
+            ringWrite(responses, buffer, strlen(buffer), c->channel_peer);
+        served++;
+        granted--;
+    }
+
+    returnTokens(c, granted);
+
+    // the backlog checks the buckets until the tokens are there
+    countThrottled(c, served, tokensShort ? ringCount(requests) : 0);
+    c->channel_throttled = tokensShort;
+    updateParked(w, c);
+
+    if (c->channel_held_count && !holdAnswers(w, c, NULL, 0))
+        releaseChannel(w, c);
+    if (c->closed)
+        return;
+
+    // more is queued, come back after the other clients
+    if (served == CHANNEL_BATCH && !c->held)
+    {
+        wake = 1;
+        write(c->channel_wake, &wake, sizeof(wake));
+    }
+
+    armTimeout(w, c);
+}
+
+int sendResponse(worker *w, connection *c, char *data, int len)
+{
+    /**
+     * @brief send as much of data as the socket takes,
+     * the rest is kept in c->pending and reading is paused
+     * until flushPending drains it.
+     *
+     * @return -1 if the connection had to be closed
+     */
+
+    unsigned long sendStart = c->traced ? traceNow() : 0;
+    TRACE_PROBE2(send_start, c->s.id, len);
+
+    int sent = c->tls ? tlsSend(c->tls, data, len) : send(c->s.socket, data, len, MSG_NOSIGNAL);
+
+    TRACE_PROBE2(send_done, c->s.id, sent);
+    if (c->traced)
+        traceSpan(w->trace, TRACE_SEND, c->s.id, sendStart, traceNow());
+
+    if (sent == -1)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            pthread_mutex_lock(&TERMINAL_LOG);
+            fprintf(stderr, "Error: Couldn't send result to peer %u\n", c->s.id);
+            pthread_mutex_unlock(&TERMINAL_LOG);
+
+            closeConnection(w, c);
+            return -1;
+        }
+        sent = 0;
+    }
+
+    if (sent < len)
+    {
+        c->pending = (char *)malloc(len - sent);
+        memcpy(c->pending, data + sent, len - sent);
+        c->pending_len = len - sent;
+        c->pending_sent = 0;
+
+        watchSocket(w, c, EPOLLOUT);
+    }
+    else if (w->draining && !c->parked)
+    {
+        // answered the last query we take from this client
+        closeConnection(w, c);
+        return -1;
+    }
+
+    armTimeout(w, c);
+
+    return 0;
+}
+
+int holdAnswers(worker *w, connection *c, char *data, int len)
+{
+    /**
+     * @brief keep answers back until the client's latest
+     * record is durable. data is kept in pending, null
+     * holds the answers gathered in channel_held
+     *
+     * @return 0 if they may go out right away
+     */
+
+    if (!currentTunables()->records_durable || c->last_record <= recordLogDurable())
+        return 0;
+
+    // the log can't commit them any more, so they never go out
+    if (recordLogBroken())
+    {
+        closeConnection(w, c);
+        return 1;
+    }
+
+    if (data)
+    {
+        c->pending = (char *)malloc(len);
+        memcpy(c->pending, data, len);
+        c->pending_len = len;
+        c->pending_sent = 0;
+
+        watchSocket(w, c, 0);
+    }
+
+    c->held = c->last_record;
+    c->held_prev = 0;
+    c->held_next = w->held;
+    if (w->held)
+        w->held->held_prev = c;
+    w->held = c;
+
+    armTimeout(w, c);
+
+    return 1;
+}
+
+void releaseHeld(worker *w)
+{
+    /**
+     * @brief send the held answers whose records the
+     * log has committed since, the clients read again.
+     * once a commit failed the others are closed instead
+     */
+
+    int broken = recordLogBroken();
+    unsigned long durable = recordLogDurable();
+
+    connection *c = w->held;
+    while (c)
+    {
+        connection *next = c->held_next;
+
+        if (c->held > durable)
+        {
+            if (broken)
+                closeConnection(w, c);
+            c = next;
+            continue;
+        }
+
+        unholdConnection(w, c);
+        armTimeout(w, c);
+
+        if (c->pending)
+        {
+            char *answers = c->pending;
+            c->pending = 0;
+
+            // the socket was out of epoll while the answers were held
+            if (sendResponse(w, c, answers, c->pending_len) == 0 && !c->pending)
+            {
+                watchSocket(w, c, c->parked ? 0 : EPOLLIN);
+                if (c->tls && !c->parked && tlsPending(c->tls))
+                    serveReadable(w, c);
+            }
+            free(answers);
+        }
+
+        // the channel goes on with what its client queued meanwhile
+        if (!c->closed && c->channel_held_count)
+        {
+            releaseChannel(w, c);
+
+            if (!w->draining)
+                serveChannel(w, c);
+            else if (!c->pending && !c->parked)
+                closeConnection(w, c);
+        }
+
+        c = next;
+    }
+}
 
-// data structures
-typedef struct _node
+void releaseChannel(worker *w, connection *c)
 {
-    float val;
-    struct _node *next;
-} node;
+    /**
+     * @brief write the answers held for the channel,
+     * serveChannel kept the room for them
+     */
 
-typedef struct
+    char *answer = c->channel_held;
+    for (int i = 0; i < c->channel_held_count; i++)
+    {
+        int length = strlen(answer);
+        ringWrite(&c->channel->responses, answer, length, c->channel_peer);
+        answer += length + 1;
+    }
+
+    c->channel_held_len = c->channel_held_count = 0;
+}
+
+void unholdConnection(worker *w, connection *c)
 {
-    node *head;
-    int size;
-} stack;
+    if (!c->held)
+        return;
+    c->held = 0;
 
-typedef struct
+    if (c->held_prev)
+        c->held_prev->held_next = c->held_next;
+    else
+        w->held = c->held_next;
+    if (c->held_next)
+        c->held_next->held_prev = c->held_prev;
+}
+
+void flushPending(worker *w, connection *c)
 {
     /**
-     * @brief structure used to store a token.
-     * type  0: integer number
-     * type  1: floating point number
-     * type  2: operator
-     * type -1: invalid
+     * @brief continue sending a partially sent
+     * response once the socket is writable
      */
-    char val[TOKEN_LENGTH];
-    char type;
-} token;
 
-// data structure method declarations
-void push(stack *s, float val);
-float pop(stack *s);
-float top(stack *s);
-stack *makeStack();
-node *makeNode(float val);
+    char *rest = c->pending + c->pending_sent;
+    int restLen = c->pending_len - c->pending_sent;
+    int sent = c->tls ? tlsSend(c->tls, rest, restLen) : send(c->s.socket, rest, restLen, MSG_NOSIGNAL);
 
-// helper function declarations
-void serverSetup(int PORT, int MAX_CONN, int ADDR);
-void clientConnect(int socketFD, struct sockaddr_in serverAddress, int addrlen);
-void evaluatePostfix(char *string);
-void *handleConnections(void *arg);
-token nextToken(char *string, int *index);
-token nextNumber(char *string, int *index);
-token nextOperator(char *string, int *index);
+    if (sent == -1)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return;
 
-// The main function
-int main(int argc, char **argv)
-{
-    NEXT_CLIENT_ID = 0;
-    setbuf(stdout, NULL);
-    SERVER_RECORDS = fopen("server_records.txt", "w");
-    setbuf(SERVER_RECORDS, NULL);
+        pthread_mutex_lock(&TERMINAL_LOG);
+        fprintf(stderr, "Error: Couldn't send result to peer %u\n", c->s.id);
+        pthread_mutex_unlock(&TERMINAL_LOG);
+
+        closeConnection(w, c);
+        return;
+    }
 
-    int PORT = DEFAULT_PORT;
-    int MAX_CONN = DEFAULT_MAX_CONN;
-    in_addr_t ADDR = INADDR_ANY;
+    c->pending_sent += sent;
+    if (c->pending_sent < c->pending_len)
+        return;
 
-    // decode arguments
-    // if port number is specified specifically as
-    // a command line argument, update the port
-    // value from default value
-    if (argc > 1)
-        PORT = atoi(argv[1]);
-    if (argc > 2)
-        MAX_CONN = atoi(argv[2]);
-    if (argc > 3)
-        ADDR = inet_addr(argv[3]);
+    free(c->pending);
+    c->pending = 0;
+
+    if (w->draining && !c->parked)
+    {
+        closeConnection(w, c);
+        return;
+    }
 
-    serverSetup(PORT, MAX_CONN, ADDR);
+    // response is out, wait for the next query or the backlog's turn
+    watchSocket(w, c, c->parked ? 0 : EPOLLIN);
 
-    fclose(SERVER_RECORDS);
+    armTimeout(w, c);
 
-    return 0;
+    // queries decrypted while the response was stuck
+    if (c->tls && !c->parked && tlsPending(c->tls))
+        serveReadable(w, c);
 }
 
-// data structure method definitions
-stack *makeStack()
+void armTimeout(worker *w, connection *c)
 {
     /**
-     * @brief return a pointer
-     * to an empty stack
+     * @brief (re)arm the timer for whatever the
+     * connection is waiting on now.
+     * none: its answers wait for the record log, not for
+     * the client, releaseHeld arms it again when they leave
+     * write timeout: a response is still pending
+     * read timeout: the first query has not arrived yet
+     * idle timeout: waiting between queries
      */
 
-    // allocate memory and initialize an empty stack
-    stack *s = (stack *)malloc(sizeof(stack));
-    s->head = 0;
-    s->size = 0;
+    const tunables *cfg = currentTunables();
+
+    int timeout;
+    if (c->held)
+        timeout = 0;
+    else if (c->pending)
+        timeout = cfg->write_timeout;
+    else if (!c->s.requests)
+        timeout = cfg->read_timeout;
+    else
+        timeout = cfg->idle_timeout;
 
-    return s;
+    if (timeout > 0)
+        timerAdd(&w->wheel, &c->t, (timeout + TIMER_TICK_MS - 1) / TIMER_TICK_MS);
+    else
+        timerDelete(&w->wheel, &c->t);
 }
 
-node *makeNode(float val)
+void closeConnection(worker *w, connection *c)
 {
     /**
-     * @brief return a pointer to a
-     * node initialized with val.
-     * next is set to null.
+     * @brief release everything held by a connection,
+     * closing the socket also drops it from epoll.
+     * the memory goes in releaseClosed, a later event
+     * of the same batch may still point to it.
      */
 
-    // allocate memory and initialize a node
-    node *n = (node *)malloc(sizeof(node));
-    n->val = val;
-    n->next = 0;
+    if (c->closed)
+        return;
+    c->closed = 1;
+
+    // every connection is traced while sampling is on, it is one span
+    TRACE_PROBE1(connection_close, c->s.id);
+    if (w->trace && currentTunables()->trace_sample)
+        traceSpan(w->trace, TRACE_CONNECTION, c->s.id,
+                  c->started.tv_sec * 1000000000UL + c->started.tv_nsec, traceNow());
+
+    timerDelete(&w->wheel, &c->t);
+    sessionRemove(&c->s);
+
+    unholdConnection(w, c);
+
+    // leave the backlog
+    c->throttled = c->channel_throttled = 0;
+    c->throttled_waiting = 0;
+    c->partial_len = 0;
+    updateParked(w, c);
+    if (c->src)
+        sourceRelease(c->src);
+
+    if (c->tls)
+        tlsClose(c->tls);
+    close(c->s.socket);
+    __atomic_fetch_sub(&c->from->active, 1, __ATOMIC_RELAXED);
+
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        w->connections = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+
+    if (c->channel)
+    {
+        // the client shares the eventfd, closing ours alone would leave it in epoll
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, c->channel_wake, NULL);
+        munmap(c->channel, sizeof(shmChannel));
+        close(c->channel_wake);
+        close(c->channel_peer);
+    }
+
+    symbolTableFree(&c->symbols);
+    free(c->pending);
+    free(c->partial);
+    free(c->channel_held);
+
+    c->next = w->closed;
+    w->closed = c;
 }
 
-void push(stack *s, float val)
+void expireConnection(timer *t, void *arg)
 {
     /**
-     * @brief add a new node with val
-     * to the top of the stack
+     * @brief timer callback, the connection
+     * waited too long and is closed
      */
 
-    // make a new node with val
-    node *n = makeNode(val);
+    connection *c = (connection *)((char *)t - offsetof(connection, t));
+
+    pthread_mutex_lock(&TERMINAL_LOG);
+    fprintf(stderr, "Timed out connection with client %u\n", c->s.id);
+    pthread_mutex_unlock(&TERMINAL_LOG);
+
+    closeConnection((worker *)arg, c);
+}
 
+void releaseClosed(worker *w)
+{
     /**
-     * @brief check if stack is empty.
-     * If empty: make n as head
-     * Else: add to the start
+     * @brief free the connections closed since the last call
      */
-    if (s->head)
-    {
-        n->next = s->head;
-        s->head = n;
-    }
-    else
+
+    while (w->closed)
     {
-        s->head = n;
+        connection *c = w->closed;
+        w->closed = c->next;
+        free(c);
     }
-
-    // increment the size of stack
-    s->size += 1;
 }
 
-float pop(stack *s)
+void drainWorker(worker *w)
 {
     /**
-     * @brief check if stack is empty
-     * else pop the top most element and return it
+     * @brief runs once when the server stops.
+     * queries already sent by a client are answered,
+     * idle clients are closed right away and the ones
+     * with a pending response are closed once it is out.
      */
 
-    if (!s->head)
-        return 0;
+    w->draining = 1;
 
-    node *temp = s->head;
-    s->head = temp->next;
+    connection *c = w->connections;
+    while (c)
+    {
+        connection *next = c->next;
 
-    float val = temp->val;
+        // the channel's queued requests are answered, then it closes with the socket
+        if (c->channel)
+            serveChannel(w, c);
 
-    free(temp);
-    (s->size)--;
+        // a client still in its handshake has sent no query, a parked one
+        // is closed by the backlog and a held one by releaseHeld once answered
+        if (!c->closed && !c->pending && !c->held && !c->parked)
+        {
+            char probe;
+            if (!c->handshaking &&
+                ((c->tls && tlsPending(c->tls)) || recv(c->s.socket, &probe, 1, MSG_PEEK) > 0))
+                drainReadable(w, c);
+            else
+                closeConnection(w, c);
+        }
 
-    return val;
+        c = next;
+    }
 }
 
-float top(stack *s)
+void drainReadable(worker *w, connection *c)
 {
     /**
-     * @brief check if stack is empty
-     * else return the value of top most element
+     * @brief the last read a draining worker takes from a
+     * client. bytes that finish no query get no answer, and
+     * the client is closed here instead of once it is out
      */
 
-    return (s->head)->val;
+    serveReadable(w, c);
+
+    if (!c->closed && !c->pending && !c->held && !c->parked)
+        closeConnection(w, c);
 }
 
-// helper function definitions
-void serverSetup(int PORT, int MAX_CONN, int ADDR)
+void stopServer()
 {
-    // create a socket
-    int socketFD = SOCKET_FD = socket(AF_INET, SOCK_STREAM, 0);
+    /**
+     * @brief stop accepting, clientConnect returns
+     * and the workers are drained
+     */
 
-    if (socketFD == -1)
-    {
-        pthread_mutex_lock(&TERMINAL_LOG);
-        fprintf(stderr, "Error: Attempt to create a socket failed...\n");
-        pthread_mutex_unlock(&TERMINAL_LOG);
-        exit(errno);
-    }
-    else
-    {
-        pthread_mutex_lock(&TERMINAL_LOG);
-        fprintf(stdout, "Socket Created successfully...\n");
-        pthread_mutex_unlock(&TERMINAL_LOG);
-    }
+    __atomic_store_n(&STOPPING, 1, __ATOMIC_RELEASE);
 
-    // socket address setup
-    struct sockaddr_in serverAddress;
-    int addrlen = sizeof(serverAddress);
-    serverAddress.sin_family = AF_INET;
-    serverAddress.sin_addr.s_addr = ADDR;
-    serverAddress.sin_port = htons(PORT);
+    uint64_t wake = 1;
+    write(STOP_FD, &wake, sizeof(wake));
+}
 
-    // binding address to the socket
-    if (bind(socketFD, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) < 0)
-    {
-        pthread_mutex_lock(&TERMINAL_LOG);
-        fprintf(stderr, "Error: Failed to bind the socket\n");
-        pthread_mutex_unlock(&TERMINAL_LOG);
-        exit(errno);
-    }
-    else
-    {
-        pthread_mutex_lock(&TERMINAL_LOG);
-        fprintf(stdout, "Socket Binded successfully...\n");
-        pthread_mutex_unlock(&TERMINAL_LOG);
-    }
+void stopWorkers()
+{
+    /**
+     * @brief wake every worker so it drains,
+     * then wait for them up to DRAIN_TIMEOUT
+     */
 
-    // convert socket to listening socket
-    if (listen(socketFD, MAX_CONN) == -1)
+    pthread_mutex_lock(&TERMINAL_LOG);
+    fprintf(stdout, "Draining in-flight requests ...\n");
+    pthread_mutex_unlock(&TERMINAL_LOG);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += DRAIN_TIMEOUT / 1000;
+    deadline.tv_nsec += (DRAIN_TIMEOUT % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
     {
-        /**
-         * @note MAX_CONN is not necessarily required for
-         * our tcp server because tcp server supports
-         * retransmission. Effectively, if queue size in
-         * our case exceeds MAX_CONN, request will be declined
-         * but re-attempted in future
-         *
-         */
-        pthread_mutex_lock(&TERMINAL_LOG);
-        fprintf(stderr, "Error: Listen failed on the socket\n");
-        pthread_mutex_unlock(&TERMINAL_LOG);
-        exit(errno);
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
     }
-    else
+
+    for (int i = 0; i < NUM_WORKERS; i++)
     {
-        pthread_mutex_lock(&TERMINAL_LOG);
-        fprintf(stdout, "Server Listening...\n\n");
-        pthread_mutex_unlock(&TERMINAL_LOG);
+        uint64_t wake = 1;
+        write(WORKERS[i].wake_fd, &wake, sizeof(wake));
     }
 
-    clientConnect(socketFD, serverAddress, addrlen);
-
-    close(socketFD);
-}
-
-void clientConnect(int socketFD, struct sockaddr_in serverAddress, int addrlen)
-{
-    while (1)
+    for (int i = 0; i < NUM_WORKERS; i++)
     {
-        // allocate memory to store the file descriptor of
-        // peer socket, this will be freed inside the thread
-        int *peer_socket = (int *)malloc(sizeof(int));
-
-        pthread_mutex_lock(&TERMINAL_LOG);
-        fprintf(stdout, "Waiting for new connection ...\n");
-        pthread_mutex_unlock(&TERMINAL_LOG);
-
-        // attempt to accept the connection request
-        *peer_socket = accept(socketFD, (struct sockaddr *)&serverAddress, (socklen_t *)&addrlen);
-
-        // handle case if couldn't connect
-        if ((*peer_socket) == -1)
+        if (pthread_timedjoin_np(WORKERS[i].thread, NULL, &deadline))
         {
             pthread_mutex_lock(&TERMINAL_LOG);
-            fprintf(stderr, "Could't connect with the client %d\n", errno);
+            fprintf(stderr, "Error: Worker %d did not drain in time\n", i);
             pthread_mutex_unlock(&TERMINAL_LOG);
-
-            free(peer_socket);
-            continue;
         }
-        pthread_mutex_lock(&TERMINAL_LOG);
-        fprintf(stdout, "Connection established with socket file descriptor %d\n", *peer_socket);
-        pthread_mutex_unlock(&TERMINAL_LOG);
-
-        // connection handling on a different thread
-        pthread_t thread;
-        pthread_create(&thread, NULL, handleConnections, peer_socket);
     }
 }
 
-void evaluatePostfix(char *string)
+void takeoverListeners()
 {
     /**
-     * @brief The function evaluates postfix
-     * expression given in string
-     *
-     * After evaluation, the value is written
-     * to the string itself
-     *
-     * @arg Takes the string as argument
-     * @return void
-     *
+     * @brief fetch the listening sockets and the next client id
+     * from the server running on HANDOFF_PATH. a socket fills the
+     * configured listener with the same address, the ones nobody
+     * asked for are kept as well so no client is refused.
      */
 
-    // check if the string is valid
-    // i.e. the pointer is valid and not null
-    if (!string)
+    struct sockaddr_un handoffAddress = {0};
+    handoffAddress.sun_family = AF_UNIX;
+    strncpy(handoffAddress.sun_path, HANDOFF_PATH, sizeof(handoffAddress.sun_path) - 1);
+
+    int handoffFD = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (handoffFD == -1 || connect(handoffFD, (struct sockaddr *)&handoffAddress, sizeof(handoffAddress)) < 0)
     {
-        strcpy(string, "EMPTY EXPRESSION");
-        return;
+        pthread_mutex_lock(&TERMINAL_LOG);
+        fprintf(stderr, "Error: No running server to take over at %s\n", HANDOFF_PATH);
+        pthread_mutex_unlock(&TERMINAL_LOG);
+        exit(errno);
     }
 
-    // get the length of the string
-    int length = strlen(string);
-
-    // initialize a stack
-    stack *s = makeStack();
+    uint next_id;
+    struct iovec iov = {&next_id, sizeof(next_id)};
 
-    // read through the string
-    int index = 0;
-    char hasFloat = 0;
-    token t;
+    int fds[MAX_LISTENERS];
+    char control[CMSG_SPACE(sizeof(fds))] = {0};
+    struct msghdr message = {0};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
 
-    while (index < length) // read through entire string
+    struct cmsghdr *cmsg;
+    if (recvmsg(handoffFD, &message, 0) != sizeof(next_id) || !(cmsg = CMSG_FIRSTHDR(&message)) ||
+        cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
     {
-        t = nextToken(string, &index);
-        if (t.type == 0 || t.type == 1) // number
-        {
-            hasFloat |= t.type;
-            push(s, atof(t.val));
-        }
-        else if (t.type == 2) // operator
-        {
-            char op = t.val[0];
-            float a, b;
+        pthread_mutex_lock(&TERMINAL_LOG);
+        fprintf(stderr, "Error: Failed to receive the listening sockets\n");
+        pthread_mutex_unlock(&TERMINAL_LOG);
+        exit(EPROTO);
+    }
 
-            if (!s->size) // if stack emtpy
-            {
-                strcpy(string, "INVALID EXPRESSION");
-                return;
-            }
-            b = pop(s);
+    int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+    close(handoffFD);
 
-            if (!s->size) // if stack emtpy
-            {
-                strcpy(string, "INVALID EXPRESSION");
-                return;
-            }
-            a = pop(s);
+    for (int i = 0; i < count; i++)
+    {
+        struct sockaddr_storage address;
+        socklen_t length = sizeof(address);
+        getsockname(fds[i], (struct sockaddr *)&address, &length);
 
-            switch (op) // perform operation on basis of operator type
-            {
-            case '+':
-                a += b;
-                break;
-            case '-':
-                a -= b;
-                break;
-            case '*':
-                a *= b;
-                break;
-            case '/':
-                if (b == 0) // check division by 0
-                {
-                    strcpy(string, "DIVISION BY ZERO");
-                    while (s -> size) pop(s);
-                    return;
-                }
-                a /= b;
-                break;
-            default:
-                strcpy(string, "INVALID EXPRESSION");
-                while (s -> size) pop(s);
-                return;
-            }
+        char name[LISTENER_NAME_LEN];
+        listenerName((struct sockaddr *)&address, name);
 
-            push(s, a);
-        }
-        else // invalid type
-        {
-            strcpy(string, "INVALID EXPRESSION");
-            return;
-        }
-    }
+        listener *l = 0;
+        for (int j = 0; j < NUM_LISTENERS && !l; j++)
+            if (LISTENERS[j].fd == -1 && !strcmp(LISTENERS[j].name, name))
+                l = &LISTENERS[j];
 
-    if (s->size == 1) // if valid postfix expression
-    {
-        float ans = top(s);
-        if (ans == (int)ans && hasFloat == 0) // select output format
+        if (!l && NUM_LISTENERS < MAX_LISTENERS)
         {
-            sprintf(string, "%d", (int)ans);
+            l = &LISTENERS[NUM_LISTENERS++];
+            memset(l, 0, sizeof(listener));
+            l->address = address;
+            l->address_len = length;
+            strcpy(l->name, name);
         }
-        else
+
+        if (!l)
         {
-            sprintf(string, "%f", ans);
+            close(fds[i]);
+            continue;
         }
+        l->fd = fds[i];
+
+        pthread_mutex_lock(&TERMINAL_LOG);
+        fprintf(stdout, "Took over listening socket %s...\n", name);
+        pthread_mutex_unlock(&TERMINAL_LOG);
     }
-    else
-        strcpy(string, "INVALID EXPRESSION");
-    
-    while (s -> size) pop(s); // empty stack
 
-    free(s);
+    // keep client ids unique across the restart
+    NEXT_CLIENT_ID = next_id;
 }
 
-void *handleConnections(void *arg)
+void *handoffListener(void *arg)
 {
     /**
-     * @brief this function serves one of the clients.
-     * It expects input from the client.
-     * And the thread dies out if client stops.
-     *
+     * @brief waits on HANDOFF_PATH for a successor
+     * started with --takeover, passes it the listening
+     * sockets with SCM_RIGHTS and stops this server.
+     * the kernel keeps queueing connections on the shared
+     * sockets meanwhile, so none are refused. accepting
+     * only pauses while the sockets are sent, this server
+     * goes on with them if that fails.
      */
 
-    int start_time = time(NULL);
-
-    // assigning a client id to the client
-    pthread_mutex_lock(&ASSIGN_CLIENT_ID);
-    uint id = NEXT_CLIENT_ID;
-    NEXT_CLIENT_ID++;
-    pthread_mutex_unlock(&ASSIGN_CLIENT_ID);
+    struct sockaddr_un handoffAddress = {0};
+    handoffAddress.sun_family = AF_UNIX;
+    strncpy(handoffAddress.sun_path, HANDOFF_PATH, sizeof(handoffAddress.sun_path) - 1);
 
-    char id_string[1000] = {0};
-    sprintf(id_string, "%u", id);
-
-    char query[MAX_STRING_LEN + 1] = {0};
-
-    int peer_socket = *((int *)arg);
+    int handoffFD = socket(AF_UNIX, SOCK_STREAM, 0);
 
-    // for information exchange
-    char buffer[MAX_STRING_LEN + 1] = {0};
+    // a stale path or the one of the server we took over from
+    unlink(HANDOFF_PATH);
 
-    // sending the client id to client
-    if (send(peer_socket, id_string, sizeof(char) * strlen(id_string), 0) == -1)
+    // only our own user may take the listeners, the path is closed to others before anyone can connect
+    if (handoffFD == -1 || bind(handoffFD, (struct sockaddr *)&handoffAddress, sizeof(handoffAddress)) < 0 ||
+        chmod(HANDOFF_PATH, 0600) == -1 || listen(handoffFD, 1) == -1)
     {
         pthread_mutex_lock(&TERMINAL_LOG);
-        fprintf(stderr, "Error: Couldn't send client id to client %u\n", id);
+        fprintf(stderr, "Error: Restart handoff unavailable on %s\n", HANDOFF_PATH);
         pthread_mutex_unlock(&TERMINAL_LOG);
+        return NULL;
     }
 
-    while (1) // for non-pipelined persistent connection
+    while (1)
     {
-        // clear buffer
-        memset(buffer, 0, MAX_STRING_LEN + 1);
+        int peer = accept(handoffFD, NULL, NULL);
+        if (peer == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
 
-        // read input from client
-        int valread = recv(peer_socket, buffer, MAX_STRING_LEN + 1, 0);
+            // out of descriptors or worse, don't spin on it
+            pthread_mutex_lock(&TERMINAL_LOG);
+            fprintf(stderr, "Error: Couldn't accept a successor on %s %d\n", HANDOFF_PATH, errno);
+            pthread_mutex_unlock(&TERMINAL_LOG);
+            sleep(HANDOFF_RETRY);
+            continue;
+        }
 
-        // if client has shutdown
-        if (valread == 0)
+        // a process of another user is no successor
+        struct ucred peerCred = {0};
+        socklen_t length = sizeof(peerCred);
+        if (getsockopt(peer, SOL_SOCKET, SO_PEERCRED, &peerCred, &length) || peerCred.uid != geteuid())
         {
             pthread_mutex_lock(&TERMINAL_LOG);
-            fprintf(stderr, "Shutting down connection with client %u\n", id);
+            fprintf(stderr, "Error: Refused a takeover by process %d of another user\n", (int)peerCred.pid);
             pthread_mutex_unlock(&TERMINAL_LOG);
-            
-            free(arg);
-            close(peer_socket);
-
-            return NULL;
+            close(peer);
+            continue;
         }
 
-        // store query
-        strcpy(query, buffer);
+        /**
+         * @brief keep our own reference to the listener,
+         * then pause accepting before the successor starts.
+         * every id handed out by this server is assigned by
+         * then, so the successor continues from next_id
+         */
+        int fds[MAX_LISTENERS];
+        int count = NUM_LISTENERS;
+        for (int i = 0; i < count; i++)
+            fds[i] = dup(LISTENERS[i].fd);
+
+        pthread_mutex_lock(&ACCEPT_LOCK);
+        HANDING_OFF = 1;
+        pthread_mutex_unlock(&ACCEPT_LOCK);
+
+        uint64_t wake = 1;
+        write(STOP_FD, &wake, sizeof(wake));
+
+        pthread_mutex_lock(&ACCEPT_LOCK);
+        while (ACCEPTING)
+            pthread_cond_wait(&ACCEPT_STOPPED, &ACCEPT_LOCK);
+        pthread_mutex_unlock(&ACCEPT_LOCK);
+
+        uint next_id = __atomic_load_n(&NEXT_CLIENT_ID, __ATOMIC_RELAXED);
+        struct iovec iov = {&next_id, sizeof(next_id)};
+
+        char control[CMSG_SPACE(sizeof(fds))] = {0};
+        struct msghdr message = {0};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = CMSG_SPACE(count * sizeof(int));
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+
+        int sent = sendmsg(peer, &message, MSG_NOSIGNAL);
+        close(peer);
+        for (int i = 0; i < count; i++)
+            close(fds[i]);
 
-        // evaluate post fix expression in place
-        evaluatePostfix(buffer);
+        pthread_mutex_lock(&TERMINAL_LOG);
+        if (sent == sizeof(next_id))
+            fprintf(stdout, "Listening sockets handed over, stopping...\n");
+        else
+            fprintf(stderr, "Error: Failed to hand the listening sockets over, accepting again\n");
+        pthread_mutex_unlock(&TERMINAL_LOG);
 
-        // log into file
-        pthread_mutex_lock(&FILE_LOG);
-        fprintf(SERVER_RECORDS, "%d %s %s %ld\n", id, query, buffer, time(NULL) - start_time);
-        pthread_mutex_unlock(&FILE_LOG);
+        // the workers drain once the listeners and the handoff path belong to the successor
+        if (sent == sizeof(next_id))
+            stopServer();
 
-        // send back the result
-        if (send(peer_socket, buffer, sizeof(char) * strlen(buffer), 0) == -1)
-        {
-            pthread_mutex_lock(&TERMINAL_LOG);
-            fprintf(stderr, "Error: Couldn't send result to peer %u\n", id);
-            pthread_mutex_unlock(&TERMINAL_LOG);
-            free(arg);
+        pthread_mutex_lock(&ACCEPT_LOCK);
+        __atomic_store_n(&HANDED_OFF, sent == sizeof(next_id), __ATOMIC_RELEASE);
+        HANDING_OFF = 0;
+        pthread_cond_broadcast(&ACCEPT_STOPPED);
+        pthread_mutex_unlock(&ACCEPT_LOCK);
 
-            return NULL;
-        }
+        if (sent == sizeof(next_id))
+            break;
     }
 
-    free(arg);
-    close(peer_socket);
+    close(handoffFD);
 
     return NULL;
 }
 
-token nextToken(char *string, int *index)
+void *adminSignals(void *arg)
 {
     /**
-     * @brief returns the next token starting from
-     * index
+     * @brief waits for admin signals on a dedicated thread
+     * SIGUSR1: print the session table, the listeners, the pinned workers and the record log to stdout
+     * SIGHUP: reload the config file
+     * SIGUSR2: write the trace rings to TRACE_FILE
+     * SIGTERM, SIGINT: drain in-flight work and stop
      */
 
-    while (string[*index] == ' ')
-        (*index)++;
+    sigset_t admin;
+    adminSignalSet(&admin);
 
-    token t;
-    memset(t.val, 0, TOKEN_LENGTH);
-
-    if (string[*index] >= '0' && string[*index] <= '9')
-    {
-        t = nextNumber(string, index);
-    }
-    else if (string[*index] == '+' || string[*index] == '-' || string[*index] == '*' || string[*index] == '/')
-    {
-        t = nextOperator(string, index);
-    }
-    else
+    while (1)
     {
-        t.type = -1;
-    }
+        int sig;
+        if (sigwait(&admin, &sig))
+            continue;
 
-    return t;
-}
+        if (sig == SIGHUP)
+        {
+            configReload();
+            continue;
+        }
 
-token nextNumber(char *string, int *index)
-{
-    /**
-     * @brief reads the next number
-     * starting from index
-     *
-     * assumes that string[index] is a
-     * numeric character
-     */
+        if (sig == SIGUSR2)
+        {
+            traceWrite();
+            continue;
+        }
+
+        if (sig == SIGTERM || sig == SIGINT)
+        {
+            pthread_mutex_lock(&TERMINAL_LOG);
+            fprintf(stdout, "Stopping server...\n");
+            pthread_mutex_unlock(&TERMINAL_LOG);
 
-    token t;
-    t.type = 0;
-    memset(t.val, 0, TOKEN_LENGTH);
+            stopServer();
+            continue;
+        }
 
-    // i stores the index from which next character is to be read
-    int i = (*index);
+        pthread_mutex_lock(&TERMINAL_LOG);
+        fprintf(stdout, "id socket requests bytes_in bytes_out throttled idle_seconds\n");
+        sessionForEach(printSession, NULL);
 
-    // j stores the index at which next character is to be written
-    int j = 0;
+        if (currentTunables()->source_rate > 0)
+        {
+            fprintf(stdout, "source connections throttled\n");
+            sourceForEach(printSource, NULL);
+        }
 
-    // to maintain a check if decimal point has already been encountered
-    char gotDecimalPoint = 0;
+        fprintf(stdout, "listener accepted active accept_errors\n");
+        for (int i = 0; i < NUM_LISTENERS; i++)
+            fprintf(stdout, "%s %lu %lu %lu\n", LISTENERS[i].name,
+                    __atomic_load_n(&LISTENERS[i].accepted, __ATOMIC_RELAXED),
+                    __atomic_load_n(&LISTENERS[i].active, __ATOMIC_RELAXED),
+                    __atomic_load_n(&LISTENERS[i].accept_errors, __ATOMIC_RELAXED));
 
-    // iterate over the string to fetch full number
-    while ((string[i] >= '0' && string[i] <= '9') || string[i] == '.')
-    {
-        if (string[i] == '.')
+        if (CPU_COUNT(&WORKER_CPUS))
         {
-            if (gotDecimalPoint)
-                break;
-            else
-                gotDecimalPoint = 1;
+            fprintf(stdout, "worker cpu node connections steered\n");
+            for (int i = 0; i < NUM_WORKERS; i++)
+                fprintf(stdout, "%d %d %d %lu %lu\n", i, WORKERS[i].cpu, WORKERS[i].node,
+                        __atomic_load_n(&WORKERS[i].handed, __ATOMIC_RELAXED),
+                        __atomic_load_n(&WORKERS[i].steered, __ATOMIC_RELAXED));
+        }
+
+        if (tlsEnabled())
+        {
+            tlsCounters tls;
+            tlsGetCounters(&tls);
+            fprintf(stdout, "tls handshakes %lu resumed %lu ktls %lu failed %lu\n", tls.handshakes, tls.resumed,
+                    tls.kernel, tls.failed);
         }
 
-        t.val[j] = string[i];
-        i++;
-        j++;
+        recordLogCounters records;
+        recordLogGetCounters(&records);
+        fprintf(stdout, "records appended %lu committed %lu fdatasyncs %lu failed %lu\n", records.appended,
+                records.committed, records.commits, records.failed);
+        pthread_mutex_unlock(&TERMINAL_LOG);
     }
 
-    // if decimal point is encountered, change type to float
-    if (gotDecimalPoint)
-        t.type = 1;
+    return NULL;
+}
 
-    // update index to new value
-    *index = i;
+void adminSignalSet(sigset_t *set)
+{
+    /**
+     * @brief the signals handled by adminSignals
+     */
 
-    return t;
+    sigemptyset(set);
+    sigaddset(set, SIGUSR1);
+    sigaddset(set, SIGHUP);
+    sigaddset(set, SIGUSR2);
+    sigaddset(set, SIGTERM);
+    sigaddset(set, SIGINT);
 }
 
-token nextOperator(char *string, int *index)
+void printSession(const session *c, void *arg)
 {
     /**
-     * @brief reads the next operator
-     * starting from index
-     *
-     * assumes that string[index] is an
-     * operator
+     * @brief prints one row of the session table
      */
 
-    token t;
-    t.type = 2;
-    memset(t.val, 0, TOKEN_LENGTH);
+    time_t last_seen = __atomic_load_n(&c->last_seen, __ATOMIC_RELAXED);
 
-    t.val[0] = string[*index];
-    (*index)++;
-
-    return t;
+    fprintf(stdout, "%u %d %lu %lu %lu %lu %ld\n", c->id, c->socket,
+            __atomic_load_n(&c->requests, __ATOMIC_RELAXED),
+            __atomic_load_n(&c->bytes_in, __ATOMIC_RELAXED),
+            __atomic_load_n(&c->bytes_out, __ATOMIC_RELAXED),
+            __atomic_load_n(&c->throttled, __ATOMIC_RELAXED),
+            time(NULL) - last_seen);
 }
+
+void printSource(const source *src, void *arg)
+{
+    /**
+     * @brief prints one client address, called with its shard locked
+     */
+
+    char address[INET6_ADDRSTRLEN];
+    if (IN6_IS_ADDR_V4MAPPED(&src->address))
+        inet_ntop(AF_INET, &src->address.s6_addr[12], address, sizeof(address));
+    else
+        inet_ntop(AF_INET6, &src->address, address, sizeof(address));
+
+    fprintf(stdout, "%s %d %lu\n", address, src->refs, __atomic_load_n(&src->throttled, __ATOMIC_RELAXED));
+}
\ No newline at end of file
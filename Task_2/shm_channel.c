@@ -0,0 +1,373 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include <string.h>
+
+#include "shm_channel.h"
+
+#define RING_MASK (SHM_RING_SIZE - 1)
+
+// function declarations
+static uint32_t recordSize(int len);
+static void copyIn(shmRing *r, uint32_t at, const void *src, int len);
+static void copyOut(shmRing *r, uint32_t at, void *dst, int len);
+static void wakePeer(int fd);
+static void spinPause();
+
+// function definitions
+int ringWrite(shmRing *r, const char *data, int len, int wakeFD)
+{
+    /**
+     * @brief producer side, append one message and
+     * wake the consumer through wakeFD if it sleeps
+     *
+     * @return -1 if the message does not fit right now
+     */
+
+    if (len > SHM_MAX_MESSAGE || !ringFits(r, len))
+        return -1;
+
+    uint32_t head = r->head;
+    uint32_t length = len;
+    copyIn(r, head, &length, sizeof(length));
+    copyIn(r, head + sizeof(length), data, len);
+
+    // publishing head and checking the flag pair up with ringSleepEmpty
+    __atomic_store_n(&r->head, head + recordSize(len), __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&r->consumer_waiting, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&r->consumer_waiting, 0, __ATOMIC_SEQ_CST))
+        wakePeer(wakeFD);
+
+    return 0;
+}
+
+int ringRead(shmRing *r, char *data, int cap, int wakeFD)
+{
+    /**
+     * @brief consumer side, take the oldest message into
+     * data, null terminated, and wake the producer through
+     * wakeFD if it waits for space. the peer can write the
+     * shared memory at will, so nothing read from it is trusted.
+     *
+     * @return its length, -1 if the ring is empty,
+     * -2 if the ring is corrupt or the message exceeds cap
+     */
+
+    uint32_t tail = r->tail;
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint32_t used = head - tail;
+
+    if (!used)
+        return -1;
+
+    uint32_t length;
+    copyOut(r, tail, &length, sizeof(length));
+
+    if (used > SHM_RING_SIZE || length > SHM_MAX_MESSAGE || recordSize(length) > used || length >= (uint32_t)cap)
+        return -2;
+
+    copyOut(r, tail + sizeof(length), data, length);
+    data[length] = 0;
+
+    __atomic_store_n(&r->tail, tail + recordSize(length), __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&r->producer_waiting, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&r->producer_waiting, 0, __ATOMIC_SEQ_CST))
+        wakePeer(wakeFD);
+
+    return length;
+}
+
+int ringFits(shmRing *r, int len)
+{
+    uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST);
+
+    return SHM_RING_SIZE - (r->head - tail) >= recordSize(len);
+}
+
+int ringPending(shmRing *r)
+{
+    // consumer side, a message is waiting
+    return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != r->tail;
+}
+
+int ringCount(shmRing *r)
+{
+    /**
+     * @brief consumer side, the messages waiting.
+     * the count stops where the ring looks corrupt,
+     * ringRead reports that once it gets there
+     */
+
+    uint32_t tail = r->tail;
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    int count = 0;
+
+    if (head - tail > SHM_RING_SIZE)
+        return 0;
+
+    while (tail != head)
+    {
+        uint32_t length;
+        copyOut(r, tail, &length, sizeof(length));
+        if (length > SHM_MAX_MESSAGE || recordSize(length) > head - tail)
+            break;
+
+        tail += recordSize(length);
+        count++;
+    }
+
+    return count;
+}
+
+int ringSleepEmpty(shmRing *r)
+{
+    /**
+     * @brief consumer about to sleep, raise the flag
+     * then look again so a message written meanwhile
+     * is not missed
+     *
+     * @return 1 if the ring is still empty and the
+     * producer will write the eventfd, else 0
+     */
+
+    __atomic_store_n(&r->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) != r->tail)
+    {
+        __atomic_store_n(&r->consumer_waiting, 0, __ATOMIC_SEQ_CST);
+        return 0;
+    }
+
+    return 1;
+}
+
+int ringSleepFull(shmRing *r, int len)
+{
+    /**
+     * @brief producer about to sleep until len fits,
+     * same handshake as ringSleepEmpty
+     */
+
+    __atomic_store_n(&r->producer_waiting, 1, __ATOMIC_SEQ_CST);
+
+    if (ringFits(r, len))
+    {
+        __atomic_store_n(&r->producer_waiting, 0, __ATOMIC_SEQ_CST);
+        return 0;
+    }
+
+    return 1;
+}
+
+shmClient *shmConnect(const char *path)
+{
+    /**
+     * @brief connect to the server's unix socket at path
+     * and move the connection onto a shared memory channel
+     *
+     * @return null if the server refused or is unreachable
+     */
+
+    struct sockaddr_un serverAddress = {0};
+    serverAddress.sun_family = AF_UNIX;
+    strncpy(serverAddress.sun_path, path, sizeof(serverAddress.sun_path) - 1);
+
+    shmClient *c = (shmClient *)calloc(1, sizeof(shmClient));
+    c->socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    c->wake_fd = eventfd(0, EFD_CLOEXEC);
+    c->server_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    int memoryFD = memfd_create("postfix_channel", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+    char buffer[SHM_MAX_MESSAGE + 1] = {0};
+
+    if (c->socket == -1 || c->wake_fd == -1 || c->server_fd == -1 || memoryFD == -1 ||
+        connect(c->socket, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) < 0 ||
+        ftruncate(memoryFD, sizeof(shmChannel)) == -1 ||
+        fcntl(memoryFD, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1)
+        goto fail;
+
+    c->channel = (shmChannel *)mmap(NULL, sizeof(shmChannel), PROT_READ | PROT_WRITE, MAP_SHARED, memoryFD, 0);
+    if (c->channel == MAP_FAILED)
+    {
+        c->channel = 0;
+        goto fail;
+    }
+    c->channel->magic = SHM_MAGIC;
+    c->channel->size = SHM_RING_SIZE;
+
+    // the server opens with the client id
+    if (recv(c->socket, buffer, SHM_MAX_MESSAGE, 0) <= 0)
+        goto fail;
+    c->id = strtoul(buffer, NULL, 10);
+
+    // one byte carries the descriptors: memory, server wake up, our wake up
+    int fds[3] = {memoryFD, c->server_fd, c->wake_fd};
+    struct iovec iov = {"S", 1};
+
+    char control[CMSG_SPACE(sizeof(fds))] = {0};
+    struct msghdr message = {0};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(c->socket, &message, MSG_NOSIGNAL) != 1)
+        goto fail;
+
+    memset(buffer, 0, sizeof(buffer));
+    if (recv(c->socket, buffer, SHM_MAX_MESSAGE, 0) <= 0 || strcmp(buffer, "SHM"))
+        goto fail;
+
+    // the mapping keeps the memory
+    close(memoryFD);
+
+    // spinning only pays off while the server runs on another cpu
+    c->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN : 0;
+
+    return c;
+
+fail:
+    if (memoryFD != -1)
+        close(memoryFD);
+    shmClose(c);
+
+    return NULL;
+}
+
+int shmSubmit(shmClient *c, const char *expression)
+{
+    /**
+     * @brief queue one expression, never blocks
+     *
+     * @return 0 once queued, 1 if the ring is full and
+     * answers have to be received first, -1 if too long
+     */
+
+    int length = strlen(expression);
+    if (length > SHM_MAX_MESSAGE)
+        return -1;
+
+    return ringWrite(&c->channel->requests, expression, length, c->server_fd) ? 1 : 0;
+}
+
+int shmReceive(shmClient *c, char *answer, int cap)
+{
+    /**
+     * @brief wait for the next answer, spinning on the ring
+     * for a while before sleeping on the eventfd
+     *
+     * @return its length, -1 if the server is gone
+     */
+
+    shmRing *responses = &c->channel->responses;
+
+    while (1)
+    {
+        for (int spin = 0; spin <= c->spin; spin++)
+        {
+            int length = ringRead(responses, answer, cap, c->server_fd);
+            if (length >= 0)
+                return length;
+            if (length == -2)
+                return -1;
+
+            spinPause();
+        }
+
+        if (!ringSleepEmpty(responses))
+            continue;
+
+        // the server only writes the socket when it goes away
+        struct pollfd fds[2] = {{c->wake_fd, POLLIN, 0}, {c->socket, POLLIN, 0}};
+        while (poll(fds, 2, -1) == -1 && errno == EINTR)
+            ;
+        if (fds[1].revents)
+            return -1;
+
+        uint64_t wake;
+        read(c->wake_fd, &wake, sizeof(wake));
+    }
+}
+
+int shmEvaluate(shmClient *c, const char *expression, char *answer, int cap)
+{
+    /**
+     * @brief one round trip, only for a client
+     * with nothing else in flight
+     */
+
+    if (shmSubmit(c, expression))
+        return -1;
+
+    return shmReceive(c, answer, cap);
+}
+
+void shmClose(shmClient *c)
+{
+    if (c->channel)
+        munmap(c->channel, sizeof(shmChannel));
+    if (c->socket != -1)
+        close(c->socket);
+    if (c->wake_fd != -1)
+        close(c->wake_fd);
+    if (c->server_fd != -1)
+        close(c->server_fd);
+
+    free(c);
+}
+
+static uint32_t recordSize(int len)
+{
+    return sizeof(uint32_t) + ((len + 3) & ~3);
+}
+
+static void copyIn(shmRing *r, uint32_t at, const void *src, int len)
+{
+    uint32_t offset = at & RING_MASK;
+    int first = len < SHM_RING_SIZE - offset ? len : SHM_RING_SIZE - offset;
+
+    memcpy(r->data + offset, src, first);
+    memcpy(r->data, (const char *)src + first, len - first);
+}
+
+static void copyOut(shmRing *r, uint32_t at, void *dst, int len)
+{
+    uint32_t offset = at & RING_MASK;
+    int first = len < SHM_RING_SIZE - offset ? len : SHM_RING_SIZE - offset;
+
+    memcpy(dst, r->data + offset, first);
+    memcpy((char *)dst + first, r->data, len - first);
+}
+
+static void wakePeer(int fd)
+{
+    uint64_t wake = 1;
+    write(fd, &wake, sizeof(wake));
+}
+
+static void spinPause()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
@@ -0,0 +1,80 @@
+#ifndef SHM_CHANNEL_H
+#define SHM_CHANNEL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SHM_RING_SIZE 65536 // bytes per direction, must be a power of 2
+#define SHM_MAX_MESSAGE 1024
+#define SHM_SPIN 20000 // polls of an empty ring before a client sleeps
+#define SHM_MAGIC 0x50465843 // "CXFP"
+
+/**
+ * @brief shared memory transport for clients on the server's host.
+ *
+ * a client maps a channel into a memfd and passes it, with two
+ * eventfds, to the server over its unix socket connection
+ * (SCM_RIGHTS). requests then go through the requests ring and
+ * answers come back through the responses ring, no system call
+ * is needed while both sides are busy.
+ *
+ * each ring has one producer and one consumer. a side that finds
+ * a ring empty (or full) raises the waiting flag, checks again and
+ * sleeps on its eventfd, the other side only writes the eventfd
+ * when it sees the flag. the unix socket stays open, closing it
+ * ends the channel.
+ */
+
+typedef struct
+{
+    /**
+     * @brief single producer, single consumer byte ring.
+     * messages are a 4 byte length followed by the bytes,
+     * padded to 4 bytes. head and tail only ever grow,
+     * they are taken modulo SHM_RING_SIZE.
+     */
+    uint32_t head __attribute__((aligned(64))); // written by the producer
+    uint32_t producer_waiting;                  // producer sleeps until a message is read
+    uint32_t tail __attribute__((aligned(64))); // written by the consumer
+    uint32_t consumer_waiting;                  // consumer sleeps until a message is written
+    char data[SHM_RING_SIZE] __attribute__((aligned(64)));
+} shmRing;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t size;
+    shmRing requests;  // client to server
+    shmRing responses; // server to client
+} shmChannel;
+
+typedef struct
+{
+    /**
+     * @brief client end of a channel. wake_fd is written
+     * by the server when answers arrive, server_fd is
+     * written by the client when requests arrive.
+     */
+    int socket;
+    int wake_fd;
+    int server_fd;
+    int spin; // ring polls before sleeping, none on a single cpu
+    uint id;
+    shmChannel *channel;
+} shmClient;
+
+int ringWrite(shmRing *r, const char *data, int len, int wakeFD);
+int ringRead(shmRing *r, char *data, int cap, int wakeFD);
+int ringFits(shmRing *r, int len);
+int ringPending(shmRing *r);
+int ringCount(shmRing *r);
+int ringSleepEmpty(shmRing *r);
+int ringSleepFull(shmRing *r, int len);
+
+shmClient *shmConnect(const char *path);
+int shmSubmit(shmClient *c, const char *expression);
+int shmReceive(shmClient *c, char *answer, int cap);
+int shmEvaluate(shmClient *c, const char *expression, char *answer, int cap);
+void shmClose(shmClient *c);
+
+#endif
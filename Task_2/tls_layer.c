@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+
+#include "tls_layer.h"
+
+#ifdef USE_TLS
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+struct tlsSession
+{
+    SSL *ssl;
+    char wants_write; // the last call stopped on a full socket
+};
+
+// global variables
+SSL_CTX *TLS_CONTEXT;
+tlsCounters TLS_COUNTERS;
+
+// function declarations
+static int tlsResult(tlsSession *t, int ret);
+
+// function definitions
+int tlsSetup(const char *cert, const char *key, const char *ticketKeys, long sessionCache)
+{
+    /**
+     * @brief load the certificate chain and key, done once
+     * before the workers start. ticketKeys, if given, names
+     * a file of TLS_TICKET_KEY_LEN random bytes
+     * (> head -c 80 /dev/urandom > tickets.key).
+     * sessionCache caps the tls 1.2 session cache,
+     * 0 keeps OpenSSL's default
+     *
+     * @return -1 with the reason on stderr
+     */
+
+    TLS_CONTEXT = SSL_CTX_new(TLS_server_method());
+    if (!TLS_CONTEXT)
+        return -1;
+
+    SSL_CTX_set_min_proto_version(TLS_CONTEXT, TLS1_2_VERSION);
+
+    // a peer closing without close_notify is a plain end of stream,
+    // kTLS takes over record encryption where the kernel supports it
+    SSL_CTX_set_options(TLS_CONTEXT, SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_ENABLE_KTLS);
+
+    // sendResponse keeps the unsent rest in its own buffer
+    SSL_CTX_set_mode(TLS_CONTEXT, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    // tls 1.2 clients resume from the cache, tls 1.3 ones from tickets
+    SSL_CTX_set_session_id_context(TLS_CONTEXT, (const unsigned char *)TLS_SESSION_CONTEXT,
+                                   sizeof(TLS_SESSION_CONTEXT) - 1);
+    SSL_CTX_set_session_cache_mode(TLS_CONTEXT, SSL_SESS_CACHE_SERVER);
+    if (sessionCache)
+        SSL_CTX_sess_set_cache_size(TLS_CONTEXT, sessionCache);
+
+    if (SSL_CTX_use_certificate_chain_file(TLS_CONTEXT, cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(TLS_CONTEXT, key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(TLS_CONTEXT) != 1)
+    {
+        fprintf(stderr, "Error: Couldn't load the certificate %s and key %s\n", cert, key);
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+
+    if (ticketKeys)
+    {
+        unsigned char keys[TLS_TICKET_KEY_LEN];
+        FILE *file = fopen(ticketKeys, "r");
+        int valid = file && fread(keys, 1, sizeof(keys), file) == sizeof(keys);
+
+        if (file)
+            fclose(file);
+
+        if (!valid || SSL_CTX_set_tlsext_ticket_keys(TLS_CONTEXT, keys, sizeof(keys)) != 1)
+        {
+            fprintf(stderr, "Error: %s must hold %d bytes of ticket keys\n", ticketKeys, TLS_TICKET_KEY_LEN);
+            return -1;
+        }
+    }
+
+    // openssl writes the socket itself, a closed peer must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    return 0;
+}
+
+int tlsEnabled()
+{
+    return TLS_CONTEXT != NULL;
+}
+
+tlsSession *tlsAccept(int fd)
+{
+    /**
+     * @brief server side session on an accepted socket,
+     * the handshake runs in tlsHandshake
+     */
+
+    tlsSession *t = (tlsSession *)calloc(1, sizeof(tlsSession));
+
+    t->ssl = SSL_new(TLS_CONTEXT);
+    if (!t->ssl || SSL_set_fd(t->ssl, fd) != 1)
+    {
+        tlsClose(t);
+        return NULL;
+    }
+    SSL_set_accept_state(t->ssl);
+
+    return t;
+}
+
+int tlsHandshake(tlsSession *t)
+{
+    /**
+     * @brief advance the handshake with whatever the socket has
+     *
+     * @return 1 once done, else -1, errno is EAGAIN while waiting
+     */
+
+    ERR_clear_error();
+    errno = 0;
+    int ret = SSL_do_handshake(t->ssl);
+
+    if (ret != 1)
+    {
+        // still waiting on the socket
+        if (tlsResult(t, ret) == -1 && errno == EAGAIN)
+            return -1;
+
+        // the peer went away or spoke something else than tls
+        __atomic_fetch_add(&TLS_COUNTERS.failed, 1, __ATOMIC_RELAXED);
+        if (errno == EAGAIN)
+            errno = ECONNRESET;
+        return -1;
+    }
+
+    __atomic_fetch_add(&TLS_COUNTERS.handshakes, 1, __ATOMIC_RELAXED);
+    if (SSL_session_reused(t->ssl))
+        __atomic_fetch_add(&TLS_COUNTERS.resumed, 1, __ATOMIC_RELAXED);
+    if (BIO_get_ktls_send(SSL_get_wbio(t->ssl)))
+        __atomic_fetch_add(&TLS_COUNTERS.kernel, 1, __ATOMIC_RELAXED);
+
+    return 1;
+}
+
+int tlsRecv(tlsSession *t, char *buffer, int len)
+{
+    ERR_clear_error();
+    errno = 0;
+    int ret = SSL_read(t->ssl, buffer, len);
+
+    return ret > 0 ? ret : tlsResult(t, ret);
+}
+
+int tlsSend(tlsSession *t, const char *data, int len)
+{
+    if (!len)
+        return 0;
+
+    ERR_clear_error();
+    errno = 0;
+    int ret = SSL_write(t->ssl, data, len);
+
+    return ret > 0 ? ret : tlsResult(t, ret);
+}
+
+int tlsPending(tlsSession *t)
+{
+    /**
+     * @brief decrypted bytes already read off the socket,
+     * epoll won't report them
+     */
+
+    return SSL_pending(t->ssl);
+}
+
+int tlsWantsWrite(tlsSession *t)
+{
+    return t->wants_write;
+}
+
+void tlsClose(tlsSession *t)
+{
+    /**
+     * @brief one attempt at close_notify, the socket is
+     * closed by the caller either way
+     */
+
+    if (t->ssl)
+    {
+        ERR_clear_error();
+        if (SSL_is_init_finished(t->ssl))
+            SSL_shutdown(t->ssl);
+        SSL_free(t->ssl);
+    }
+
+    free(t);
+}
+
+void tlsGetCounters(tlsCounters *counters)
+{
+    counters->handshakes = __atomic_load_n(&TLS_COUNTERS.handshakes, __ATOMIC_RELAXED);
+    counters->resumed = __atomic_load_n(&TLS_COUNTERS.resumed, __ATOMIC_RELAXED);
+    counters->kernel = __atomic_load_n(&TLS_COUNTERS.kernel, __ATOMIC_RELAXED);
+    counters->failed = __atomic_load_n(&TLS_COUNTERS.failed, __ATOMIC_RELAXED);
+}
+
+static int tlsResult(tlsSession *t, int ret)
+{
+    /**
+     * @brief turn a failed openssl call into the socket
+     * convention: 0 at the end of the stream, -1 and errno
+     */
+
+    int error = SSL_get_error(t->ssl, ret);
+    t->wants_write = error == SSL_ERROR_WANT_WRITE;
+
+    switch (error)
+    {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        // errno is cleared before every call, so a stale EAGAIN can't pass for a wait
+        if (!errno)
+            errno = ECONNRESET;
+        return -1;
+    default:
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+#else
+
+// without USE_TLS the listeners stay plaintext
+
+int tlsSetup(const char *cert, const char *key, const char *ticketKeys, long sessionCache)
+{
+    fprintf(stderr, "Error: Built without TLS, compile with -DUSE_TLS -lssl -lcrypto\n");
+    return -1;
+}
+
+int tlsEnabled()
+{
+    return 0;
+}
+
+tlsSession *tlsAccept(int fd)
+{
+    return NULL;
+}
+
+int tlsHandshake(tlsSession *t)
+{
+    errno = EPROTO;
+    return -1;
+}
+
+int tlsRecv(tlsSession *t, char *buffer, int len)
+{
+    errno = EPROTO;
+    return -1;
+}
+
+int tlsSend(tlsSession *t, const char *data, int len)
+{
+    errno = EPROTO;
+    return -1;
+}
+
+int tlsPending(tlsSession *t)
+{
+    return 0;
+}
+
+int tlsWantsWrite(tlsSession *t)
+{
+    return 0;
+}
+
+void tlsClose(tlsSession *t)
+{
+}
+
+void tlsGetCounters(tlsCounters *counters)
+{
+    counters->handshakes = counters->resumed = counters->kernel = counters->failed = 0;
+}
+
+#endif
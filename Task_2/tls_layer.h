@@ -0,0 +1,46 @@
+#ifndef TLS_LAYER_H
+#define TLS_LAYER_H
+
+#define TLS_SESSION_CONTEXT "postfix"
+#define TLS_TICKET_KEY_LEN 80 // name, hmac and aes key of a ticket key file
+
+/**
+ * @brief optional TLS for the server's tcp listeners.
+ *
+ * built with -DUSE_TLS (and -lssl -lcrypto) the layer wraps
+ * non-blocking sockets in OpenSSL sessions, without it every
+ * function is a stub and tlsSetup refuses.
+ *
+ * reconnecting clients resume their session: TLS 1.3 tickets,
+ * and the session cache for TLS 1.2. a ticket key file shared
+ * by two servers keeps tickets valid across --takeover.
+ * where the kernel has the tls module, record encryption is
+ * handed to kTLS once the handshake is done.
+ *
+ * tlsHandshake, tlsRecv and tlsSend behave like their socket
+ * counterparts: -1 with errno EAGAIN while the socket is not
+ * ready, tlsWantsWrite then tells which way to wait.
+ */
+
+typedef struct tlsSession tlsSession;
+
+typedef struct
+{
+    unsigned long handshakes;
+    unsigned long resumed;
+    unsigned long kernel; // sessions sending through kTLS
+    unsigned long failed;
+} tlsCounters;
+
+int tlsSetup(const char *cert, const char *key, const char *ticketKeys, long sessionCache);
+int tlsEnabled();
+tlsSession *tlsAccept(int fd);
+int tlsHandshake(tlsSession *t);
+int tlsRecv(tlsSession *t, char *buffer, int len);
+int tlsSend(tlsSession *t, const char *data, int len);
+int tlsPending(tlsSession *t);
+int tlsWantsWrite(tlsSession *t);
+void tlsClose(tlsSession *t);
+void tlsGetCounters(tlsCounters *counters);
+
+#endif
@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define RING_MASK (TRACE_RING_EVENTS - 1)
+
+typedef struct
+{
+    /**
+     * @brief one span. seq is the event's index + 1 once
+     * it is written and 0 while it is being written, so
+     * traceDump can skip an event overwritten under it
+     */
+    unsigned long seq;
+    unsigned long start; // nanoseconds of CLOCK_MONOTONIC
+    unsigned long end;
+    uint client;
+    int type;
+} traceEvent;
+
+struct traceRing
+{
+    /**
+     * @brief the spans of one worker, head counts
+     * every event ever written. only the worker writes,
+     * traceDump reads from the admin thread
+     */
+    int track;
+    unsigned long head;
+    traceEvent events[TRACE_RING_EVENTS];
+    struct traceRing *next;
+};
+
+// global variables
+static const char *SPAN_NAMES[TRACE_SPAN_TYPES] = {"connection", "read", "query", "evaluate", "records", "send"};
+static traceRing *RINGS;
+static pthread_mutex_t RINGS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+// function definitions
+traceRing *traceRingNew(int track)
+{
+    /**
+     * @brief a ring for the thread shown as track
+     * in the trace, allocated once sampling is on
+     *
+     * @return null without memory
+     */
+
+    traceRing *r = (traceRing *)calloc(1, sizeof(traceRing));
+    if (!r)
+        return NULL;
+    r->track = track;
+
+    pthread_mutex_lock(&RINGS_LOCK);
+    r->next = RINGS;
+    RINGS = r;
+    pthread_mutex_unlock(&RINGS_LOCK);
+
+    return r;
+}
+
+unsigned long traceNow()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+void traceSpan(traceRing *r, int type, uint client, unsigned long start, unsigned long end)
+{
+    unsigned long index = r->head;
+    traceEvent *e = &r->events[index & RING_MASK];
+
+    __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store_n(&e->start, start, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->end, end, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->client, client, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->type, type, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&e->seq, index + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->head, index + 1, __ATOMIC_RELEASE);
+}
+
+int traceDump(const char *path)
+{
+    /**
+     * @brief write every ring to path as Chrome trace json,
+     * timestamps in microseconds. the workers keep tracing
+     * meanwhile, events they overwrite are left out
+     *
+     * @return the events written, -1 if path can't be written
+     */
+
+    FILE *file = fopen(path, "w");
+    if (!file)
+        return -1;
+
+    int pid = getpid();
+    int written = 0;
+
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"server\"}}", pid);
+
+    pthread_mutex_lock(&RINGS_LOCK);
+    for (traceRing *r = RINGS; r; r = r->next)
+    {
+        fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"worker %d\"}}",
+                pid, r->track, r->track);
+
+        unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        unsigned long first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+
+        for (unsigned long i = first; i < head; i++)
+        {
+            traceEvent *e = &r->events[i & RING_MASK];
+
+            unsigned long seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+            traceEvent copy;
+            copy.start = __atomic_load_n(&e->start, __ATOMIC_RELAXED);
+            copy.end = __atomic_load_n(&e->end, __ATOMIC_RELAXED);
+            copy.client = __atomic_load_n(&e->client, __ATOMIC_RELAXED);
+            copy.type = __atomic_load_n(&e->type, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+            // overwritten by the worker while we read it
+            if (seq != i + 1 || __atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq)
+                continue;
+            if (copy.type < 0 || copy.type >= TRACE_SPAN_TYPES)
+                continue;
+
+            // a connection overlaps the requests, it is an async span of its own
+            if (copy.type == TRACE_CONNECTION)
+                fprintf(file,
+                        ",\n{\"name\":\"client %u\",\"cat\":\"connection\",\"ph\":\"b\",\"id\":%u,\"ts\":%.3f,"
+                        "\"pid\":%d,\"tid\":%d},\n{\"name\":\"client %u\",\"cat\":\"connection\",\"ph\":\"e\","
+                        "\"id\":%u,\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+                        copy.client, copy.client, copy.start / 1e3, pid, r->track, copy.client, copy.client,
+                        copy.end / 1e3, pid, r->track);
+            else
+                fprintf(file,
+                        ",\n{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                        "\"pid\":%d,\"tid\":%d,\"args\":{\"client\":%u}}",
+                        SPAN_NAMES[copy.type], copy.start / 1e3, (copy.end - copy.start) / 1e3, pid, r->track,
+                        copy.client);
+            written++;
+        }
+    }
+    pthread_mutex_unlock(&RINGS_LOCK);
+
+    fprintf(file, "\n]}\n");
+
+    int failed = ferror(file);
+    if (fclose(file) || failed)
+        return -1;
+
+    return written;
+}
@@ -0,0 +1,58 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <sys/types.h>
+
+#define TRACE_RING_EVENTS 65536 // per worker, must be a power of 2
+#define TRACE_FILE "server_trace.json"
+
+/**
+ * @brief tracing of the server's request path.
+ *
+ * static tracepoints: built with -DUSE_SDT (needs sys/sdt.h,
+ * from systemtap-sdt-dev) every TRACE_PROBE is a USDT probe
+ * of the provider postfix_server. a probe is a nop until a
+ * tracer attaches, perf, bpftrace and ftrace uprobes
+ * (uprobe_events) all list them. without USE_SDT they are
+ * compiled out.
+ *
+ * trace ring: with sampling on, one of every n reads is
+ * timed through recv, evaluation, the records and send.
+ * every worker writes its spans into a ring of its own,
+ * the oldest are overwritten. traceDump writes all rings
+ * as a Chrome trace (chrome://tracing, ui.perfetto.dev):
+ * one track per worker, connections as async spans.
+ * while sampling is off a span costs one branch.
+ */
+
+#ifdef USE_SDT
+#include <sys/sdt.h>
+#define TRACE_PROBE1(name, a) DTRACE_PROBE1(postfix_server, name, a)
+#define TRACE_PROBE2(name, a, b) DTRACE_PROBE2(postfix_server, name, a, b)
+#define TRACE_PROBE3(name, a, b, c) DTRACE_PROBE3(postfix_server, name, a, b, c)
+#else
+#define TRACE_PROBE1(name, a) ((void)0)
+#define TRACE_PROBE2(name, a, b) ((void)0)
+#define TRACE_PROBE3(name, a, b, c) ((void)0)
+#endif
+
+// what a span measured
+enum
+{
+    TRACE_CONNECTION,
+    TRACE_READ,
+    TRACE_QUERY,
+    TRACE_EVALUATE,
+    TRACE_RECORDS,
+    TRACE_SEND,
+    TRACE_SPAN_TYPES
+};
+
+typedef struct traceRing traceRing;
+
+traceRing *traceRingNew(int track);
+unsigned long traceNow();
+void traceSpan(traceRing *r, int type, uint client, unsigned long start, unsigned long end);
+int traceDump(const char *path);
+
+#endif
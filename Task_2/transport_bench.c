@@ -0,0 +1,170 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <string.h>
+
+#include "shm_channel.h"
+#include "calc_client.h"
+
+#define DEFAULT_ROUNDS 100000
+#define MAX_STRING_LEN 1024
+#define QUERY "1 2 +"
+#define ANSWER "3"
+
+/**
+ * @brief round trip latency of one query at a time over
+ * tcp on loopback, the unix socket and a shared memory
+ * channel, against a server started with --unix PATH
+ *
+ * > gcc -O2 transport_bench.c shm_channel.c -o transport_bench
+ * > ./transport_bench PORT UNIX_PATH [ROUNDS]
+ */
+
+static double elapsedNs(struct timespec start, struct timespec end)
+{
+    return (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+}
+
+static int compareDouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void report(const char *name, double *samples, int rounds, int failed)
+{
+    if (failed)
+    {
+        fprintf(stdout, "%-6s: failed after %d round trips\n", name, failed - 1);
+        return;
+    }
+
+    qsort(samples, rounds, sizeof(double), compareDouble);
+    fprintf(stdout, "%-6s: p50 %8.0f ns  p99 %8.0f ns  max %8.0f ns\n", name,
+            samples[rounds / 2], samples[rounds * 99 / 100], samples[rounds - 1]);
+}
+
+static int socketRoundTrips(int socketFD, double *samples, int rounds)
+{
+    /**
+     * @brief line mode queries on a connected socket
+     *
+     * @return 0, or 1 + the round trips done before a failure
+     */
+
+    char buffer[MAX_STRING_LEN + 1];
+
+    // the server opens with the client id, the hello asks for line mode
+    if (recv(socketFD, buffer, MAX_STRING_LEN, 0) <= 0)
+        return 1;
+    if (send(socketFD, CALC_LINE_HELLO, strlen(CALC_LINE_HELLO), MSG_NOSIGNAL) == -1)
+        return 1;
+
+    for (int i = 0; i < rounds; i++)
+    {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        if (send(socketFD, QUERY "\n", sizeof(QUERY), MSG_NOSIGNAL) != sizeof(QUERY))
+            return i + 1;
+
+        int length = 0;
+        while (!length || buffer[length - 1] != '\n')
+        {
+            int valread = recv(socketFD, buffer + length, MAX_STRING_LEN - length, 0);
+            if (valread <= 0)
+                return i + 1;
+            length += valread;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        samples[i] = elapsedNs(start, end);
+
+        if (strncmp(buffer, ANSWER "\n", length))
+            return i + 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "usage: %s PORT UNIX_PATH [ROUNDS]\n", argv[0]);
+        return 1;
+    }
+
+    int port = atoi(argv[1]);
+    const char *path = argv[2];
+    int rounds = argc > 3 ? atoi(argv[3]) : DEFAULT_ROUNDS;
+    double *samples = (double *)malloc(rounds * sizeof(double));
+
+    // tcp on loopback
+    struct sockaddr_in inetAddress = {0};
+    inetAddress.sin_family = AF_INET;
+    inetAddress.sin_addr.s_addr = inet_addr("127.0.0.1");
+    inetAddress.sin_port = htons(port);
+
+    int socketFD = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    int failed = connect(socketFD, (struct sockaddr *)&inetAddress, sizeof(inetAddress)) < 0
+                     ? 1
+                     : socketRoundTrips(socketFD, samples, rounds);
+    report("tcp", samples, rounds, failed);
+    close(socketFD);
+
+    // unix socket
+    struct sockaddr_un unixAddress = {0};
+    unixAddress.sun_family = AF_UNIX;
+    strncpy(unixAddress.sun_path, path, sizeof(unixAddress.sun_path) - 1);
+
+    socketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+    failed = connect(socketFD, (struct sockaddr *)&unixAddress, sizeof(unixAddress)) < 0
+                 ? 1
+                 : socketRoundTrips(socketFD, samples, rounds);
+    report("unix", samples, rounds, failed);
+    close(socketFD);
+
+    // shared memory channel
+    shmClient *c = shmConnect(path);
+    failed = c ? 0 : 1;
+
+    char answer[MAX_STRING_LEN + 1];
+    for (int i = 0; c && i < rounds; i++)
+    {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        if (shmEvaluate(c, QUERY, answer, sizeof(answer)) < 0 || strcmp(answer, ANSWER))
+        {
+            failed = i + 1;
+            break;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        samples[i] = elapsedNs(start, end);
+    }
+    report("shm", samples, rounds, failed);
+
+    if (c)
+        shmClose(c);
+    free(samples);
+
+    return failed != 0;
+}